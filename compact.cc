@@ -0,0 +1,596 @@
+/* Copyright 2015 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <unordered_map>
+
+#include "granary/arch/instrument.h"
+#include "granary/arch/x86/patch.h"
+#include "granary/arch/x86/xed-intel64.h"
+
+#include "granary/code/cache.h"
+#include "granary/code/index.h"
+#include "granary/code/profile.h"
+
+#ifndef O_LARGEFILE
+# define O_LARGEFILE 0
+#endif
+
+DEFINE_bool(persist, true, "Should the code cache be persisted?");
+
+DEFINE_string(persist_dir, "", "Directory path to where runtime state should "
+                               "be persisted. This should be unique for a "
+                               "given set of binaries.");
+
+DEFINE_string(keep_code_hashes, "", "Comma-separated list of hexadecimal "
+                                    "code hashes. If non-empty, then only the "
+                                    "blocks translated for one of these code "
+                                    "hashes are kept.");
+
+DEFINE_bool(relayout_cache, false, "Re-order the code cache so that hot "
+                                   "blocks are packed together at the "
+                                   "beginning of the cache, and cold and "
+                                   "error blocks are at the end. This "
+                                   "requires a --profile_file.");
+
+DEFINE_string(profile_file, "", "Path to a block execution profile, as "
+                                "recorded by grrplay --profile_file.");
+
+namespace granary {
+namespace {
+
+static const xed_state_t kXEDState64 = {
+    XED_MACHINE_MODE_LONG_64,
+    XED_ADDRESS_WIDTH_64b};
+
+// A `rel32` operand of a branch, or a `disp32` of a RIP-relative memory
+// operand, in the code cache.
+struct Fixup {
+  int64_t rel32_offset;
+
+  // Offset of the next instruction, to which `rel32` is relative.
+  int64_t next_offset;
+
+  // Offset of the branch target, or of the memory location. Targets outside
+  // of the code cache are in the instrumentation page, which sits just before
+  // the code cache.
+  int64_t target;
+};
+
+// A contiguous range of the code cache that is either kept or dropped as a
+// whole. This is a block (possibly a superblock), or any bytes that precede
+// the first block.
+struct Unit {
+  int64_t begin;
+  int64_t end;  // Excludes any trailing padding.
+  int64_t new_begin;
+
+  // Range of `gFixups` for the branches in this unit.
+  size_t first_fixup;
+  size_t last_fixup;
+
+  // Range of `gCounterRefs` for the block execution counters used by this
+  // unit.
+  size_t first_counter_ref;
+  size_t last_counter_ref;
+
+  // Number of times that the blocks whose index entries refer to this unit
+  // were executed.
+  uint64_t count;
+
+  bool is_block;
+  bool is_error;
+  bool is_live;
+  bool is_placed;
+};
+
+// Every block in the old code cache, in cache order.
+static std::vector<Unit> gUnits;
+
+// Every branch in the old code cache, in cache order.
+static std::vector<Fixup> gFixups;
+
+// Offsets of the `disp32`s of memory operands that address block execution
+// counters. Counters are indexed by the cache offsets of their blocks, so
+// these move along with their blocks.
+static std::vector<int64_t> gCounterRefs;
+
+// Code hashes whose blocks should be kept. Empty means keep everything.
+static std::set<uint32_t> gKeepCodeHashes;
+
+// Parse the `--keep_code_hashes` list.
+static void ParseCodeHashes(void) {
+  std::stringstream ss(FLAGS_keep_code_hashes);
+  for (std::string hash; std::getline(ss, hash, ','); ) {
+    if (!hash.empty()) {
+      gKeepCodeHashes.insert(static_cast<uint32_t>(
+          std::stoul(hash, nullptr, 16)));
+    }
+  }
+}
+
+// Returns `true` if the block with key `key` should be kept.
+static bool KeepKey(index::Key key) {
+  return gKeepCodeHashes.empty() || gKeepCodeHashes.count(key.code_hash);
+}
+
+// Begin a new unit.
+static void AddUnit(int64_t offset, bool is_block) {
+  if (gUnits.empty() || gUnits.back().begin != offset) {
+    gUnits.push_back({offset, offset, 0, gFixups.size(), gFixups.size(),
+                      gCounterRefs.size(), gCounterRefs.size(), 0,
+                      false, false, false, false});
+  }
+  gUnits.back().is_block = is_block;
+}
+
+// Returns the offset of the block entry to which `val` refers.
+static int64_t CacheOffsetOf(index::Value val) {
+  return static_cast<int64_t>(val.cache_offset * index::kCacheOffsetScale);
+}
+
+// Returns the displacement of the execution counter of the block at `offset`
+// from the beginning of the counters.
+static int64_t CounterDisp(int64_t offset) {
+  return (offset / index::kCacheOffsetScale) *
+         static_cast<int64_t>(sizeof(uint64_t));
+}
+
+// Returns `true` if the instruction at `offset` is the `MOV r14, imm64` that
+// begins a block. The immediate is the block's `index::Value`, which records
+// the offset of the block itself.
+static bool IsBlockEntry(const uint8_t *cache, int64_t offset, unsigned len) {
+  if (10 != len || (offset % 8)) return false;
+  if (0x49 != cache[offset] || 0xBE != cache[offset + 1]) return false;
+  index::Value val;
+  memcpy(&(val.value), &(cache[offset + 2]), sizeof val.value);
+  return offset == CacheOffsetOf(val);
+}
+
+// Splits the code cache into blocks by decoding every instruction in it.
+// Blocks, including superblocks, begin with a `MOV r14, imm64`. A block's
+// execution counter is addressed by a `disp32` off of the register into which
+// the block loads the pointer to the counters.
+static bool SplitCache(const uint8_t *cache, int64_t size) {
+  const auto counters_offset = arch::InstrumentationDataOffset(
+      arch::kInstrumentationDataBlockCounters);
+  xed_decoded_inst_t xedd;
+  auto counters_reg = XED_REG_INVALID;
+
+  AddUnit(0, false);
+  for (int64_t offset = 0; offset < size; ) {
+    auto max_len = static_cast<unsigned>(std::min<int64_t>(15, size - offset));
+    xed_decoded_inst_zero_set_mode(&xedd, &kXEDState64);
+    if (XED_ERROR_NONE != xed_decode(&xedd, &(cache[offset]), max_len)) {
+      std::cerr << "Unable to decode code cache at offset "
+                << std::hex << offset << std::endl;
+      return false;
+    }
+
+    auto len = xed_decoded_inst_get_length(&xedd);
+    auto iclass = xed_decoded_inst_get_iclass(&xedd);
+    auto next_offset = offset + len;
+
+    if (IsBlockEntry(cache, offset, len)) {
+      index::Value val;
+      memcpy(&(val.value), &(cache[offset + 2]), sizeof val.value);
+      AddUnit(offset, true);
+      gUnits.back().is_error = val.ends_with_error;
+      counters_reg = XED_REG_INVALID;
+    }
+
+    if (4 == xed_decoded_inst_get_branch_displacement_width(&xedd)) {
+      auto target = next_offset +
+                    xed_decoded_inst_get_branch_displacement(&xedd);
+      if (target >= size ||
+          target < -static_cast<int64_t>(os::kPageSize)) {
+        std::cerr << "Branch at offset " << std::hex << offset
+                  << " targets uncommitted code." << std::endl;
+        return false;
+      }
+      gFixups.push_back({next_offset - 4, next_offset, target});
+      gUnits.back().last_fixup = gFixups.size();
+    }
+
+    if (xed_decoded_inst_number_of_memory_operands(&xedd) &&
+        4 == xed_decoded_inst_get_memory_displacement_width(&xedd, 0)) {
+      auto base = xed_decoded_inst_get_base_reg(&xedd, 0);
+      auto disp = xed_decoded_inst_get_memory_displacement(&xedd, 0);
+      auto disp_offset = next_offset - 4 -
+                         xed_decoded_inst_get_immediate_width(&xedd);
+
+      if (XED_REG_RIP == base) {
+        auto target = next_offset + disp;
+        if (target >= size ||
+            target < -static_cast<int64_t>(os::kPageSize)) {
+          std::cerr << "Memory operand at offset " << std::hex << offset
+                    << " addresses data outside of the code cache."
+                    << std::endl;
+          return false;
+        }
+        gFixups.push_back({disp_offset, next_offset, target});
+        gUnits.back().last_fixup = gFixups.size();
+        counters_reg = XED_REG_INVALID;
+        if (counters_offset == target && XED_ICLASS_MOV == iclass) {
+          counters_reg = xed_decoded_inst_get_reg(&xedd, XED_OPERAND_REG0);
+        }
+
+      } else if (XED_REG_INVALID != counters_reg && counters_reg == base &&
+                 gUnits.back().is_block &&
+                 CounterDisp(gUnits.back().begin) == disp) {
+        gCounterRefs.push_back(disp_offset);
+        gUnits.back().last_counter_ref = gCounterRefs.size();
+      }
+    }
+
+    if (XED_ICLASS_INT3 != iclass) gUnits.back().end = next_offset;
+    offset = next_offset;
+  }
+  return true;
+}
+
+// Returns the unit that contains `offset`.
+static Unit *FindUnit(int64_t offset) {
+  auto it = std::upper_bound(
+      gUnits.begin(), gUnits.end(), offset,
+      [] (int64_t offset, const Unit &unit) { return offset < unit.begin; });
+  GRANARY_ASSERT(gUnits.begin() != it);
+  return &*(--it);
+}
+
+// Returns the new offset of some old offset in a live unit.
+static int64_t Relocate(int64_t offset) {
+  auto unit = FindUnit(offset);
+  GRANARY_ASSERT(unit->is_live);
+  return unit->new_begin + (offset - unit->begin);
+}
+
+// Marks the unit containing `offset`, and everything reachable from it, as
+// live.
+static void MarkLive(int64_t offset) {
+  std::vector<Unit *> work_list;
+  work_list.push_back(FindUnit(offset));
+  while (!work_list.empty()) {
+    auto unit = work_list.back();
+    work_list.pop_back();
+    if (unit->is_live) continue;
+    unit->is_live = true;
+    for (auto i = unit->first_fixup; i < unit->last_fixup; ++i) {
+      if (0 <= gFixups[i].target) {
+        work_list.push_back(FindUnit(gFixups[i].target));
+      }
+    }
+  }
+}
+
+// Attributes the execution counts in the profile to the units that the index
+// entries of the profiled blocks refer to.
+static void ReadProfile(void) {
+  std::unordered_map<uint64_t, uint64_t> counts;
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto fd = open(FLAGS_profile_file.c_str(), O_RDONLY | O_CLOEXEC);
+  GRANARY_ASSERT(!errno && "Unable to open the profile file.");
+  code::BlockProfileEntry entry;
+  while (static_cast<ssize_t>(sizeof entry) == read(fd, &entry, sizeof entry)) {
+    counts[entry.key.key] += entry.count;
+  }
+  close(fd);
+
+  index::Rewrite([&] (index::Key key, index::Value &val) {
+    auto count = counts.find(key.key);
+    if (counts.end() != count) {
+      auto unit = FindUnit(CacheOffsetOf(val));
+      if (unit->is_live) unit->count += count->second;
+    }
+  });
+}
+
+// Places `unit`, followed by its successors. Successors are only followed
+// through hot units.
+static void PlaceHot(std::vector<Unit *> &order, Unit *unit) {
+  std::vector<Unit *> work_list;
+  work_list.push_back(unit);
+  while (!work_list.empty()) {
+    unit = work_list.back();
+    work_list.pop_back();
+    if (unit->is_placed) continue;
+    unit->is_placed = true;
+    order.push_back(unit);
+    if (!unit->count && unit->is_block) continue;
+
+    // Push in reverse so that the first branch target is placed first.
+    for (auto i = unit->last_fixup; i-- > unit->first_fixup; ) {
+      if (0 > gFixups[i].target) continue;
+      auto succ = FindUnit(gFixups[i].target);
+      if (succ->is_live && !succ->is_placed && !succ->is_error) {
+        work_list.push_back(succ);
+      }
+    }
+  }
+}
+
+// Orders the live units. By default, the existing order is kept. When
+// re-laying out the cache, hot units come first (hottest first, each followed
+// by its successors), then cold units, and finally error blocks.
+static std::vector<Unit *> OrderCache(void) {
+  std::vector<Unit *> order;
+  if (!FLAGS_relayout_cache) {
+    for (auto &unit : gUnits) {
+      if (unit.is_live) order.push_back(&unit);
+    }
+    return order;
+  }
+
+  std::vector<Unit *> hot;
+  for (auto &unit : gUnits) {
+    if (unit.is_live && unit.count && !unit.is_error) hot.push_back(&unit);
+  }
+  std::stable_sort(hot.begin(), hot.end(), [] (Unit *a, Unit *b) {
+    return a->count > b->count;
+  });
+  for (auto unit : hot) PlaceHot(order, unit);
+
+  for (auto &unit : gUnits) {
+    if (unit.is_live && !unit.is_placed && !unit.is_error) {
+      unit.is_placed = true;
+      order.push_back(&unit);
+    }
+  }
+  for (auto &unit : gUnits) {
+    if (unit.is_live && !unit.is_placed) order.push_back(&unit);
+  }
+  return order;
+}
+
+// Assigns new offsets to all live units. Blocks stay aligned to 8 bytes.
+static int64_t LayoutCache(const std::vector<Unit *> &order) {
+  int64_t new_size = 0;
+  for (auto unit : order) {
+    new_size = (new_size + 7) & ~7LL;
+    unit->new_begin = new_size;
+    new_size += unit->end - unit->begin;
+  }
+  return new_size;
+}
+
+// Copies all live units into the new code cache, and fixes up their branches,
+// RIP-relative memory operands, block execution counters, and block IDs.
+static std::vector<uint8_t> RelocateCache(const uint8_t *cache,
+                                          int64_t new_size) {
+  std::vector<uint8_t> new_cache(static_cast<size_t>(new_size), 0xCC);
+  for (const auto &unit : gUnits) {
+    if (!unit.is_live) continue;
+    auto new_unit = &(new_cache[static_cast<size_t>(unit.new_begin)]);
+    memcpy(new_unit, &(cache[unit.begin]),
+           static_cast<size_t>(unit.end - unit.begin));
+
+    for (auto i = unit.first_fixup; i < unit.last_fixup; ++i) {
+      const auto &fixup = gFixups[i];
+      auto new_rel32_offset = unit.new_begin +
+                              (fixup.rel32_offset - unit.begin);
+      auto new_target = 0 <= fixup.target ? Relocate(fixup.target)
+                                          : fixup.target;
+      auto new_next_offset = unit.new_begin +
+                             (fixup.next_offset - unit.begin);
+      auto rel32 = static_cast<CacheOffset>(new_target - new_next_offset);
+      memcpy(&(new_cache[static_cast<size_t>(new_rel32_offset)]), &rel32,
+             sizeof rel32);
+    }
+
+    for (auto i = unit.first_counter_ref; i < unit.last_counter_ref; ++i) {
+      auto new_disp_offset = unit.new_begin + (gCounterRefs[i] - unit.begin);
+      auto disp = static_cast<int32_t>(CounterDisp(unit.new_begin));
+      memcpy(&(new_cache[static_cast<size_t>(new_disp_offset)]), &disp,
+             sizeof disp);
+    }
+
+    if (unit.is_block) {
+      index::Value val;
+      memcpy(&(val.value), &(new_unit[2]), sizeof val.value);
+      val.cache_offset = static_cast<uint32_t>(
+          unit.new_begin / index::kCacheOffsetScale);
+      memcpy(&(new_unit[2]), &(val.value), sizeof val.value);
+    }
+  }
+  return new_cache;
+}
+
+// Keeps the patch points of all live units that haven't yet been patched.
+static std::vector<arch::PatchPoint> RelocatePatchPoints(const uint8_t *cache,
+                                                         int64_t size,
+                                                         const char *path) {
+  std::vector<arch::PatchPoint> patches;
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto fd = open(path, O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+  if (-1 == fd) {
+    GRANARY_IF_ASSERT( errno = 0; )
+    return patches;
+  }
+
+  arch::PatchPoint patch;
+  while (static_cast<ssize_t>(sizeof patch) == read(fd, &patch, sizeof patch)) {
+    if (!patch.target) continue;
+    if (0 > patch.patch_offset || (patch.patch_offset + 4) > size) continue;
+    int32_t rel32 = 0;
+    memcpy(&rel32, &(cache[patch.patch_offset]), sizeof rel32);
+    if (rel32 || !FindUnit(patch.patch_offset)->is_live) continue;
+    patch.patch_offset = static_cast<CacheOffset>(
+        Relocate(patch.patch_offset));
+    patches.push_back(patch);
+  }
+  close(fd);
+  return patches;
+}
+
+// Writes out `size` bytes of `data` to the file `path`. The file is at least
+// `min_size` bytes long.
+static void WriteFile(const char *path, const void *data, size_t size,
+                      size_t min_size) {
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC |
+                       O_LARGEFILE, 0666);
+  GRANARY_ASSERT(!errno && "Unable to open compacted file.");
+  auto written = write(fd, data, size);
+  GRANARY_ASSERT(!errno && size == static_cast<size_t>(written) &&
+                 "Unable to write compacted file.");
+  GRANARY_UNUSED(written);
+  if (size < min_size) {
+    ftruncate(fd, static_cast<off_t>(min_size));
+    GRANARY_ASSERT(!errno && "Unable to resize compacted file.");
+  }
+  fsync(fd);
+  close(fd);
+}
+
+// Maps the segments of the code cache back-to-back, just as `grrplay` does.
+// Returns the size of the code cache, which is zero if there is no code cache
+// to compact.
+static int64_t MapCache(uint8_t *cache) {
+  // Anything beyond the committed size isn't reachable from the index.
+  auto committed_size = static_cast<int64_t>(index::CommittedCacheSize());
+  int64_t size = 0;
+  for (size_t segment = 0; segment < cache::kMaxNumSegments; ++segment) {
+    auto segment_begin = static_cast<int64_t>(segment * cache::kSegmentSize);
+    if (segment_begin >= committed_size) break;
+
+    char path[256];
+    cache::SegmentPath(path, FLAGS_persist_dir.c_str(), segment);
+    GRANARY_IF_ASSERT( errno = 0; )
+    auto fd = open(path, O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    if (-1 == fd) break;
+
+    struct stat info;
+    fstat(fd, &info);
+    GRANARY_ASSERT(!errno && "Could stat code cache segment.");
+    auto segment_size = std::min<int64_t>(
+        static_cast<int64_t>(cache::kSegmentSize),
+        std::min<int64_t>(info.st_size, committed_size - segment_begin));
+    if (segment_size) {
+      mmap(&(cache[segment_begin]), static_cast<size_t>(segment_size),
+           PROT_READ, MAP_FIXED | MAP_PRIVATE, fd, 0);
+      GRANARY_ASSERT(!errno && "Unable to map code cache segment.");
+    }
+    close(fd);
+
+    size = segment_begin + segment_size;
+    if (static_cast<int64_t>(cache::kSegmentSize) != segment_size) break;
+  }
+  GRANARY_IF_ASSERT( errno = 0; )
+  return size;
+}
+
+// Compacts the code cache. Returns `false` if the code cache can't be
+// compacted.
+static bool CompactCache(void) {
+  char path[256 + 16];
+
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto cache = reinterpret_cast<uint8_t *>(mmap(
+      nullptr, cache::kMaxCacheSize, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+  GRANARY_ASSERT(!errno && "Unable to map address space for code cache.");
+
+  auto size = MapCache(cache);
+  if (!size) {
+    munmap(cache, cache::kMaxCacheSize);
+    std::cerr << "No code cache to compact." << std::endl;
+    return true;
+  }
+
+  if (!SplitCache(cache, size)) {
+    munmap(cache, cache::kMaxCacheSize);
+    return false;
+  }
+
+  // The roots of the code cache are the blocks in the index.
+  index::Rewrite([=] (index::Key key, index::Value &val) {
+    if (KeepKey(key) && CacheOffsetOf(val) < size) {
+      MarkLive(CacheOffsetOf(val));
+    }
+  });
+
+  if (FLAGS_relayout_cache) ReadProfile();
+  auto new_size = LayoutCache(OrderCache());
+  auto new_cache = RelocateCache(cache, new_size);
+
+  sprintf(path, "%s/grr.patch.persist", FLAGS_persist_dir.c_str());
+  auto patches = RelocatePatchPoints(cache, size, path);
+
+  index::Rewrite([=] (index::Key key, index::Value &val) {
+    if (!KeepKey(key) || CacheOffsetOf(val) >= size ||
+        !FindUnit(CacheOffsetOf(val))->is_live) {
+      val = index::Value();
+    } else {
+      val.cache_offset = static_cast<uint32_t>(
+          Relocate(CacheOffsetOf(val)) / index::kCacheOffsetScale);
+    }
+  });
+
+  for (size_t segment_begin = 0; segment_begin < new_cache.size();
+       segment_begin += cache::kSegmentSize) {
+    cache::SegmentPath(path, FLAGS_persist_dir.c_str(),
+                       segment_begin / cache::kSegmentSize);
+    strcat(path, ".compact");
+    WriteFile(path, &(new_cache[segment_begin]),
+              std::min<size_t>(cache::kSegmentSize,
+                               new_cache.size() - segment_begin), 0);
+  }
+
+  sprintf(path, "%s/grr.patch.persist.compact", FLAGS_persist_dir.c_str());
+  WriteFile(path, patches.data(), patches.size() * sizeof(arch::PatchPoint),
+            os::kPageSize);
+
+  index::Replace(static_cast<size_t>(new_size));
+
+  auto num_live = std::count_if(gUnits.begin(), gUnits.end(),
+                                [] (const Unit &unit) { return unit.is_live; });
+  std::cout << "Kept " << std::dec << num_live << " of " << gUnits.size()
+            << " blocks; compacted the code cache from " << size
+            << " to " << new_size << " bytes." << std::endl;
+
+  munmap(cache, cache::kMaxCacheSize);
+  return true;
+}
+
+}  // namespace
+}  // namespace granary
+
+extern "C" int main(int argc, char **argv, char **) {
+  using namespace granary;
+  google::SetUsageMessage(std::string(argv[0]) + " [options]");
+  google::ParseCommandLineFlags(&argc, &argv, false);
+
+  if (FLAGS_persist_dir.empty()) {
+    std::cerr << "Must provide a unique path to a directory where the "
+              << "runtime state can be persisted." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (FLAGS_relayout_cache && FLAGS_profile_file.empty()) {
+    std::cerr << "Must provide a --profile_file to re-layout the code cache."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  ParseCodeHashes();
+  xed_tables_init();
+  index::Init(index::kAnyFeatures);
+  auto compacted = CompactCache();
+  index::Exit();
+
+  return compacted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -3,7 +3,11 @@
 #include <gflags/gflags.h>
 
 #include <iostream>
+#include <memory>
+#include <queue>
+#include <vector>
 
+#include "granary/code/coverage_file.h"
 #include "granary/code/index.h"
 
 DEFINE_bool(persist, true, "Should the code cache be persisted?");
@@ -12,10 +16,120 @@ DEFINE_string(persist_dir, "", "Directory path to where runtime state should "
                                "be persisted. This should be unique for a "
                                "given set of binaries.");
 
+DEFINE_bool(compact_index, false, "Fold the code cache index journal into a "
+                                  "new index file. This must not be done "
+                                  "while grrplay is using the index.");
+
+DEFINE_string(output_coverage_file, "", "File name in which to save the "
+                                        "merged code coverage data.");
+
+DEFINE_bool(compress_coverage_file, true,
+            "Delta-encode the paths in the merged coverage file.");
+
+namespace {
+
+// Merges the edge buckets of all coverage files.
+static void MergeEdgeCoverage(
+    std::vector<std::unique_ptr<granary::code::CoverageFileReader>> &readers,
+    granary::code::CoverageFileWriter &writer) {
+  using namespace granary::code;
+  std::vector<uint8_t> buckets(readers[0]->NumEdgeBuckets());
+  for (auto &reader : readers) {
+    GRANARY_ASSERT(buckets.size() == reader->NumEdgeBuckets() &&
+                   "Can't merge edge bitmaps of different sizes.");
+    auto reader_buckets = reader->EdgeBuckets();
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      buckets[i] |= reader_buckets[i];
+    }
+  }
+  writer.AddEdgeBuckets(buckets.data(), buckets.size());
+}
+
+// Merges the paths of all coverage files in one pass, by repeatedly taking
+// the smallest next path of any coverage file. The writer keeps the biggest
+// count of paths that are in many coverage files.
+static void MergePathCoverage(
+    std::vector<std::unique_ptr<granary::code::CoverageFileReader>> &readers,
+    granary::code::CoverageFileWriter &writer) {
+  using namespace granary::code;
+  typedef std::pair<CoverageRecord, size_t> NextRecord;
+  auto greater = [] (const NextRecord &a, const NextRecord &b) {
+    return b.first < a.first;
+  };
+  std::priority_queue<NextRecord, std::vector<NextRecord>, decltype(greater)>
+      next_records(greater);
+
+  for (size_t i = 0; i < readers.size(); ++i) {
+    CoverageRecord record;
+    if (readers[i]->Next(&record)) {
+      next_records.push({record, i});
+    }
+  }
+
+  while (!next_records.empty()) {
+    auto next = next_records.top();
+    next_records.pop();
+    writer.Add(next.first);
+    if (readers[next.second]->Next(&(next.first))) {
+      next_records.push(next);
+    }
+  }
+}
+
+// Merges the coverage files named by `argv` into `--output_coverage_file`.
+static int MergeCoverage(int argc, char **argv) {
+  using namespace granary::code;
+  if (FLAGS_output_coverage_file.empty()) {
+    std::cerr << "Must provide an output coverage file." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<std::unique_ptr<CoverageFileReader>> readers;
+  for (auto i = 0; i < argc; ++i) {
+    std::unique_ptr<CoverageFileReader> reader(new CoverageFileReader);
+    if (!reader->Open(argv[i])) {
+      continue;  // Missing or empty.
+    }
+    if (!readers.empty() && reader->Kind() != readers[0]->Kind()) {
+      std::cerr << "Can't merge path and edge coverage files." << std::endl;
+      return EXIT_FAILURE;
+    }
+    readers.push_back(std::move(reader));
+  }
+
+  if (readers.empty()) {
+    std::cerr << "No coverage files to merge." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  auto kind = readers[0]->Kind();
+  CoverageFileWriter writer;
+  writer.Open(FLAGS_output_coverage_file.c_str(), kind,
+              FLAGS_compress_coverage_file);
+  if (kCoverageFileEdgeBuckets == kind) {
+    MergeEdgeCoverage(readers, writer);
+  } else {
+    MergePathCoverage(readers, writer);
+  }
+  if (!writer.Close()) {
+    std::cerr << "Unable to write " << FLAGS_output_coverage_file
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
 extern "C" int main(int argc, char **argv, char **) {
   using namespace granary;
-  google::SetUsageMessage(std::string(argv[0]) + " [options]");
-  google::ParseCommandLineFlags(&argc, &argv, false);
+  google::SetUsageMessage(
+      std::string(argv[0]) + " [options] [merge coverage_file...]");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (2 <= argc && std::string("merge") == argv[1]) {
+    return MergeCoverage(argc - 2, &(argv[2]));
+  }
 
   if (FLAGS_persist_dir.empty()) {
     std::cerr << "Must provide a unique path to a directory where the "
@@ -23,9 +137,15 @@ extern "C" int main(int argc, char **argv, char **) {
     return EXIT_FAILURE;
   }
 
-  index::Init();
+  index::Init(index::kAnyFeatures);
+
+  if (FLAGS_compact_index) {
+    index::Compact();
+  } else {
+    index::Dump();
+  }
 
-  index::Dump();
+  index::Exit();
 
   return EXIT_SUCCESS;
 }
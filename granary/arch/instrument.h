@@ -10,12 +10,34 @@
 namespace granary {
 namespace arch {
 
+// Data outside of the code cache that is used by translated code. Translated
+// code only reaches this data through pointers at the end of the
+// instrumentation page, which always directly precedes the code cache. This
+// keeps the code cache independent of where the `grr` binary is loaded.
+enum InstrumentationData {
+  kInstrumentationDataBlockCounters,
+  kInstrumentationDataEdgeBitmap,
+  kNumInstrumentationData
+};
+
+// Returns the offset of the pointer to `data`, relative to the beginning of
+// the code cache.
+inline int64_t InstrumentationDataOffset(InstrumentationData data) {
+  return (static_cast<int64_t>(data) -
+          static_cast<int64_t>(kNumInstrumentationData)) *
+         static_cast<int64_t>(sizeof(void *));
+}
+
 // Initialize instrumentation routines for use within basic blocks.
 void InitInstrumentationFunctions(CachePC instrument_section);
 
 // Returns the location in the code cache of where this instrumentation
 // function is.
-CachePC GetInstrumentationFunction(code::InstrumentationPoint loc);
+CachePC GetInstrumentationFunction(code::InstrumentationPoint loc,
+                                   bool aflags_dead=false);
+
+// Returns the location in the instrumentation page of the pointer to `data`.
+const void *GetInstrumentationData(InstrumentationData data);
 
 }  // namespace arch
 }  // namespace granary
@@ -2,6 +2,10 @@
 
 #include "granary/base/base.h"
 
+#include "granary/code/index.h"
+
+#include <vector>
+
 #ifndef GRANARY_ARCH_PATCH_H_
 #define GRANARY_ARCH_PATCH_H_
 
@@ -11,6 +15,30 @@ namespace arch {
 void InitPatcher(void);
 void ExitPatcher(void);
 
+// Links the persisted patch points whose targets are already translated.
+//
+// Note: This must be invoked after the code cache is initialized.
+void LinkPersistedPatchPoints(void);
+
+// Links the jumps in committed code whose targets were translated since the
+// previous commit. Linking these jumps is deferred to the next commit, so
+// that a persisted jump never targets uncommitted code.
+//
+// Note: This must be invoked right after the code cache is committed.
+void LinkCommittedPatchPoints(void);
+
+// Links the jumps that are waiting on `key`, where `key` was found in a shared
+// index. Another process might have translated `key`, in which case this
+// process never saw it being inserted, and so never linked the jumps.
+void LinkSharedPatchPoints(index::Key key, index::Value val);
+
+// Saves the patch points that are waiting on their targets into `data`, and
+// later replaces the waiting patch points with saved ones, e.g. so that a
+// fork server child can send them back to its parent. Restored patch points
+// are linked if their targets are already translated.
+void CheckpointPatchPoints(std::vector<uint8_t> *data);
+void RestorePatchPoints(const std::vector<uint8_t> &data);
+
 }  // namespace arch
 }  // namespace granary
 
@@ -30,6 +30,12 @@
 #define GRANARY_ABI_ADDR32 XED_REG_R12D
 #define GRANARY_ABI_ADDR64 XED_REG_R12
 
+// Scratch register for storing the address of an entry on the process's
+// shadow stack. This is also scratch for inline instrumentation.
+#define GRANARY_ABI_SHADOW8 XED_REG_R13B
+#define GRANARY_ABI_SHADOW32 XED_REG_R13D
+#define GRANARY_ABI_SHADOW64 XED_REG_R13
+
 // The process structure for saving/restoring things.
 #define GRANARY_ABI_PROCESS64 XED_REG_R15
 
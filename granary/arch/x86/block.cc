@@ -7,6 +7,8 @@
 
 #include "granary/code/block.h"
 #include "granary/code/cache.h"
+#include "granary/code/coverage.h"
+#include "granary/code/profile.h"
 
 #include "granary/arch/instrument.h"
 
@@ -32,9 +34,49 @@ struct PatchPoint {
 static PatchPoint gBranchTaken = {0, nullptr};
 static PatchPoint gBranchNotTaken = {0, nullptr};
 
-// Inject an instrumentation function call.
+// The return site of an emulated function call. This is a patchable jump to
+// the block at the return address, whose address is pushed onto the shadow
+// stack by a RIP-relative `LEA`.
+struct ReturnSite {
+  PatchPoint jump;
+  const arch::Instruction *load_instr;
+  CachePC load_end_pc;
+};
+
+// Return sites of the block being encoded. A superblock has one return site
+// for every direct function call inside of it.
+static std::vector<ReturnSite> gReturnSites;
+
+// A RIP-relative `MOV` of a pointer to some data outside of the code cache.
+struct DataLoad {
+  const arch::Instruction *load_instr;
+  const void *target;
+};
+
+// Data pointer loads in the block being encoded, whose displacements are
+// filled in when they are encoded.
+static std::vector<DataLoad> gDataLoads;
+
+// A memory operand that addresses the execution counter of the block being
+// encoded. The displacement is the block's cache offset, which is only known
+// once the block is allocated.
+struct BlockCounterRef {
+  arch::Instruction *instr;
+  unsigned op_num;
+};
+
+static std::vector<BlockCounterRef> gBlockCounterRefs;
+
+// Are the arithmetic flags dead at the point where the next instrumentation
+// function call will execute? This tracks a backward liveness analysis of the
+// arithmetic flags over the instructions of the block being emulated.
+static bool gAFlagsDead = false;
+
+// Inject an instrumentation function call. If the arithmetic flags are dead
+// then the call goes to a version of the instrumentation function that need
+// not save and restore the flags.
 static void Instrument(Block *block, code::InstrumentationPoint ipoint) {
-  auto func_pc = arch::GetInstrumentationFunction(ipoint);
+  auto func_pc = arch::GetInstrumentationFunction(ipoint, gAFlagsDead);
   auto instr = block->cache_instructions.Add();
   instr->has_pc_rel_op = true;
   instr->reencode_pc_rel_op = true;
@@ -43,6 +85,175 @@ static void Instrument(Block *block, code::InstrumentationPoint ipoint) {
   instr->operands[1].u.imm0 = reinterpret_cast<uintptr_t>(func_pc);
 }
 
+// Loads the pointer to `data` into `reg`. Data outside of the code cache is
+// only ever reached through the instrumentation page, never directly, so that
+// the code doesn't depend on where the `grr` binary is loaded.
+static void LoadDataPointer(Block *block, xed_reg_enum_t reg,
+                            arch::InstrumentationData data) {
+  auto target = arch::GetInstrumentationData(data);
+  auto load = block->cache_instructions.Add();
+  xed_inst2(load, arch::kXEDState64, XED_ICLASS_MOV,
+            arch::kAddrWidthBits_amd64,
+            xed_reg(reg),
+            xed_mem_bd(XED_REG_RIP, xed_disp(0, 32),
+                       arch::kAddrWidthBits_amd64));
+  gDataLoads.push_back({load, target});
+}
+
+// Increments the edge bitmap counter of the edge from the multi-way branch
+// at the end of `block` to its target. If `target_pc` is zero then the target
+// is only known at runtime, and is in `GRANARY_ABI_PC32`. The index of the
+// counter is computed with `LEA`s so that the flags are left alone, and the
+// counter itself is only incremented with an `INC` if the flags are dead.
+static void CoverEdge(Block *block, AppPC32 target_pc) {
+  if (gAFlagsDead) {
+    auto inc = block->cache_instructions.Add();
+    xed_inst1(inc, arch::kXEDState64, XED_ICLASS_INC, 8,
+              xed_mem_b(GRANARY_ABI_ADDR64, 8));
+  } else {
+    auto store = block->cache_instructions.Add();
+    xed_inst2(store, arch::kXEDState64, XED_ICLASS_MOV, 8,
+              xed_mem_b(GRANARY_ABI_ADDR64, 8),
+              xed_reg(GRANARY_ABI_SHADOW8));
+
+    auto inc = block->cache_instructions.Add();
+    xed_inst2(inc, arch::kXEDState64, XED_ICLASS_LEA,
+              arch::kAddrWidthBits_x86,
+              xed_reg(GRANARY_ABI_SHADOW32),
+              xed_mem_bd(GRANARY_ABI_SHADOW64, xed_disp(1, 8),
+                         arch::kAddrWidthBits_x86));
+
+    auto load = block->cache_instructions.Add();
+    xed_inst2(load, arch::kXEDState64, XED_ICLASS_MOVZX,
+              arch::kAddrWidthBits_x86,
+              xed_reg(GRANARY_ABI_SHADOW32),
+              xed_mem_b(GRANARY_ABI_ADDR64, 8));
+  }
+
+  // The target is known, so the index of the counter is a constant.
+  if (target_pc) {
+    auto index = code::EdgeBitmapIndex(block->StartPC(), target_pc);
+    auto counter = block->cache_instructions.Add();
+    xed_inst2(counter, arch::kXEDState64, XED_ICLASS_LEA,
+              arch::kAddrWidthBits_amd64,
+              xed_reg(GRANARY_ABI_ADDR64),
+              xed_mem_bd(GRANARY_ABI_ADDR64, xed_disp(index, 32),
+                         arch::kAddrWidthBits_amd64));
+    LoadDataPointer(block, GRANARY_ABI_ADDR64,
+                    arch::kInstrumentationDataEdgeBitmap);
+    return;
+  }
+
+  auto counter = block->cache_instructions.Add();
+  xed_inst2(counter, arch::kXEDState64, XED_ICLASS_LEA,
+            arch::kAddrWidthBits_amd64,
+            xed_reg(GRANARY_ABI_ADDR64),
+            xed_mem_bisd(GRANARY_ABI_SHADOW64, GRANARY_ABI_ADDR64, 1,
+                         xed_disp(0, 8), arch::kAddrWidthBits_amd64));
+
+  LoadDataPointer(block, GRANARY_ABI_SHADOW64,
+                  arch::kInstrumentationDataEdgeBitmap);
+
+  auto trunc = block->cache_instructions.Add();
+  xed_inst2(trunc, arch::kXEDState64, XED_ICLASS_MOVZX,
+            arch::kAddrWidthBits_x86,
+            xed_reg(GRANARY_ABI_ADDR32), xed_reg(GRANARY_ABI_ADDR16));
+
+  // `index = target * 45 + branch_id`, as `(target * 9) * 5 + branch_id`.
+  auto mul5 = block->cache_instructions.Add();
+  xed_inst2(mul5, arch::kXEDState64, XED_ICLASS_LEA,
+            arch::kAddrWidthBits_x86,
+            xed_reg(GRANARY_ABI_ADDR32),
+            xed_mem_bisd(GRANARY_ABI_ADDR64, GRANARY_ABI_ADDR64, 4,
+                         xed_disp(code::EdgeBitmapBranchId(block->StartPC()),
+                                  32),
+                         arch::kAddrWidthBits_x86));
+
+  auto mul9 = block->cache_instructions.Add();
+  xed_inst2(mul9, arch::kXEDState64, XED_ICLASS_LEA,
+            arch::kAddrWidthBits_x86,
+            xed_reg(GRANARY_ABI_ADDR32),
+            xed_mem_bisd(GRANARY_ABI_PC64, GRANARY_ABI_PC64, 8,
+                         xed_disp(0, 8), arch::kAddrWidthBits_x86));
+}
+
+// Returns the number of bytes added by `CoverEdge` for a known target.
+static int32_t CoverEdgeSize(void) {
+  if (!code::EdgeBitmap()) return 0;
+  return 7 + 8 + (gAFlagsDead ? 4 : 5 + 4 + 4);
+}
+
+// Instruments a multi-way branch whose target is `target_pc`, or whose target
+// is in `GRANARY_ABI_PC32` if `target_pc` is zero.
+static void InstrumentMultiWayBranch(Block *block, AppPC32 target_pc) {
+  Instrument(block, code::InstrumentationPoint::kInstrumentMultiWayBranch);
+  if (code::EdgeBitmap()) {
+    CoverEdge(block, target_pc);
+  }
+}
+
+// Returns a memory operand for the execution counter of the block being
+// encoded, and remembers to fill in its displacement.
+static xed_encoder_operand_t BlockCounter(arch::Instruction *instr,
+                                          unsigned op_num) {
+  gBlockCounterRefs.push_back({instr, op_num});
+  return xed_mem_bd(GRANARY_ABI_ADDR64, xed_disp(0, 32),
+                    arch::kAddrWidthBits_amd64);
+}
+
+// Increments the execution counter of `block` on entry to the block. Like
+// with edge coverage, the counter is only incremented with an `INC` if the
+// flags are dead.
+static void CountBlock(Block *block) {
+  if (gAFlagsDead) {
+    auto inc = block->cache_instructions.Add();
+    xed_inst1(inc, arch::kXEDState64, XED_ICLASS_INC,
+              arch::kAddrWidthBits_amd64, BlockCounter(inc, 0));
+  } else {
+    auto store = block->cache_instructions.Add();
+    xed_inst2(store, arch::kXEDState64, XED_ICLASS_MOV,
+              arch::kAddrWidthBits_amd64,
+              BlockCounter(store, 0), xed_reg(GRANARY_ABI_SHADOW64));
+
+    auto inc = block->cache_instructions.Add();
+    xed_inst2(inc, arch::kXEDState64, XED_ICLASS_LEA,
+              arch::kAddrWidthBits_amd64,
+              xed_reg(GRANARY_ABI_SHADOW64),
+              xed_mem_bd(GRANARY_ABI_SHADOW64, xed_disp(1, 8),
+                         arch::kAddrWidthBits_amd64));
+
+    auto load = block->cache_instructions.Add();
+    xed_inst2(load, arch::kXEDState64, XED_ICLASS_MOV,
+              arch::kAddrWidthBits_amd64,
+              xed_reg(GRANARY_ABI_SHADOW64), BlockCounter(load, 1));
+  }
+  LoadDataPointer(block, GRANARY_ABI_ADDR64,
+                  arch::kInstrumentationDataBlockCounters);
+}
+
+// Instruments the entry of a block, which is either counted inline, or
+// passed to an instrumentation function.
+static void InstrumentBlockEntry(Block *block) {
+  if (code::BlockCounters()) {
+    CountBlock(block);
+  } else if (code::GetInstrumentationFunction(code::kInstrumentBlockEntry)) {
+    Instrument(block, code::kInstrumentBlockEntry);
+  }
+}
+
+// Charges the execution budget if `cfi` is a back-edge, i.e. if it branches
+// backward. Returns `true` if the budget is charged. The charge is emitted
+// even if there is no budget, because the block might be persisted and then
+// run with a budget. Without a budget, the instrumentation function is just a
+// `RET`.
+static bool InstrumentBackEdge(Block *block, const arch::Instruction *cfi) {
+  if (cfi->TargetPC() > cfi->StartPC()) {
+    return false;
+  }
+  Instrument(block, code::kInstrumentBackEdge);
+  return true;
+}
+
 // Inject an instrumentation function call.
 static void InstrumentPC(Block *block, Addr32 pc) {
   const auto &ids = code::GetInstrumentationIds(pc);
@@ -427,13 +638,188 @@ static const arch::Instruction *PatchableJump(Block *block) {
   return patch;
 }
 
+// Loads the address of the shadow stack entry whose index is in
+// `GRANARY_ABI_ADDR32` into `GRANARY_ABI_SHADOW64`. Entries are 16 bytes, and
+// `LEA` is used instead of `SHL` so that the flags are left alone.
+static void LoadShadowStackEntry(Block *block) {
+  static_assert(112 == offsetof(os::Process32, shadow_stack),
+                "Bad structure packing of `os::Process32`.");
+  for (auto i = 0; i < 2; ++i) {
+    auto scale = block->cache_instructions.Add();
+    xed_inst2(scale, arch::kXEDState64, XED_ICLASS_LEA,
+              arch::kAddrWidthBits_amd64,
+              xed_reg(GRANARY_ABI_SHADOW64),
+              xed_mem_bisd(GRANARY_ABI_SHADOW64, GRANARY_ABI_ADDR64, 8,
+                           xed_disp(0, 8), arch::kAddrWidthBits_amd64));
+  }
+  auto load_stack = block->cache_instructions.Add();
+  xed_inst2(load_stack, arch::kXEDState64, XED_ICLASS_MOV,
+            arch::kAddrWidthBits_amd64,
+            xed_reg(GRANARY_ABI_SHADOW64),
+            xed_mem_bd(GRANARY_ABI_PROCESS64,
+                       // offsetof(os::Process32, shadow_stack)
+                       xed_disp(112, 8),
+                       arch::kAddrWidthBits_amd64));
+}
+
+// Moves the top of the process's shadow stack by `shift` entries, leaving the
+// new top in `GRANARY_ABI_ADDR32`. The top is a byte, so this wraps around.
+static void BumpShadowStackTop(Block *block, intptr_t shift_) {
+  static_assert(120 == offsetof(os::Process32, shadow_stack_top),
+                "Bad structure packing of `os::Process32`.");
+  auto shift = static_cast<uintptr_t>(shift_);
+  auto store_top = block->cache_instructions.Add();
+  xed_inst2(store_top, arch::kXEDState64, XED_ICLASS_MOV, 8,
+            xed_mem_bd(GRANARY_ABI_PROCESS64,
+                       // offsetof(os::Process32, shadow_stack_top)
+                       xed_disp(120, 8), 8),
+            xed_reg(GRANARY_ABI_ADDR8));
+  auto bump_top = block->cache_instructions.Add();
+  xed_inst2(bump_top, arch::kXEDState64, XED_ICLASS_LEA,
+            arch::kAddrWidthBits_x86,
+            xed_reg(GRANARY_ABI_ADDR32),
+            xed_mem_bd(GRANARY_ABI_ADDR64, xed_disp(shift, 8),
+                       arch::kAddrWidthBits_x86));
+}
+
+// Loads the top of the process's shadow stack into `GRANARY_ABI_ADDR32`.
+static void LoadShadowStackTop(Block *block) {
+  auto load_top = block->cache_instructions.Add();
+  xed_inst2(load_top, arch::kXEDState64, XED_ICLASS_MOVZX,
+            arch::kAddrWidthBits_x86,
+            xed_reg(GRANARY_ABI_ADDR32),
+            xed_mem_bd(GRANARY_ABI_PROCESS64,
+                       // offsetof(os::Process32, shadow_stack_top)
+                       xed_disp(120, 8), 8));
+}
+
+// Pushes the return address of the function call `cfi` onto the process's
+// shadow stack, along with the address of the block's return site.
+static void PushShadowStack(Block *block, const arch::Instruction *cfi) {
+  auto store_site = block->cache_instructions.Add();
+  xed_inst2(store_site, arch::kXEDState64, XED_ICLASS_MOV,
+            arch::kAddrWidthBits_amd64,
+            xed_mem_bd(GRANARY_ABI_SHADOW64, xed_disp(8, 8),
+                       arch::kAddrWidthBits_amd64),
+            xed_reg(GRANARY_ABI_ADDR64));
+
+  // The displacement is filled in once the return site is encoded.
+  auto load_site = block->cache_instructions.Add();
+  xed_inst2(load_site, arch::kXEDState64, XED_ICLASS_LEA,
+            arch::kAddrWidthBits_amd64,
+            xed_reg(GRANARY_ABI_ADDR64),
+            xed_mem_bd(XED_REG_RIP, xed_disp(0, 32),
+                       arch::kAddrWidthBits_amd64));
+  gReturnSites.back().load_instr = load_site;
+
+  auto store_pc = block->cache_instructions.Add();
+  xed_inst2(store_pc, arch::kXEDState64, XED_ICLASS_MOV,
+            arch::kAddrWidthBits_x86,
+            xed_mem_b(GRANARY_ABI_SHADOW64, arch::kAddrWidthBits_x86),
+            xed_imm0(static_cast<uint32_t>(-cfi->EndPC()), 32));
+
+  LoadShadowStackEntry(block);
+
+  auto zext_top = block->cache_instructions.Add();
+  xed_inst2(zext_top, arch::kXEDState64, XED_ICLASS_MOVZX,
+            arch::kAddrWidthBits_x86,
+            xed_reg(GRANARY_ABI_ADDR32), xed_reg(GRANARY_ABI_ADDR8));
+
+  BumpShadowStackTop(block, 1);
+  LoadShadowStackTop(block);
+}
+
+// Adds the return site of an emulated function call. This is only reached by
+// way of a predicted function return. If the jump hasn't been patched yet then
+// this falls through to a `RET` back to the dispatcher.
+//
+// The return site is placed after the block's own `RET` back to the
+// dispatcher. If the block instead falls through into its successor (within a
+// superblock), then the return site is placed inline, and jumped around.
+static void AddReturnSite(Block *block, const arch::Instruction *cfi,
+                          bool falls_through) {
+  if (falls_through) {
+    EndBlock(block);
+  }
+
+  gReturnSites.push_back({{cfi->EndPC(), PatchableJump(block)},
+                          nullptr, nullptr});
+
+  if (falls_through) {
+    // Jump around the:
+    //    1)  Patchable `jmp` (5 bytes).
+    //    2)  `ret` back to the dispatcher (1 byte).
+    auto skip = block->cache_instructions.Add();
+    xed_inst1(skip, arch::kXEDState64, XED_ICLASS_JMP,
+              arch::kAddrWidthBits_amd64, xed_relbr(6, 8));
+  } else {
+    EndBlock(block);
+  }
+}
+
+// Pops the top entry of the process's shadow stack, and jumps to its return
+// site if its return address matches the target of the function return in
+// `GRANARY_ABI_PC32`. The comparison is done with `LEA` and `JRCXZ` so that
+// the flags are left alone.
+static void PopShadowStack(Block *block) {
+  auto jump_site = block->cache_instructions.Add();
+  xed_inst1(jump_site, arch::kXEDState64, XED_ICLASS_JMP,
+            arch::kAddrWidthBits_amd64,
+            xed_mem_bd(GRANARY_ABI_SHADOW64, xed_disp(8, 8),
+                       arch::kAddrWidthBits_amd64));
+
+  auto restore_rcx_match = block->cache_instructions.Add();
+  xed_inst2(restore_rcx_match, arch::kXEDState64, XED_ICLASS_XCHG,
+            arch::kAddrWidthBits_amd64,
+            xed_reg(GRANARY_ABI_ADDR64), xed_reg(XED_REG_RCX));
+
+  // The prediction was wrong; return back to the dispatcher.
+  EndBlock(block);
+
+  auto restore_rcx = block->cache_instructions.Add();
+  xed_inst2(restore_rcx, arch::kXEDState64, XED_ICLASS_XCHG,
+            arch::kAddrWidthBits_amd64,
+            xed_reg(GRANARY_ABI_ADDR64), xed_reg(XED_REG_RCX));
+
+  // Jump around the:
+  //    1)  `xchg` that restores `rcx` (3 bytes).
+  //    2)  `ret` back to the dispatcher (1 byte).
+  auto check = block->cache_instructions.Add();
+  xed_inst1(check, arch::kXEDState64, XED_ICLASS_JRCXZ,
+            arch::kAddrWidthBits_amd64, xed_relbr(4, 8));
+
+  auto swap_rcx = block->cache_instructions.Add();
+  xed_inst2(swap_rcx, arch::kXEDState64, XED_ICLASS_XCHG,
+            arch::kAddrWidthBits_amd64,
+            xed_reg(GRANARY_ABI_ADDR64), xed_reg(XED_REG_RCX));
+
+  auto compare_pc = block->cache_instructions.Add();
+  xed_inst2(compare_pc, arch::kXEDState64, XED_ICLASS_LEA,
+            arch::kAddrWidthBits_x86,
+            xed_reg(GRANARY_ABI_ADDR32),
+            xed_mem_bisd(GRANARY_ABI_ADDR64, GRANARY_ABI_PC64, 1,
+                         xed_disp(0, 8), arch::kAddrWidthBits_x86));
+
+  auto load_pc = block->cache_instructions.Add();
+  xed_inst2(load_pc, arch::kXEDState64, XED_ICLASS_MOV,
+            arch::kAddrWidthBits_x86,
+            xed_reg(GRANARY_ABI_ADDR32),
+            xed_mem_b(GRANARY_ABI_SHADOW64, arch::kAddrWidthBits_x86));
+
+  BumpShadowStackTop(block, -1);
+  LoadShadowStackEntry(block);
+  LoadShadowStackTop(block);
+}
+
 // Virtualizes an application branch instruction.
 static void VirtualizeBranch(Block *block, const arch::Instruction *cfi) {
   gBranchTaken.app_pc32 = cfi->TargetPC();
   gBranchTaken.cache_instr = PatchableJump(block);
 
+  gAFlagsDead = block->target_kills_aflags;
+  InstrumentBackEdge(block, cfi);
   RecordLastMultiWayBranch(block);
-  Instrument(block, code::InstrumentationPoint::kInstrumentMultiWayBranch);
+  InstrumentMultiWayBranch(block, cfi->TargetPC());
   LoadImm(block, GRANARY_ABI_PC32, cfi->TargetPC());
 
   // If the condition isn't taken then we fall-through and return to here.
@@ -443,7 +829,10 @@ static void VirtualizeBranch(Block *block, const arch::Instruction *cfi) {
   gBranchNotTaken.cache_instr = PatchableJump(block);
 
   RecordLastMultiWayBranch(block);
-  Instrument(block, code::InstrumentationPoint::kInstrumentMultiWayBranch);
+  gAFlagsDead = block->fall_through_kills_aflags;
+  InstrumentMultiWayBranch(block, cfi->EndPC());
+  auto cover_edge_size = CoverEdgeSize();
+  gAFlagsDead = false;
 
   auto cond = block->cache_instructions.Add();
   memcpy(cond, cfi, sizeof *cond);
@@ -457,7 +846,8 @@ static void VirtualizeBranch(Block *block, const arch::Instruction *cfi) {
   //    2)  `call` into the instrumentation point (5 bytes).
   //    3)  `mov` of the block `eip` into the Process' last branch pc (4 bytes).
   //    4)  `ret` back to the dispatcher (1 byte).
-  cond->operands[0].u.brdisp = 15;
+  //    5)  Optional inline edge coverage.
+  cond->operands[0].u.brdisp = 15 + cover_edge_size;
 
   LoadImm(block, GRANARY_ABI_PC32, cfi->EndPC());  // 6 bytes.
 }
@@ -471,7 +861,7 @@ static bool EmulateDirectJump(Block *block, const arch::Instruction *cfi) {
 // Emulates an indirect jump.
 static bool EmulateIndirectJump(Block *block, const arch::Instruction *cfi) {
   RecordLastMultiWayBranch(block);
-  Instrument(block, code::InstrumentationPoint::kInstrumentMultiWayBranch);
+  InstrumentMultiWayBranch(block, 0);
   LoadOp(block, cfi, GRANARY_ABI_PC32, cfi->operands[0]);
   return true;
 }
@@ -479,32 +869,37 @@ static bool EmulateIndirectJump(Block *block, const arch::Instruction *cfi) {
 // Emulates a direct function call.
 static bool EmulateDirectFunctionCall(Block *block,
                                       const arch::Instruction *cfi) {
+  AddReturnSite(block, cfi, false);
   LoadImm(block, GRANARY_ABI_PC32, cfi->TargetPC());
   StoreImm32(block, GRANARY_ABI_SP64, cfi->EndPC());
   BumpSP(block, -arch::kAddrWidthBytes_x86);
+  PushShadowStack(block, cfi);
   return true;
 }
 
 // Emulates an indirect function call.
 static bool EmulateIndirectFunctionCall(Block *block,
                                         const arch::Instruction *cfi) {
+  AddReturnSite(block, cfi, false);
   RecordLastMultiWayBranch(block);
-  Instrument(block, code::InstrumentationPoint::kInstrumentMultiWayBranch);
+  InstrumentMultiWayBranch(block, 0);
   StoreImm32(block, GRANARY_ABI_SP64, cfi->EndPC());
   BumpSP(block, -arch::kAddrWidthBytes_x86);
   LoadOp(block, cfi, GRANARY_ABI_PC32, cfi->operands[0]);
+  PushShadowStack(block, cfi);
   return true;
 }
 
 // Emulates a function return.
 static bool EmulateFunctionReturn(Block *block, const arch::Instruction *cfi) {
+  PopShadowStack(block);
   const auto &imm = cfi->operands[0];
   if (XED_ENCODER_OPERAND_TYPE_IMM0 == imm.type) {
     BumpSP(block, imm.u.imm0);
   }
   BumpSP(block, arch::kAddrWidthBytes_x86);
   RecordLastMultiWayBranch(block);
-  Instrument(block, code::InstrumentationPoint::kInstrumentMultiWayBranch);
+  InstrumentMultiWayBranch(block, 0);
   LoadMem(block, GRANARY_ABI_PC32, GRANARY_ABI_SP64);
   return true;
 }
@@ -512,7 +907,8 @@ static bool EmulateFunctionReturn(Block *block, const arch::Instruction *cfi) {
 // Emulates a JCXZ, which is not valid in amd64.
 static void EmulateJcxz(Block *block, const arch::Instruction *cfi) {
   RecordLastMultiWayBranch(block);
-  Instrument(block, code::InstrumentationPoint::kInstrumentMultiWayBranch);
+  gAFlagsDead = block->target_kills_aflags;
+  InstrumentMultiWayBranch(block, cfi->TargetPC());
   LoadReg(block, XED_REG_ECX, GRANARY_ABI_VAL32);
   LoadImm(block, GRANARY_ABI_PC32, cfi->TargetPC());
 
@@ -521,14 +917,17 @@ static void EmulateJcxz(Block *block, const arch::Instruction *cfi) {
   LoadReg(block, XED_REG_ECX, GRANARY_ABI_VAL32);
 
   RecordLastMultiWayBranch(block);
-  Instrument(block, code::InstrumentationPoint::kInstrumentMultiWayBranch);
+  gAFlagsDead = block->fall_through_kills_aflags;
+  InstrumentMultiWayBranch(block, cfi->EndPC());
+  auto cover_edge_size = CoverEdgeSize();
+  gAFlagsDead = false;
 
   // Jump around the `MOV ECX, VAL32; RET` and the instrumentation.
   auto cond = block->cache_instructions.Add();
   memcpy(cond, cfi, sizeof *cond);
   cond->mode = arch::kXEDState64;
   cond->iclass = XED_ICLASS_JECXZ;
-  cond->operands[0].u.brdisp = 3 + 1 + 9;
+  cond->operands[0].u.brdisp = 3 + 1 + 9 + cover_edge_size;
 
   LoadImm(block, GRANARY_ABI_PC32, cfi->EndPC());
 
@@ -546,12 +945,6 @@ static bool EmulateBranch(Block *block, const arch::Instruction *cfi) {
   return true;
 }
 
-// Add a padding byte before a block.
-static void AddPadding(Block *block) {
-  auto instr = block->cache_instructions.Add();
-  xed_inst0(instr, arch::kXEDState64, XED_ICLASS_INT3, 0);
-}
-
 // Convert an instruction into a UD2.
 static void ConvertToError(Block *block, arch::Instruction *instr) {
   xed_inst0(instr, arch::kXEDState64, XED_ICLASS_UD2, 0);
@@ -1028,92 +1421,182 @@ static void ReportEncoderFailure(Block *block, arch::Instruction &instr) {
   ConvertToError(block, &instr);
 }
 
-}  // namespace
+// Returns `true` if `block` can fall through into the block at `next_pc`
+// within a superblock. This is the case for blocks that end in a direct jump
+// or direct function call to `next_pc`, or that end without a control-flow
+// instruction just before `next_pc`.
+static bool CanFallThrough(Block *block, AppPC32 next_pc) {
+  if (block->has_error || block->has_syscall || !block->num_app_instructions) {
+    return false;
+  }
+  auto ainstr = &(block->LastInstruction()->instruction);
+  if (ainstr->IsDirectJump() || ainstr->IsDirectFunctionCall()) {
+    return ainstr->TargetPC() == next_pc;
+  } else if (ainstr->IsBranch() || ainstr->IsJump() ||
+             ainstr->IsFunctionCall() || ainstr->IsFunctionReturn() ||
+             ainstr->IsSystemCall() || ainstr->IsSystemReturn() ||
+             ainstr->IsInterruptCall() || ainstr->IsInterruptReturn()) {
+    return false;
+  } else {
+    return !ainstr->IsSerializing() && !ainstr->IsUndefined() &&
+           ainstr->EndPC() == next_pc;
+  }
+}
 
-// Encodes the the block and returns a pointer to the location in the code
-// cache at which the block was encoded.
-//
-// Note: This function is NOT thread safe. `EncodedSize` and `Encode` should
-//       be performed in a transaction.
-void Block::Encode(index::Value &val) {
-  EndBlock(this);
+// Emulates the instructions of `block`, in reverse order. If `falls_through`
+// is `true`, then `block` is followed by its only successor within a
+// superblock, and so it doesn't return back to the dispatcher. Its direct
+// jump, or the load of the PC of its successor, is elided.
+static void EmulateBlock(Block *block, index::Value &val, bool falls_through) {
+  gAFlagsDead = false;
+  if (!falls_through) {
+    EndBlock(block);
+  }
 
-  if (GRANARY_UNLIKELY(!num_app_instructions)) {
+  if (GRANARY_UNLIKELY(!block->num_app_instructions)) {
     val.ends_with_error = true;
-    LoadImm(this, GRANARY_ABI_PC32, StartPC());
-
-  } else {
-    auto ainstr = &(app_instructions[num_app_instructions - 1].instruction);
-    auto first_ainstr = &(app_instructions[0].instruction);
+    LoadImm(block, GRANARY_ABI_PC32, block->StartPC());
+    return;
+  }
 
-    // Try to emulate the last instruction as a control-flow instruction.
-    if (EmulateCFI(this, ainstr)) {
-      val.has_one_successor = ainstr->IsDirectJump() ||
-                              ainstr->IsDirectFunctionCall();
-      val.ends_with_syscall = has_syscall;
+  auto ainstr = &(block->LastInstruction()->instruction);
+  auto first_ainstr = &(block->FirstInstruction()->instruction);
+
+  // Are the arithmetic flags live just after the instruction being emulated?
+  // The flags are conservatively live on exit from the block, unless the
+  // block's successor is known to overwrite them before reading them.
+  auto aflags_live = true;
+
+  if (falls_through) {
+    aflags_live = !(ainstr->IsDirectJump() || ainstr->IsDirectFunctionCall() ?
+                    block->target_kills_aflags :
+                    block->fall_through_kills_aflags);
+
+    if (ainstr->IsDirectFunctionCall()) {
+      AddReturnSite(block, ainstr, true);
+      StoreImm32(block, GRANARY_ABI_SP64, ainstr->EndPC());
+      BumpSP(block, -arch::kAddrWidthBytes_x86);
+      PushShadowStack(block, ainstr);
+      LoadImm(block, GRANARY_ABI_PC32, ainstr->StartPC());
+      --ainstr;
 
-      // Record the PC of the jump instruction. Useful if we have a fault when
-      // loading the target (e.g. an indirect jump where the target is stored
-      // in memory).
-      LoadImm(this, GRANARY_ABI_PC32, ainstr->StartPC());
+    } else if (ainstr->IsDirectJump()) {
 
+      // The jump is elided, so if the budget runs out on it then the target
+      // needs to be loaded for the dispatcher.
+      gAFlagsDead = !aflags_live;
+      if (InstrumentBackEdge(block, ainstr)) {
+        LoadImm(block, GRANARY_ABI_PC32, ainstr->TargetPC());
+      }
+      gAFlagsDead = false;
       --ainstr;
-
-    // It wasn't a control-flow instruction, so we emulated it with a direct
-    // jump, and so it only has one successor.
-    } else {
-      val.has_one_successor = !ainstr->IsSerializing();
-      val.ends_with_error = ainstr->IsUndefined();
     }
 
-    // For each remaining app instruction (in reverse order), try to emulate,
-    // andif not, virtualize each instruction.
-    for (; ainstr >= first_ainstr; --ainstr) {
-      GRANARY_ASSERT(XED_ICLASS_INVALID != ainstr->iclass);
+  // Try to emulate the last instruction as a control-flow instruction.
+  } else if (EmulateCFI(block, ainstr)) {
+    val.has_one_successor = ainstr->IsDirectJump() ||
+                            ainstr->IsDirectFunctionCall();
+    val.ends_with_syscall = block->has_syscall;
 
-      if (!Emulate(this, ainstr)) {
-        Virtualize(this, ainstr);
-      }
+    // Record the PC of the jump instruction. Useful if we have a fault when
+    // loading the target (e.g. an indirect jump where the target is stored
+    // in memory).
+    LoadImm(block, GRANARY_ABI_PC32, ainstr->StartPC());
 
-      // Instrument the instruction at this program counter.
-      InstrumentPC(this, ainstr->StartPC());
+    aflags_live = ainstr->reads_aflags ||
+                  !((ainstr->IsDirectJump() || ainstr->IsDirectFunctionCall()) &&
+                    block->target_kills_aflags);
+    --ainstr;
 
-      // Load the exact PC32 of each instruction just before emulating the
-      // instruction. This gives us precise PCs when reporting crashes.
-      LoadImm(this, GRANARY_ABI_PC32, ainstr->StartPC());
-    }
-    //Instrument(this, code::kInstrumentBlockEntry);
+  // It wasn't a control-flow instruction, so we emulated it with a direct
+  // jump, and so it only has one successor.
+  } else {
+    val.has_one_successor = !ainstr->IsSerializing();
+    val.ends_with_error = ainstr->IsUndefined();
+    aflags_live = !block->fall_through_kills_aflags;
   }
 
-  // Find the beginning of the block. We might push
-  auto start_cache_pc = cache::Allocate(0);
-  auto actual_start_cache_pc = start_cache_pc;
-  if (auto extra = reinterpret_cast<uintptr_t>(start_cache_pc) % 8) {
-    actual_start_cache_pc += (8 - extra);
-  }
+  // For each remaining app instruction (in reverse order), try to emulate,
+  // andif not, virtualize each instruction.
+  for (; ainstr >= first_ainstr; --ainstr) {
+    GRANARY_ASSERT(XED_ICLASS_INVALID != ainstr->iclass);
 
-  val.cache_offset = cache::PCToOffset(actual_start_cache_pc);
+    // Any instrumentation of this instruction executes before it, and so
+    // sees the flags that are live on entry to this instruction.
+    aflags_live = ainstr->reads_aflags ||
+                  (aflags_live && !ainstr->kills_aflags);
+    gAFlagsDead = !aflags_live;
 
-  // On entry to the block, add the block's identifying info in.
-  LoadImm(this, GRANARY_ABI_BLOCK64, val.value);
+    if (!Emulate(block, ainstr)) {
+      Virtualize(block, ainstr);
+    }
 
-  // Add padding before the entry of the block to align blocks to 8-byte
-  // boundaries.
-  for (; start_cache_pc < actual_start_cache_pc; ++start_cache_pc) {
-    AddPadding(this);
+    // Instrument the instruction at this program counter.
+    InstrumentPC(block, ainstr->StartPC());
+
+    // Load the exact PC32 of each instruction just before emulating the
+    // instruction. This gives us precise PCs when reporting crashes.
+    LoadImm(block, GRANARY_ABI_PC32, ainstr->StartPC());
   }
+}
 
-  // Encode the instructions.
-  for (auto &einstr : cache_instructions) {
+// Encodes the cache instructions of `block` into the code cache, and makes
+// `val` refer to the encoded code.
+static void EncodeBlock(Block *block, index::Value &val) {
+
+  // On entry to the block, add the block's identifying info in. The cache
+  // offset of the block isn't yet known, but it doesn't change the size of
+  // the instruction.
+  LoadImm(block, GRANARY_ABI_BLOCK64, val.value);
+  auto block_id_instr = &(block->cache_instructions.front());
+
+  // Size the instructions so that the whole block is allocated at once. The
+  // extra bytes leave room to align the block to an 8-byte boundary.
+  auto num_bytes = 7UL;
+  for (auto &einstr : block->cache_instructions) {
     auto instr_size = einstr.NumEncodedBytes();
     if (!instr_size) {
-      ReportEncoderFailure(this, einstr);
-      has_error = true;
+      ReportEncoderFailure(block, einstr);
+      block->has_error = true;
       instr_size = einstr.NumEncodedBytes();
     }
+    num_bytes += instr_size;
+  }
+
+  auto start_cache_pc = cache::Allocate(num_bytes);
+  auto end_cache_pc = start_cache_pc + num_bytes;
+  auto encode_pc = start_cache_pc;
+
+  // Add padding before the entry of the block to align blocks to 8-byte
+  // boundaries.
+  if (auto extra = reinterpret_cast<uintptr_t>(encode_pc) % 8) {
+    memset(encode_pc, 0xCC, 8 - extra);  // `INT3`.
+    encode_pc += (8 - extra);
+  }
+
+  auto entry_cache_pc = encode_pc;
+  cache::SetValuePC(val, encode_pc);
+  block_id_instr->operands[1] = xed_imm0(val.value, 64);
+  block_id_instr->NumEncodedBytes();
+
+  // Counters are 8 bytes, and are indexed by cache offset.
+  for (const auto &ref : gBlockCounterRefs) {
+    GRANARY_IF_ASSERT( auto instr_size = ref.instr->encoded_length; )
+    ref.instr->operands[ref.op_num] = xed_mem_bd(
+        GRANARY_ABI_ADDR64,
+        xed_disp(val.cache_offset * sizeof(uint64_t), 32),
+        arch::kAddrWidthBits_amd64);
+    ref.instr->NumEncodedBytes();
+    GRANARY_ASSERT(instr_size == ref.instr->encoded_length);
+  }
+  gBlockCounterRefs.clear();
 
+  // Encode the instructions.
+  for (auto &einstr : block->cache_instructions) {
+    if (!einstr.is_valid) continue;  // Couldn't even encode a `UD2`.
+
+    auto instr_size = einstr.encoded_length;
     if (instr_size) {
-      auto encode_pc = cache::Allocate(instr_size);
       UpdateRelBranch(&einstr, encode_pc);
       einstr.Encode(encode_pc);
 
@@ -1128,17 +1611,119 @@ void Block::Encode(index::Value &val) {
         AddPatchPoint(gBranchNotTaken.app_pc32, encode_pc);
         memset(&gBranchNotTaken, 0, sizeof gBranchNotTaken);
       }
+
+      // The displacement of the `LEA` is the last 4 bytes of the instruction.
+      for (auto &site : gReturnSites) {
+        if (&einstr == site.load_instr) {
+          GRANARY_ASSERT(7 == instr_size);
+          site.load_end_pc = encode_pc + instr_size;
+
+        } else if (&einstr == site.jump.cache_instr) {
+          GRANARY_ASSERT(5 == instr_size);
+          GRANARY_ASSERT(nullptr != site.load_end_pc);
+          auto disp = static_cast<int32_t>(encode_pc - site.load_end_pc);
+          memcpy(site.load_end_pc - 4, &disp, sizeof disp);
+          AddPatchPoint(site.jump.app_pc32, encode_pc);
+        }
+      }
+
+      // The instrumentation page directly precedes the code cache, so data
+      // pointers are always reachable with a 32-bit displacement.
+      for (const auto &load : gDataLoads) {
+        if (&einstr == load.load_instr) {
+          GRANARY_ASSERT(7 == instr_size);
+          auto next_pc = reinterpret_cast<intptr_t>(encode_pc + instr_size);
+          auto target = reinterpret_cast<intptr_t>(load.target);
+          auto disp = static_cast<int32_t>(target - next_pc);
+          GRANARY_ASSERT(target == (next_pc + disp));
+          memcpy(encode_pc + instr_size - 4, &disp, sizeof disp);
+        }
+      }
+
+      encode_pc += instr_size;
     }
   }
 
+  gReturnSites.clear();
+  gDataLoads.clear();
+
+  code::ProfileBlockSize(val, static_cast<size_t>(encode_pc - entry_cache_pc));
+
+  // Pad out the unused alignment bytes at the end of the block.
+  memset(encode_pc, 0xCC, static_cast<size_t>(end_cache_pc - encode_pc));
+
   // Report back up the chain (to the indexer) that this block has an error
   // in it (somewhere). This will prevent us from even executing it.
-  if (has_error) {
+  if (block->has_error) {
     val.ends_with_error = true;
   }
 
+  // Let the dispatcher skip restoring the flags when entering this block.
+  if (gAFlagsDead && !val.ends_with_error) {
+    cache::MarkAFlagsDeadOnEntry(val);
+  }
+
   arch::SerializePipeline();
 }
 
-}  // namespace granary
+}  // namespace
+
+// Encodes the the block and returns a pointer to the location in the code
+// cache at which the block was encoded.
+//
+// Note: This function is NOT thread safe. `EncodedSize` and `Encode` should
+//       be performed in a transaction.
+void Block::Encode(index::Value &val) {
+  EmulateBlock(this, val, false);
+
+  // Count executions of this block, if anything wants to know.
+  if (num_app_instructions) {
+    InstrumentBlockEntry(this);
+  }
+
+  EncodeBlock(this, val);
+}
 
+// Encodes a prefix of `blocks` as a single superblock, where each block falls
+// through into the next. The superblock is made up of every leading block that
+// can fall through into the next block, as well as that last next block.
+//
+// Note: This function is NOT thread safe.
+size_t Block::EncodeSuperblock(Block *blocks, size_t num_blocks,
+                               index::Value &val) {
+  auto num_superblock_blocks = 1UL;
+  while (num_superblock_blocks < num_blocks &&
+         CanFallThrough(&(blocks[num_superblock_blocks - 1]),
+                        blocks[num_superblock_blocks].StartPC())) {
+    ++num_superblock_blocks;
+  }
+
+  if (2 > num_superblock_blocks) {
+    return 0;
+  }
+
+  // The last block returns back to the dispatcher like any other block. The
+  // other blocks are emulated into the front of the last block's
+  // instructions, back to front, so that they fall through into one another.
+  auto superblock = &(blocks[num_superblock_blocks - 1]);
+  EmulateBlock(superblock, val, false);
+
+  // The superblock is identified by the block that ends it, as that is the
+  // block whose multi-way branch (if any) is recorded.
+  val.block_pc32 = superblock->StartPC();
+  for (auto i = num_superblock_blocks - 1; i-- > 0; ) {
+    index::Value ignored_val;
+    EmulateBlock(&(blocks[i]), ignored_val, true);
+    superblock->cache_instructions.splice_after(
+        superblock->cache_instructions.before_begin(),
+        blocks[i].cache_instructions);
+  }
+
+  // Count executions of the whole superblock, if anything wants to know.
+  InstrumentBlockEntry(superblock);
+
+  EncodeBlock(superblock, val);
+  return num_superblock_blocks;
+}
+
+}  // namespace granary
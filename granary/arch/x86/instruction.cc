@@ -275,6 +275,18 @@ static void DecodeOperands(const xed_decoded_inst_t *xedd,
   }
 }
 
+// Returns true if the decoded instruction must write to all of the arithmetic
+// flags. Conditional writes, e.g. of shifts by `CL`, don't count.
+static bool KillsAFlags(const xed_decoded_inst_t *xedd) {
+  auto rflags = xed_decoded_inst_get_rflags_info(xedd);
+  if (!rflags || !xed_simple_flag_get_must_write(rflags)) return false;
+  xed_flag_set_t written;
+  written.flat = xed_simple_flag_get_written_flag_set(rflags)->flat |
+                 xed_simple_flag_get_undefined_flag_set(rflags)->flat;
+  return written.s.of && written.s.sf && written.s.zf && written.s.af &&
+         written.s.pf && written.s.cf;
+}
+
 // Decode the prefixes. We purposely ignore branch taken/not taken hints.
 static void DecodePrefixes(const xed_decoded_inst_t *xedd, Instruction *instr) {
   if (xed_operand_values_has_real_rep(xedd)) {
@@ -396,6 +408,7 @@ bool Instruction::TryDecode(const uint8_t *decode_bytes, size_t max_num_bytes,
   memcpy(bytes, decode_bytes, decoded_length);
   DecodePrefixes(&xedd, this);
   DecodeOperands(&xedd, xed_decoded_inst_inst(&xedd), this);
+  kills_aflags = KillsAFlags(&xedd);
   return VerifyDecodedOperands(this);
 }
 
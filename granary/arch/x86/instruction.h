@@ -195,6 +195,11 @@ struct Instruction final : public xed_encoder_instruction_t {
     bool reads_aflags:1;
     bool writes_aflags:1;
 
+    // Does this instruction unconditionally overwrite all of the arithmetic
+    // flags (with defined or undefined values)? If so, then the arithmetic
+    // flags are dead just before this instruction, unless it also reads them.
+    bool kills_aflags:1;
+
     // Does this use "legacy" 32- or 16-bit registers? If so, then this
     // instruction likely cannot also use newer 64-bit registers (r8-r15).
     bool uses_legacy_registers:1;
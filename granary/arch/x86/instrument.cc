@@ -3,6 +3,11 @@
 #include "granary/arch/instruction.h"
 #include "granary/arch/instrument.h"
 
+#include "granary/code/coverage.h"
+#include "granary/code/profile.h"
+
+#include "granary/os/page.h"
+
 namespace granary {
 namespace arch {
 
@@ -11,38 +16,71 @@ extern const xed_state_t kXEDState64;
 namespace {
 
 static CachePC gInstFuncs[code::InstrumentationPoint::kInvalid] = {nullptr};
+static CachePC gAFlagsDeadInstFuncs[code::InstrumentationPoint::kInvalid] = {
+    nullptr};
+
+// Pointers to data outside of the code cache.
+static const void **gInstData = nullptr;
+
+// Encodes a stub at `instrument_section` that jumps to `addr`, or returns if
+// there is no instrumentation function.
+static void EncodeInstrumentationStub(CachePC instrument_section,
+                                      uintptr_t addr) {
+  arch::Instruction instr;
+  memset(&instr, 0, sizeof instr);
+  memset(instrument_section, 0x90, 8);
+  if (addr) {
+    auto next_pc = instrument_section + 5;
+    auto target_pc = reinterpret_cast<CachePC>(addr);
+    xed_inst1(&instr, arch::kXEDState64, XED_ICLASS_JMP,
+              kAddrWidthBits_amd64, xed_relbr(target_pc - next_pc, 32));
+  } else {
+    xed_inst0(&instr, arch::kXEDState64, XED_ICLASS_RET_NEAR,
+              kAddrWidthBits_amd64);
+  }
+  instr.Encode(instrument_section);
+}
 
 }  // namespace
 
 // Initialize instrumentation routines for use within basic blocks.
 void InitInstrumentationFunctions(CachePC instrument_section) {
+  auto code_cache_begin = instrument_section + os::kPageSize;
   auto ipoint_max = static_cast<int>(code::InstrumentationPoint::kInvalid);
   for (auto i = 0; i < ipoint_max; ++i) {
-    arch::Instruction instr;
-    memset(&instr, 0, sizeof instr);
-    memset(instrument_section, 0x90, 8);
-
     auto ipoint = static_cast<code::InstrumentationPoint>(i);
-    if (auto addr = code::GetInstrumentationFunction(ipoint)) {
-      auto next_pc = instrument_section + 5;
-      auto target_pc = reinterpret_cast<CachePC>(addr);
-      xed_inst1(&instr, arch::kXEDState64, XED_ICLASS_JMP,
-                kAddrWidthBits_amd64, xed_relbr(target_pc - next_pc, 32));
-    } else {
-      xed_inst0(&instr, arch::kXEDState64, XED_ICLASS_RET_NEAR,
-                kAddrWidthBits_amd64);
-    }
+
     gInstFuncs[ipoint] = instrument_section;
-    instr.Encode(instrument_section);
+    EncodeInstrumentationStub(instrument_section,
+                              code::GetInstrumentationFunction(ipoint));
+    instrument_section += 8;
+
+    gAFlagsDeadInstFuncs[ipoint] = instrument_section;
+    EncodeInstrumentationStub(instrument_section,
+                              code::GetInstrumentationFunction(ipoint, true));
     instrument_section += 8;
   }
+
+  // Pointers to data follow the stubs, and end at the end of the page.
+  gInstData = reinterpret_cast<const void **>(
+      code_cache_begin - kNumInstrumentationData * sizeof(void *));
+  GRANARY_ASSERT(instrument_section <= reinterpret_cast<CachePC>(gInstData));
+  gInstData[kInstrumentationDataBlockCounters] = code::BlockCounters();
+  gInstData[kInstrumentationDataEdgeBitmap] = code::EdgeBitmap();
 }
 
 // Returns the location in the code cache of where this instrumentation
 // function is.
-CachePC GetInstrumentationFunction(code::InstrumentationPoint ipoint) {
+CachePC GetInstrumentationFunction(code::InstrumentationPoint ipoint,
+                                   bool aflags_dead) {
   GRANARY_ASSERT(code::InstrumentationPoint::kInvalid != ipoint);
-  return gInstFuncs[ipoint];
+  return aflags_dead ? gAFlagsDeadInstFuncs[ipoint] : gInstFuncs[ipoint];
+}
+
+// Returns the location in the instrumentation page of the pointer to `data`.
+const void *GetInstrumentationData(InstrumentationData data) {
+  GRANARY_ASSERT(kNumInstrumentationData > data);
+  return &(gInstData[data]);
 }
 
 }  // namespace arch
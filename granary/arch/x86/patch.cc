@@ -10,7 +10,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
 
 #include <gflags/gflags.h>
 
@@ -20,6 +25,7 @@
 
 DECLARE_bool(persist);
 DECLARE_string(persist_dir);
+DECLARE_bool(shared_cache);
 
 DEFINE_bool(disable_patching, false,
             "Disable hot-patching of conditional branches?");
@@ -28,149 +34,295 @@ namespace granary {
 namespace arch {
 namespace {
 
-struct PatchPoint {
-  CacheOffset patch_offset;
-  index::Key target;
-};
-
-enum {
-  // After how many patch points should we try to patch?
-  kPatchInterval = 64,
+// Patch points that are waiting on their targets to be translated, grouped
+// by the `index::Key` of the target.
+static std::unordered_map<uint64_t, std::vector<CacheOffset>> gWaitLists;
 
-  // How many patch points should we store?
-  kNumPatches = (2 * os::kPageSize) / sizeof(PatchPoint)
-};
+// Keys of the wait lists whose targets were translated since the last commit,
+// but that also contain jumps in committed code. Those jumps are linked by
+// `LinkCommittedPatchPoints` once their targets are committed too.
+static std::vector<uint64_t> gDeferredLinks;
 
-static_assert(!(kNumPatches % kPatchInterval), "Invalid patch interval.");
-
-// Array of all patch points.
-//
-// Note: `+ 1` is so that `mmap` won't overflow and corrupt some other memory.
-alignas(os::kPageSize) static PatchPoint gPatches[kNumPatches + 1];
+// Patch points that have been added to the wait lists, but that haven't yet
+// been appended to the patch file.
+static std::vector<PatchPoint> gPendingPatches;
 
-// Offset of the next patch point that can be assigned.
-static int gNextPatch = 0;
-
-// FD for the patch file.
+// FD for the patch file. The patch file is a log of patch points. Patch
+// points in the log that have since been patched are skipped when the log is
+// read back in, and the log is rewritten with only the waiting patch points
+// on exit.
 static int gFd = -1;
 
+// Returns a pointer to the `rel32` of the jump at `patch_offset`.
+static CacheOffset *PatchPointer(CacheOffset patch_offset) {
+  return reinterpret_cast<CacheOffset *>(reinterpret_cast<uintptr_t>(
+      cache::OffsetToPC(patch_offset)));
+}
+
 // Patch a jump in the code.
 //
 // Note: `patch_offset` is the offset of an `int32_t` in the code cache that
 //       immediately follows the `JMP` opcode.
 static void Patch(CacheOffset patch_offset, index::Value target) {
   auto next_pc = cache::OffsetToPC(patch_offset + 4 /* sizeof(CacheOffset) */);
-  auto target_pc = cache::OffsetToPC(target.cache_offset);
+  auto target_pc = cache::ValueToPC(target);
   auto offset_diff = static_cast<CacheOffset>(target_pc - next_pc);
-  auto rel32 = reinterpret_cast<CacheOffset *>(reinterpret_cast<uintptr_t>(
-      cache::OffsetToPC(patch_offset)));
+  auto rel32 = PatchPointer(patch_offset);
   offset_diff = __sync_lock_test_and_set(rel32, offset_diff);
   // It should have had a zero value (e.g. `JMP next_pc`).
   GRANARY_ASSERT(!offset_diff);
 }
 
-// Clear all patch points.
-static void ClearPatchPoints(void) {
-  memset(gPatches, 0, sizeof gPatches);
-  gNextPatch = 0;
+// Returns true if the jump at `patch_offset` is part of code that has already
+// been committed to the persisted code cache.
+static bool IsCommitted(CacheOffset patch_offset) {
+  return FLAGS_persist && !FLAGS_shared_cache &&
+         (static_cast<size_t>(patch_offset) + 4) <= index::CommittedCacheSize();
 }
 
-
-// Type to patch all patch points.
-static void PatchCode(void) {
-  auto first_free = 0;
-  auto last_free = 0;
-  auto patched = false;
-  for (auto i = 0; i < gNextPatch; ++i) {
-    auto &patch = gPatches[i];
-
-    // A patch point that we can patch.
-    if (auto val = index::Find(patch.target)) {
-      Patch(patch.patch_offset, val);
-      memset(&patch, 0, sizeof patch);
-      ++last_free;
-      patched = true;
-
-    // A patch point that we can't patch yet. Bubble it to a different
-    // position.
-    } else if (first_free != last_free) {
-      memcpy(&(gPatches[first_free]), &patch, sizeof patch);
-      memset(&patch, 0, sizeof patch);
-      ++first_free;
-      ++last_free;
-
-    // A patch point that we can't patch yet. There are free slots available
-    // to which we can bubble this
-    } else {
-      ++first_free;
-      ++last_free;
+// Appends the pending patch points to the patch file. Short writes are
+// retried. If the append fails, then the patch file is truncated back to its
+// last whole patch point, and the pending patch points are dropped; their
+// jumps will go through the dispatcher in later runs instead of being linked.
+static void WritePendingPatches(void) {
+  if (-1 == gFd || gPendingPatches.empty()) return;
+
+  auto data = reinterpret_cast<const uint8_t *>(gPendingPatches.data());
+  auto size = gPendingPatches.size() * sizeof(PatchPoint);
+  auto old_size = lseek(gFd, 0, SEEK_END);
+  while (size) {
+    auto written = write(gFd, data, size);
+    if (0 < written) {
+      data += written;
+      size -= static_cast<size_t>(written);
+    } else if (EINTR != errno) {
+      std::cerr << "Unable to append to the patch file: "
+                << strerror(errno) << std::endl;
+      GRANARY_IF_ASSERT( errno = 0; )
+      ftruncate(gFd, old_size);
+      GRANARY_ASSERT(!errno && "Unable to truncate the patch file.");
+      break;
     }
   }
-  if (patched) {
-    cache::ClearInlineCache();
+
+  gPendingPatches.clear();
+}
+
+// Links all patch points waiting on `key` to the newly inserted `val`.
+static void LinkWaitList(index::Key key, index::Value val) {
+
+  // The patch points of the newly inserted block must be logged before the
+  // block can be committed.
+  WritePendingPatches();
+
+  auto wait_list_it = gWaitLists.find(key.key);
+  if (wait_list_it == gWaitLists.end()) return;
+
+  // A persisted jump must never outlive the code that it targets, so jumps
+  // that are already committed keep waiting until the target is committed.
+  // This is invoked while the target is being inserted into the index, which
+  // isn't a safe point to commit at.
+  auto &wait_list = wait_list_it->second;
+  auto has_deferred_links = false;
+  auto live_end = std::remove_if(
+      wait_list.begin(), wait_list.end(),
+      [&] (CacheOffset patch_offset) {
+        if (IsCommitted(patch_offset)) {
+          has_deferred_links = true;
+          return false;
+        }
+        Patch(patch_offset, val);
+        return true;
+      });
+  wait_list.erase(live_end, wait_list.end());
+  if (has_deferred_links) {
+    gDeferredLinks.push_back(key.key);
+  } else {
+    gWaitLists.erase(wait_list_it);
   }
-  gNextPatch = first_free;
+}
+
+// Adds the jump at `patch_offset` to the wait list of `target`.
+static void Wait(CacheOffset patch_offset, index::Key target) {
+  gWaitLists[target.key].push_back(patch_offset);
 }
 
 }  // namespace
 
-// Add a new patch point.
+// Add a new patch point. The jump is linked immediately if `target` has
+// already been translated, otherwise it waits for `target` to be inserted
+// into the index.
+//
+// Note: If the target already exists then it is older than the jump, and so
+//       it is always committed no later than the jump itself.
 void AddPatchPoint(CachePC rel32, AppPC32 target) {
   if (FLAGS_disable_patching) {
     return;
   }
-  if (gNextPatch && !(gNextPatch % kPatchInterval)) {
-    PatchCode();
-    if (GRANARY_UNLIKELY(kNumPatches == gNextPatch)) ClearPatchPoints();
-  }
 
-  auto &patch = gPatches[gNextPatch++];
+  PatchPoint patch;
   patch.patch_offset = cache::PCToOffset(reinterpret_cast<CachePC>(
       reinterpret_cast<uintptr_t>(rel32)));
   patch.target = index::Key(os::gProcess, target);
+
+  if (auto val = index::Find(patch.target)) {
+    Patch(patch.patch_offset, val);
+  } else {
+    Wait(patch.patch_offset, patch.target);
+    if (-1 != gFd) gPendingPatches.push_back(patch);
+  }
 }
 
+// Initialize the patcher. The persisted patch points are read back into their
+// wait lists, but they can only be linked once the code cache is initialized.
+//
+// Note: Patch points are private to a process, even when the code cache is
+//       shared. A process only ever patches the code that it encoded.
 void InitPatcher(void) {
-  auto flags = MAP_FIXED;
-  if (FLAGS_persist) {
-
-    static char gPath[256] = {'\0'};
-    sprintf(gPath, "%s/grr.patch.persist", FLAGS_persist_dir.c_str());
+  gWaitLists.clear();
+  gPendingPatches.clear();
+  if (!FLAGS_disable_patching) {
+    index::SetInsertHook(LinkWaitList);
+  }
 
-    GRANARY_IF_ASSERT( errno = 0; )
-    gFd = open(gPath, O_RDWR | O_CLOEXEC | O_CREAT | O_LARGEFILE, 0666);
-    GRANARY_ASSERT(!errno && "Unable to open patch file.");
+  if (!FLAGS_persist || FLAGS_shared_cache) {
+    gFd = -1;
+    return;
+  }
 
-    ftruncate(gFd, os::kPageSize);
-    flags |= MAP_SHARED;
+  static char gPath[256] = {'\0'};
+  sprintf(gPath, "%s/grr.patch.persist", FLAGS_persist_dir.c_str());
 
-  } else {
-    gFd = -1;
-    flags |= MAP_PRIVATE | MAP_ANONYMOUS;
+  GRANARY_IF_ASSERT( errno = 0; )
+  gFd = open(gPath, O_RDWR | O_APPEND | O_CLOEXEC | O_CREAT | O_LARGEFILE,
+             0666);
+  GRANARY_ASSERT(!errno && "Unable to open patch file.");
+
+  // Patch points in code beyond the last committed size of the code cache
+  // refer to code that is discarded when the code cache is revived, so they
+  // are dropped.
+  PatchPoint patch;
+  while (static_cast<ssize_t>(sizeof patch) ==
+         read(gFd, &patch, sizeof patch)) {
+    if (!patch.target || 0 > patch.patch_offset) continue;
+    if (!IsCommitted(patch.patch_offset)) continue;
+    Wait(patch.patch_offset, patch.target);
+    gPendingPatches.push_back(patch);
   }
 
+  // Rewrite the log without the dropped patch points, otherwise they could be
+  // confused with the patch points of new code encoded at the same offsets.
   GRANARY_IF_ASSERT( errno = 0; )
-  mmap(&gPatches, os::kPageSize, PROT_READ | PROT_WRITE, flags, gFd, 0);
-  GRANARY_ASSERT(!errno && "Unable to map patch file.");
+  ftruncate(gFd, 0);
+  GRANARY_ASSERT(!errno && "Unable to truncate the patch file.");
+  WritePendingPatches();
+}
 
-  // Advance the patch offset.
-  for (; gNextPatch < kNumPatches; ++gNextPatch) {
-    if (!gPatches[gNextPatch].target) break;
+// Links the persisted patch points whose targets were translated by an
+// earlier run, and forgets those that were already patched.
+void LinkPersistedPatchPoints(void) {
+  if (FLAGS_disable_patching) return;
+  for (auto it = gWaitLists.begin(); it != gWaitLists.end(); ) {
+    auto &wait_list = it->second;
+    index::Key target;
+    target.key = it->first;
+    auto val = index::Find(target);
+    auto live_end = std::remove_if(
+        wait_list.begin(), wait_list.end(),
+        [=] (CacheOffset patch_offset) {
+          if (*PatchPointer(patch_offset)) return true;
+          if (!val) return false;
+          Patch(patch_offset, val);
+          return true;
+        });
+    wait_list.erase(live_end, wait_list.end());
+    if (wait_list.empty()) {
+      it = gWaitLists.erase(it);
+    } else {
+      ++it;
+    }
   }
 }
 
-void ExitPatcher(void) {
-  if (FLAGS_persist) {
-    PatchCode();
-    msync(gPatches, os::kPageSize, MS_SYNC | MS_INVALIDATE);
+// Links the committed jumps whose targets were translated before the most
+// recent commit.
+void LinkCommittedPatchPoints(void) {
+  for (auto key : gDeferredLinks) {
+    auto wait_list_it = gWaitLists.find(key);
+    if (wait_list_it == gWaitLists.end()) continue;
+
+    index::Key target;
+    target.key = key;
+    auto val = index::Find(target);
+    GRANARY_ASSERT(val && "Deferred link to an untranslated target.");
+    for (auto patch_offset : wait_list_it->second) {
+      Patch(patch_offset, val);
+    }
+    gWaitLists.erase(wait_list_it);
   }
+  gDeferredLinks.clear();
+}
 
-  munmap(gPatches, os::kPageSize);
+// Links the jumps that are waiting on `key`, where `key` was found in a shared
+// index.
+void LinkSharedPatchPoints(index::Key key, index::Value val) {
+  if (GRANARY_LIKELY(gWaitLists.empty())) return;
+  LinkWaitList(key, val);
+}
 
-  if (FLAGS_persist) {
-    fsync(gFd);
-    close(gFd);
+void CheckpointPatchPoints(std::vector<uint8_t> *data) {
+  data->clear();
+  for (const auto &wait_list : gWaitLists) {
+    PatchPoint patch;
+    patch.target.key = wait_list.first;
+    for (auto patch_offset : wait_list.second) {
+      patch.patch_offset = patch_offset;
+      auto bytes = reinterpret_cast<const uint8_t *>(&patch);
+      data->insert(data->end(), bytes, bytes + sizeof patch);
+    }
+  }
+}
+
+void RestorePatchPoints(const std::vector<uint8_t> &data) {
+  GRANARY_ASSERT(0 == (data.size() % sizeof(PatchPoint)) &&
+                 "Invalid saved patch points.");
+  gWaitLists.clear();
+  for (size_t i = 0; i < data.size(); i += sizeof(PatchPoint)) {
+    PatchPoint patch;
+    memcpy(&patch, &(data[i]), sizeof patch);
+    Wait(patch.patch_offset, patch.target);
+  }
+  LinkPersistedPatchPoints();
+}
+
+// Persists the patch points that are still waiting on their targets.
+void ExitPatcher(void) {
+  index::SetInsertHook(nullptr);
+  if (-1 == gFd) return;
+
+  // Make sure that the waiting jumps are committed; jumps in uncommitted code
+  // would be dropped when the persisted code cache is revived.
+  cache::Commit();
+
+  // Compact the log down to only the waiting patch points.
+  gPendingPatches.clear();
+  for (const auto &wait_list : gWaitLists) {
+    PatchPoint patch;
+    patch.target.key = wait_list.first;
+    for (auto patch_offset : wait_list.second) {
+      patch.patch_offset = patch_offset;
+      gPendingPatches.push_back(patch);
+    }
   }
+
+  GRANARY_IF_ASSERT( errno = 0; )
+  ftruncate(gFd, 0);
+  GRANARY_ASSERT(!errno && "Unable to truncate the patch file.");
+  WritePendingPatches();
+
+  fsync(gFd);
+  close(gFd);
+  gFd = -1;
 }
 
 }  // namespace arch
@@ -2,12 +2,22 @@
 
 #include "granary/arch/patch.h"
 
+#include "granary/code/index.h"
+
 #ifndef GRANARY_ARCH_X86_PATCH_H_
 #define GRANARY_ARCH_X86_PATCH_H_
 
 namespace granary {
 namespace arch {
 
+// A jump in the code cache that will be patched to go to `target` once
+// `target` is translated. Unpatched patch points are persisted to the
+// `grr.patch.persist` file.
+struct PatchPoint {
+  CacheOffset patch_offset;
+  index::Key target;
+};
+
 // Add a new patch point.
 void AddPatchPoint(CachePC rel32, AppPC32 target);
 
@@ -17,6 +17,8 @@ Block::Block(void)
       num_app_instructions(0),
       has_syscall(false),
       has_error(false),
+      target_kills_aflags(false),
+      fall_through_kills_aflags(false),
       app_instructions(),
       cache_instructions() {}
 
@@ -97,9 +99,44 @@ static Instruction DecodeInstruction(Block *block, AppPC32 pc32, uint8_t *bytes,
   return instr;
 }
 
+// Maximum number of instructions to look at in the successor of a block when
+// deciding if the arithmetic flags are dead on entry to the successor.
+enum : int {
+  kMaxNumAFlagsLookaheadInstructions = 4
+};
+
+// Returns true if the arithmetic flags are overwritten by the code at `pc32`
+// before they are read, or before control leaves that code.
+static bool KillsAFlags(
+    const std::function<bool(AppPC32 pc, uint8_t &byte)> &try_read_byte,
+    AppPC32 pc32) {
+  uint8_t instr_bytes[arch::kMaxNumInstructionBytes] = {0};
+  for (int i = 0; i < kMaxNumAFlagsLookaheadInstructions; ++i) {
+    auto num_bytes = ReadInstructionBytes(try_read_byte, pc32, instr_bytes);
+    Instruction instr;
+    auto &ainstr(instr.instruction);
+    if (!ainstr.TryDecode(instr_bytes, num_bytes, arch::ISA::x86)) break;
+    if (ainstr.reads_aflags) break;
+    if (ainstr.kills_aflags) return true;
+    if (AtBlockEnd(instr)) break;
+    pc32 += ainstr.NumBytes();
+  }
+  return false;
+}
 
 }  // namespace
 
+// Decodes the block starting at `pc32` in `process`. This only reads bytes
+// that are both executable and readable.
+void Block::Decode(os::Process32 *process, AppPC32 pc32) {
+  DoDecode(pc32, [=] (Addr32 pc, uint8_t &byte) -> bool {
+    auto pc64 = process->ConvertPC(pc);
+    if (!process->TryRead(pc64, byte)) return false;
+    if (!process->CanExecute(pc)) return false;
+    return true;
+  });
+}
+
 // Decodes and returns the block starting at `start_app_pc`.
 void Block::DoDecode(
     AppPC32 pc32,
@@ -119,6 +156,20 @@ void Block::DoDecode(
     app_instructions.push_back(instr);
     if (AtBlockEnd(instr)) break;
   }
+
+  // Look ahead into the successors to find out if the instrumentation at the
+  // end of this block needs to preserve the arithmetic flags.
+  const auto &last_instr = app_instructions.back().instruction;
+  if (has_error || last_instr.IsSystemCall() || last_instr.IsInterruptCall()) {
+    return;
+  }
+  if (last_instr.IsBranch() || last_instr.IsDirectJump() ||
+      last_instr.IsDirectFunctionCall()) {
+    target_kills_aflags = KillsAFlags(try_read_byte, last_instr.TargetPC());
+  }
+  if (last_instr.IsBranch() || !AtBlockEnd(app_instructions.back())) {
+    fall_through_kills_aflags = KillsAFlags(try_read_byte, end_app_pc);
+  }
 }
 
 }  // namespace granary
@@ -39,6 +39,10 @@ class Block final {
   ReverseInstructionIterator rbegin(void);
   ReverseInstructionIterator rend(void);
 
+  // Decodes the block starting at `pc32` in `process`. This only reads bytes
+  // that are both executable and readable.
+  void Decode(os::Process32 *process, AppPC32 pc32);
+
   // Decodes and returns the block starting at `start_pc`.
   template <typename TryRead>
   void Decode(AppPC32 pc32, TryRead try_read_byte) {
@@ -52,6 +56,15 @@ class Block final {
   //       be performed in a transaction.
   void Encode(index::Value &val);
 
+  // Encodes a prefix of `blocks` as a single superblock, where each block
+  // falls through into the next, and returns the number of blocks in the
+  // superblock. Nothing is encoded, and zero is returned, if the first block
+  // can't fall through into the second.
+  //
+  // Note: This function is NOT thread safe.
+  static size_t EncodeSuperblock(Block *blocks, size_t num_blocks,
+                                 index::Value &val);
+
   AppPC32 start_app_pc;
   AppPC32 end_app_pc;  // After the CFI.
 
@@ -64,6 +77,12 @@ class Block final {
   // Was there an error (decoding/emulating/encoding)?
   bool has_error;
 
+  // Are the arithmetic flags dead on entry to the target, or to the fall-
+  // through, of the last instruction of this block? This is conservatively
+  // `false` when the successor isn't known or can't be decoded.
+  bool target_kills_aflags;
+  bool fall_through_kills_aflags;
+
   // Actual instructions in this block.
   std::vector<Instruction> app_instructions;
 
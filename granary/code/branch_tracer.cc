@@ -31,6 +31,7 @@ void TraceBranchImpl(
 
 // Defined in `tracer.S`. Saves some machine state
 extern void TraceBranch(void);
+extern void TraceBranchAFlagsDead(void);
 
 }  // extern C
 
@@ -40,7 +41,8 @@ void InitBranchTracer(void) {
   }
   code::AddInstrumentationFunction(
       code::InstrumentationPoint::kInstrumentMultiWayBranch,
-      TraceBranch);
+      TraceBranch,
+      TraceBranchAFlagsDead);
 }
 
 void ExitBranchTracer(void) {
@@ -4,15 +4,22 @@
 #include "granary/code/index.h"
 
 #include "granary/arch/instrument.h"
+#include "granary/arch/patch.h"
 
 #include "granary/os/page.h"
 
 #include <gflags/gflags.h>
 
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -25,8 +32,17 @@
 # define O_LARGEFILE 0
 #endif
 
+#ifndef MADV_HUGEPAGE
+# define MADV_HUGEPAGE 0
+#endif
+
 DECLARE_bool(persist);
 DECLARE_string(persist_dir);
+DECLARE_bool(shared_cache);
+DECLARE_bool(disable_inline_cache);
+
+DEFINE_bool(print_cache_stats, false, "Print out statistics about the code "
+                                      "cache when exiting.");
 
 namespace granary {
 namespace {
@@ -36,26 +52,71 @@ enum : size_t {
 }  // namespace
 namespace cache {
 namespace {
-enum : unsigned {
-  kProbesPerEntry = 4,
-  kNumEntries = 2048,
-  kNumCacheSlots = kNumEntries + kProbesPerEntry,
+enum : size_t {
+  // The instrumentation page, followed by the code cache.
+  kReservedSize = os::kPageSize + kMaxCacheSize,
+
+  // The code cache grows in huge page-sized chunks. The beginning of the code
+  // cache is aligned to this size.
+  kGrowthSize = 1ULL << 21ULL  // 2 MiB.
 };
 
-struct CacheEntry {
-  AppPC32 app_pc;
-  uint32_t cache_pc_disp_from_inline_cache;
+static_assert(!(kSegmentSize % kGrowthSize),
+              "Code cache segments must be made of whole growth chunks.");
+
+enum : size_t {
+  // The index mirror is a lossy, open-addressing hash table. The probes of a
+  // slot are the entries that follow it, hence the extra entries at the end.
+  kIndexMirrorBits = 20,
+  kNumIndexMirrorSlots = 1ULL << kIndexMirrorBits,
+  kNumIndexMirrorProbes = 8,
+  kNumIndexMirrorEntries = kNumIndexMirrorSlots + kNumIndexMirrorProbes,
+
+  kIndexMirrorSize = kNumIndexMirrorEntries * 16
 };
 
-extern "C" {
+// Multiplier for the Fibonacci hashing of keys in the index mirror. This must
+// match `cache.S`.
+static const uint64_t kIndexMirrorHashMul = 0x9E3779B97F4A7C15ULL;
+
+// An entry in the index mirror.
+struct IndexMirrorEntry {
+  index::Key key;
+  CachePC cache_pc;
+};
 
-CacheEntry gInlineCache[kNumCacheSlots];
+static_assert(16 == sizeof(IndexMirrorEntry),
+              "Invalid structure packing of `IndexMirrorEntry`.");
+
+// Bit of the `CachePC`s in the inline cache and in the index mirror that tells
+// `cache.S` that the arithmetic flags are dead on entry to the block, and so
+// they need not be restored before entering the block. This must match
+// `cache.S`.
+static const uintptr_t kAFlagsDeadBit = 1ULL << 63;
+
+extern "C" {
 
 void *gCacheAddr = nullptr;
 
-}  // extern C
+// Number of indirect branches whose targets were found, or not found, in the
+// inline cache. These are updated from within the assembly in `cache.S`.
+uint64_t gNumInlineCacheHits = 0;
+uint64_t gNumInlineCacheMisses = 0;
+
+// Mirror of the index entries that are reachable by indirect branches. This
+// is probed from within the assembly in `cache.S`.
+IndexMirrorEntry *gIndexMirror = nullptr;
+
+// Number of inline cache misses whose targets were found, or not found, in
+// the index mirror.
+uint64_t gNumIndexMirrorHits = 0;
+uint64_t gNumIndexMirrorMisses = 0;
 
-static uint8_t gNextInlineCacheEntry[kNumEntries] = {0};
+// Defined in `cache.S`. A lone `RET` back into `Call`. Shadow stack entries
+// that don't predict a return site jump here.
+extern void granary_shadow_stack_miss(void);
+
+}  // extern C
 
 // Beginning of the memory mapping for the code cache.
 static void *gBegin = nullptr;
@@ -68,50 +129,208 @@ static CachePC gBeginSyncPC = nullptr;
 // The next code cache location that can be allocated.
 static CachePC gNextBlockPC = nullptr;
 
-// Path to the persisted cache file.
-static char gCachePath[256] = {'\0'};
-
-// File descriptor for the code cache.
+// File descriptor for the segment at the end of the code cache.
 static int gFd = -1;
 
+// Index of the segment backed by `gFd`.
+static size_t gSegment = 0;
+
 // Flags for `mmap`.
 static int gMMapFlags = MAP_FIXED | MAP_POPULATE | MAP_SHARED;
 
 // Size (in bytes) of the code cache.
 static size_t gCacheSize = 0;
 
+// Size (in bytes) of the code cache that is shared with other processes, or
+// `nullptr` if the code cache isn't shared.
+static uint64_t *gSharedCacheSize = nullptr;
+
 // Should the cache be synchronized with the file system?
 static bool gSyncCache = false;
 
-// Is the inline cache empty? This lets us avoid redundant inline cache flushes.
-static bool kCacheIsEmpty = true;
+// Number of times that the code cache has grown.
+static uint64_t gNumGrowths = 0;
 
-// Returns the size of the existing cache.
-static size_t ExistingCacheSize(void) {
-  if (!FLAGS_persist) return 0;
-  struct stat info;
-  fstat(gFd, &info);
-  return static_cast<size_t>(info.st_size);
+// Total number of bytes that the code cache has grown by.
+static uint64_t gNumBytesGrown = 0;
+
+// Total time (in nanoseconds) spent growing the code cache.
+static uint64_t gGrowthTime = 0;
+
+// Blocks and traces, indexed by `index::Value::cache_offset`, on entry to which
+// the arithmetic flags are dead. This isn't persisted, so revived blocks are
+// conservatively treated as needing their flags.
+static std::vector<bool> gAFlagsDeadOnEntry;
+
+// Returns the program counter to which the dispatcher should go in order to
+// enter the block `val`.
+static CachePC DispatchPC(index::Value val) {
+  auto pc = reinterpret_cast<uintptr_t>(ValueToPC(val));
+  if (val.cache_offset < gAFlagsDeadOnEntry.size() &&
+      gAFlagsDeadOnEntry[val.cache_offset]) {
+    pc |= kAFlagsDeadBit;
+  }
+  return reinterpret_cast<CachePC>(pc);
+}
+
+// Returns the current time, in nanoseconds.
+static uint64_t CurrentTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
+
+// Asks for some of the code cache to be backed by huge pages. This only has
+// an effect on anonymous and shared memory mappings, e.g. a cache that isn't
+// persisted, or one persisted to a `tmpfs` mounted with `huge=advise`.
+static void AdviseHugePages(void *begin, size_t size) {
+  madvise(begin, size, MADV_HUGEPAGE);
+  GRANARY_IF_ASSERT( errno = 0; )  // Not all kernels support huge pages.
+}
+
+// Opens the file that backs segment `segment` of the code cache.
+static int OpenSegment(size_t segment) {
+  char path[256];
+  SegmentPath(path, FLAGS_persist_dir.c_str(), segment);
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto fd = open(path, O_RDWR | O_CLOEXEC | O_CREAT | O_LARGEFILE, 0666);
+  GRANARY_ASSERT(!errno && "Unable to open persisted code cache segment.");
+  return fd;
 }
 
-// Adds a new page to the end of the code cache.
+// Makes `segment` the segment at the end of the code cache. The previous
+// segment is full, and so it is retired: its file never changes size again,
+// and it stays mapped without an open file descriptor.
+static void SwitchSegment(size_t segment) {
+  if (-1 != gFd) close(gFd);
+  gFd = OpenSegment(segment);
+  gSegment = segment;
+}
+
+// Grows the code cache out to the next multiple of `kGrowthSize`. Growing in
+// big chunks keeps the number of `ftruncate`s and `mmap`s down, and lets the
+// chunks be backed by huge pages. Adjacent chunks of the same segment are
+// merged into a single mapping by the kernel.
 static void ResizeCache(void) {
+  GRANARY_ASSERT(gCacheSize < kMaxCacheSize && "The code cache is full.");
+  auto start_time = CurrentTime();
+  auto new_cache_size = (gCacheSize + kGrowthSize) & ~(kGrowthSize - 1);
+  auto num_bytes = new_cache_size - gCacheSize;
+
   off_t offset = 0;
   if (FLAGS_persist) {
+    auto segment = gCacheSize / kSegmentSize;
+    if (segment != gSegment || -1 == gFd) SwitchSegment(segment);
+    offset = static_cast<off_t>(gCacheSize % kSegmentSize);
+
     GRANARY_IF_ASSERT( errno = 0; )
-    ftruncate(gFd, static_cast<off_t>(gCacheSize + os::kPageSize));
+    ftruncate(gFd, offset + static_cast<off_t>(num_bytes));
     GRANARY_ASSERT(!errno && "Unable to resize code cache.");
-
-    offset = static_cast<off_t>(gCacheSize);
   }
 
   GRANARY_IF_ASSERT( errno = 0; )
-  mmap(gEnd, os::kPageSize, PROT_READ | PROT_WRITE | PROT_EXEC, gMMapFlags,
+  mmap(gEnd, num_bytes, PROT_READ | PROT_WRITE | PROT_EXEC, gMMapFlags,
        gFd, offset);
   GRANARY_ASSERT(!errno && "Unable to map new end of code cache.");
+  AdviseHugePages(gEnd, num_bytes);
 
-  gCacheSize += os::kPageSize;
+  gCacheSize = new_cache_size;
   gEnd = gBeginSyncPC + gCacheSize;
+
+  gNumGrowths += 1;
+  gNumBytesGrown += num_bytes;
+  gGrowthTime += CurrentTime() - start_time;
+}
+
+// Map in a code cache that is shared with other processes. Every segment file
+// is extended to the full segment size up-front so that no process ever needs
+// to grow its mapping. The files are sparse, so unused space costs nothing.
+static void InitSharedCache(void) {
+  SwitchSegment(0);
+
+  GRANARY_IF_ASSERT( errno = 0; )
+  flock(gFd, LOCK_EX);
+  GRANARY_ASSERT(!errno && "Unable to lock the code cache file.");
+
+  for (size_t segment = 0; segment < kMaxNumSegments; ++segment) {
+    auto fd = segment ? OpenSegment(segment) : gFd;
+    ftruncate(fd, static_cast<off_t>(kSegmentSize));
+    GRANARY_ASSERT(!errno && "Unable to scale the shared code cache segment.");
+
+    mmap(gBeginSyncPC + segment * kSegmentSize, kSegmentSize,
+         PROT_READ | PROT_WRITE | PROT_EXEC, MAP_FIXED | MAP_SHARED, fd, 0);
+    GRANARY_ASSERT(!errno && "Unable to map the shared code cache segment.");
+    AdviseHugePages(gBeginSyncPC + segment * kSegmentSize, kSegmentSize);
+    if (segment) close(fd);
+  }
+
+  // A zero shared size means that this is the first process to share this
+  // cache, and that nothing has been committed to it. The size is kept
+  // non-zero from here on.
+  gSharedCacheSize = index::SharedCacheSize();
+  if (!*gSharedCacheSize) {
+    memset(gBeginSyncPC, 0xCC, 8);  // `INT3`.
+    *gSharedCacheSize = 8;
+  }
+
+  gCacheSize = kMaxCacheSize;
+  gEnd = gBeginSyncPC + gCacheSize;
+
+  flock(gFd, LOCK_UN);
+}
+
+// Maps in the segments of a persisted code cache. Anything beyond the last
+// committed size is unreachable from the index. It was either written by a
+// run that died before it could commit, or it is unused space at the end of a
+// formerly shared cache. Segment files that lie entirely beyond the committed
+// size are removed.
+static void ReviveCache(void) {
+  auto committed_size = index::CommittedCacheSize();
+  size_t existing_size = 0;
+  for (size_t segment = 0; segment < kMaxNumSegments; ++segment) {
+    char path[256];
+    SegmentPath(path, FLAGS_persist_dir.c_str(), segment);
+    struct stat info;
+    if (stat(path, &info)) continue;
+
+    auto segment_begin = segment * kSegmentSize;
+    if (segment_begin >= committed_size || segment_begin != existing_size) {
+      unlink(path);
+    } else {
+      existing_size = segment_begin + std::min<size_t>(
+          kSegmentSize, static_cast<size_t>(info.st_size));
+    }
+  }
+  GRANARY_IF_ASSERT( errno = 0; )
+
+  gCacheSize = std::min(existing_size, committed_size);
+  if (!gCacheSize) return;
+
+  GRANARY_DEBUG( std::cerr << "Reviving cache file." << std::endl; )
+
+  // Scale the last segment file out to a multiple of the page size so that
+  // we can mmap it.
+  auto scaled_cache_size = (gCacheSize + (os::kPageSize - 1)) & os::kPageMask;
+  for (size_t segment_begin = 0; segment_begin < scaled_cache_size;
+       segment_begin += kSegmentSize) {
+    auto segment_size = std::min<size_t>(kSegmentSize,
+                                         scaled_cache_size - segment_begin);
+    SwitchSegment(segment_begin / kSegmentSize);
+
+    GRANARY_IF_ASSERT( errno = 0; )
+    ftruncate(gFd, static_cast<off_t>(segment_size));
+    GRANARY_ASSERT(!errno && "Unable to scale the code cache segment.");
+
+    mmap(gBeginSyncPC + segment_begin, segment_size,
+         PROT_READ | PROT_WRITE | PROT_EXEC, gMMapFlags, gFd, 0);
+    GRANARY_ASSERT(!errno && "Unable to map the code cache segment.");
+    AdviseHugePages(gBeginSyncPC + segment_begin, segment_size);
+  }
+
+  gNextBlockPC += gCacheSize;
+  gCacheSize = scaled_cache_size;
+  gEnd = gBeginSyncPC + scaled_cache_size;
 }
 
 static void InitInstrumentation(void) {
@@ -129,43 +348,76 @@ static void InitInstrumentation(void) {
 
 }  // namespace
 
-// Insert into the LRU cache. The cache is accessed from within the assembly
-// in `cache.S`.
+// Insert into the inline cache of `process`. Entries stay valid across
+// context switches, traces, and patches, as they always refer to a block or
+// trace that implements `key`. They are only invalidated, all at once, when
+// the process's page hash changes.
 void InsertIntoInlineCache(const os::Process32 *process, index::Key key,
                            index::Value block) {
-  kCacheIsEmpty = false;
-  auto offset = process->last_branch_pc % kNumEntries;
-  auto probe = (gNextInlineCacheEntry[offset]++) % kProbesPerEntry;
-  auto &entry = gInlineCache[offset + probe];
-  auto cache_pc = reinterpret_cast<intptr_t>(gBeginSyncPC) + block.cache_offset;
-  auto first_entry = reinterpret_cast<intptr_t>(&(gInlineCache[0]));
+  auto cache = process->inline_cache;
+  auto bucket = process->last_branch_pc % kNumInlineCacheBuckets;
+  auto probe = (cache->next_probe[bucket]++) % kNumInlineCacheProbes;
+  auto &entry = cache->entries[bucket + probe];
   entry.app_pc = key.pc32;
-  entry.cache_pc_disp_from_inline_cache = static_cast<uint32_t>(
-      cache_pc - first_entry);
+  entry.generation = process->inline_cache_generation;
+  entry.cache_pc = DispatchPC(block);
 }
 
-void ClearInlineCache(void) {
-  if (!kCacheIsEmpty) {
-    memset(gInlineCache, 0, sizeof gInlineCache);
-    kCacheIsEmpty = true;
+// Makes every entry of `stack` return back into `Call` when it is used. Entries
+// are cleared when the process's page hash changes, so that a stale return
+// site can't take the process into code from a different page hash.
+void ClearShadowStack(ShadowStack *stack) {
+  auto miss_pc = reinterpret_cast<CachePC>(granary_shadow_stack_miss);
+  for (auto &entry : stack->entries) {
+    entry.neg_return_pc = 0;
+    entry.padding = 0;
+    entry.return_site = miss_pc;
   }
 }
 
+// Insert into the index mirror. If the key isn't already in the mirror, and
+// all of its probes are taken, then the entry in its first probe is evicted.
+void InsertIntoIndexMirror(index::Key key, index::Value block) {
+  if (FLAGS_disable_inline_cache) return;
+  if (block.ends_with_error || block.ends_with_syscall) return;
+  auto slot = (key.key * kIndexMirrorHashMul) >> (64 - kIndexMirrorBits);
+  auto entry = &(gIndexMirror[slot]);
+  for (auto i = 0UL; i < kNumIndexMirrorProbes; ++i) {
+    if (gIndexMirror[slot + i].key == key || !gIndexMirror[slot + i].key) {
+      entry = &(gIndexMirror[slot + i]);
+      break;
+    }
+  }
+  entry->key = key;
+  entry->cache_pc = DispatchPC(block);
+}
+
+// Marks the arithmetic flags as being dead on entry to `block`.
+void MarkAFlagsDeadOnEntry(index::Value block) {
+  if (block.cache_offset >= gAFlagsDeadOnEntry.size()) {
+    gAFlagsDeadOnEntry.resize(block.cache_offset + 1);
+  }
+  gAFlagsDeadOnEntry[block.cache_offset] = true;
+}
+
 // Initialize the code cache.
 void Init(void) {
-  if (FLAGS_persist) {
-    sprintf(gCachePath, "%s/grr.cache.persist", FLAGS_persist_dir.c_str());
-    GRANARY_IF_ASSERT( errno = 0; )
-    gFd = open(gCachePath, O_RDWR | O_CLOEXEC | O_CREAT | O_LARGEFILE, 0666);
-    GRANARY_ASSERT(!errno && "Unable to open persisted code cache file.");
-  } else {
+  if (!FLAGS_persist) {
     gMMapFlags = MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS;
   }
 
   GRANARY_IF_ASSERT( errno = 0; )
 
-  const auto begin_loc = (reinterpret_cast<uintptr_t>(&Init) + k250MiB) & ~4095ULL;
-  gBegin = mmap(reinterpret_cast<void *>(begin_loc), k250MiB, PROT_NONE,
+  // Everything in the code cache, and everything that it calls, must be
+  // reachable with `rel32` branches. The code cache itself begins on a huge
+  // page boundary, just after the instrumentation page. This puts the code
+  // cache at a different distance from the `grr` binary in every run (e.g.
+  // with ASLR), so translated code only reaches the binary through the
+  // instrumentation page: its calls go through stubs, and its data accesses go
+  // through pointers, both of which are re-initialized in every run.
+  const auto begin_loc = ((reinterpret_cast<uintptr_t>(&Init) + k250MiB) &
+                          ~(kGrowthSize - 1)) - os::kPageSize;
+  gBegin = mmap(reinterpret_cast<void *>(begin_loc), kReservedSize, PROT_NONE,
                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
                 -1, 0);
   GRANARY_ASSERT(!errno && "Unable to map address space for code cache.");
@@ -173,6 +425,14 @@ void Init(void) {
   // The first page of the code cache is for instrumentation.
   InitInstrumentation();
 
+  GRANARY_IF_ASSERT( errno = 0; )
+  // The index mirror is shared with fork server children, so that the
+  // entries that they add are kept by the parent.
+  gIndexMirror = reinterpret_cast<IndexMirrorEntry *>(mmap(
+      nullptr, kIndexMirrorSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+  GRANARY_ASSERT(!errno && "Unable to map index mirror.");
+
   gBeginSyncPC = reinterpret_cast<CachePC>(gBegin) + os::kPageSize;
   gBeginSync = gBeginSyncPC;
   gEnd = gBeginSyncPC;
@@ -180,43 +440,63 @@ void Init(void) {
 
   gCacheAddr = gBeginSync;
 
-  if ((gCacheSize = ExistingCacheSize())) {
-    GRANARY_DEBUG( std::cerr << "Reviving cache file." << std::endl; )
-
-    auto scaled_cache_size = (gCacheSize + (os::kPageSize - 1)) & os::kPageMask;
-
-    // Scale the cache file out to a multiple of the page size so that we can
-    // mmap it.
-    GRANARY_IF_ASSERT( errno = 0; )
-    ftruncate(gFd, static_cast<off_t>(scaled_cache_size));
-    GRANARY_ASSERT(!errno && "Unable to scale the code cache file.");
-
-    // Bring the old cache into memory, although scale it out. We'll keep as
-    // many of the original cache pages non-writable, just in case this helps
-    // us to catch spurious bugs.
-    GRANARY_IF_ASSERT( errno = 0; )
-    mmap(gBeginSync, scaled_cache_size, PROT_READ | PROT_WRITE | PROT_EXEC,
-           gMMapFlags, gFd, 0);
-    GRANARY_ASSERT(!errno && "Unable to map the scaled code cache file.");
-
-    gNextBlockPC += gCacheSize;
-    gCacheSize = scaled_cache_size;
-    gEnd = gBeginSyncPC + scaled_cache_size;
+  if (FLAGS_persist && FLAGS_shared_cache) {
+    InitSharedCache();
+  } else if (FLAGS_persist) {
+    ReviveCache();
   }
 }
 
 void Exit(void) {
-  if (!FLAGS_persist || !gSyncCache) return;
-  auto actual_cache_size = gNextBlockPC - gBeginSyncPC;
-  msync(gBeginSync, gCacheSize, MS_SYNC | MS_INVALIDATE);
-  munmap(gBegin, k250MiB);
-  ftruncate(gFd, actual_cache_size);
-  close(gFd);
+  if (FLAGS_print_cache_stats) {
+    std::cerr << std::dec << "Code cache grew " << gNumGrowths << " times, by "
+              << gNumBytesGrown << " bytes, in " << (gGrowthTime / 1000)
+              << " us." << std::endl;
+    std::cerr << "Inline cache had " << gNumInlineCacheHits << " hits and "
+              << gNumInlineCacheMisses << " misses." << std::endl;
+    std::cerr << "Index mirror had " << gNumIndexMirrorHits << " hits and "
+              << gNumIndexMirrorMisses << " misses." << std::endl;
+  }
+  munmap(gIndexMirror, kIndexMirrorSize);
+  gIndexMirror = nullptr;
+  if (!FLAGS_persist) return;
+  if (gSharedCacheSize) {
+    munmap(gBegin, kReservedSize);
+    close(gFd);
+    return;
+  }
+  if (!gSyncCache) return;
+  Commit();
+  auto actual_cache_size = static_cast<size_t>(gNextBlockPC - gBeginSyncPC);
+  munmap(gBegin, kReservedSize);
+  if (-1 != gFd) {
+    ftruncate(gFd, static_cast<off_t>(
+        actual_cache_size - gSegment * kSegmentSize));
+    close(gFd);
+  }
+}
+
+// Commit the code cache, and all index entries that refer to it, to the
+// persisted index journal, and then link the committed jumps that were
+// waiting on those entries.
+//
+// Note: The cache is a shared mapping of the cache file, so the code itself
+//       survives the death of this process without needing an `msync`.
+void Commit(void) {
+  if (!FLAGS_persist) return;
+  index::Commit(static_cast<size_t>(gNextBlockPC - gBeginSyncPC));
+  arch::LinkCommittedPatchPoints();
 }
 
 // Allocate `num_bytes` of space from the code cache.
 CachePC Allocate(size_t num_bytes) {
   gSyncCache = true;
+  if (gSharedCacheSize) {
+    auto offset = __sync_fetch_and_add(gSharedCacheSize, num_bytes);
+    GRANARY_ASSERT((offset + num_bytes) <= gCacheSize &&
+                   "The shared code cache is full.");
+    return gBeginSyncPC + offset;
+  }
   auto ret = gNextBlockPC;
   gNextBlockPC += num_bytes;
   if (GRANARY_UNLIKELY(gNextBlockPC > gEnd)) ResizeCache();
@@ -240,5 +520,19 @@ CachePC OffsetToPC(CacheOffset offset) {
   return gBeginSyncPC + offset;
 }
 
+// Returns the program counter of the block or trace entry to which `val`
+// refers.
+CachePC ValueToPC(index::Value val) {
+  return gBeginSyncPC + val.cache_offset * index::kCacheOffsetScale;
+}
+
+// Makes `val` refer to the block or trace entry at `pc`.
+void SetValuePC(index::Value &val, CachePC pc) {
+  auto offset = static_cast<size_t>(pc - gBeginSyncPC);
+  GRANARY_ASSERT(!(offset % index::kCacheOffsetScale) &&
+                 "Blocks and trace entries must be aligned.");
+  val.cache_offset = static_cast<uint32_t>(offset / index::kCacheOffsetScale);
+}
+
 }  // namespace cache
 }  // namespace granary
@@ -5,6 +5,8 @@
 
 #include "granary/code/index.h"
 
+#include <cstdio>
+
 namespace granary {
 namespace os {
 class Process32;
@@ -12,13 +14,104 @@ class Process32;
 
 namespace cache {
 
-// Insert into the LRU cache. The cache is accessed from within the assembly
-// in `cache.S`.
+enum : size_t {
+  // The code cache is made up of segments. Each segment of a persisted cache
+  // is backed by its own file. Segments are mapped back-to-back, so branches
+  // between segments are ordinary `rel32` branches.
+  kSegmentSize = 1ULL << 27ULL,  // 128 MiB.
+  kMaxNumSegments = 8,
+
+  // Maximum size of the code cache, excluding the instrumentation page.
+  kMaxCacheSize = kSegmentSize * kMaxNumSegments
+};
+
+static_assert(kMaxCacheSize <= (1ULL << 27ULL) * index::kCacheOffsetScale,
+              "Cache offsets in `index::Value` can't address the code cache.");
+
+// Formats the path to the file that backs segment `segment` of the persisted
+// code cache.
+inline static void SegmentPath(char *path, const char *persist_dir,
+                               size_t segment) {
+  if (!segment) {
+    sprintf(path, "%s/grr.cache.persist", persist_dir);
+  } else {
+    sprintf(path, "%s/grr.cache.%zu.persist", persist_dir, segment);
+  }
+}
+
+enum : size_t {
+  kNumInlineCacheBuckets = 2048,
+  kNumInlineCacheProbes = 4,
+  kNumInlineCacheEntries = kNumInlineCacheBuckets + kNumInlineCacheProbes
+};
+
+// An entry in the inline cache of a process.
+struct InlineCacheEntry {
+  AppPC32 app_pc;
+
+  // Generation of the process's inline cache when this entry was inserted.
+  uint32_t generation;
+
+  CachePC cache_pc;
+};
+
+static_assert(16 == sizeof(InlineCacheEntry),
+              "Invalid structure packing of `InlineCacheEntry`.");
+
+// Per-process cache of the targets of indirect branches. This is probed from
+// within the assembly in `cache.S`, and indexed by the PC of the last
+// indirect branch.
+struct InlineCache {
+  InlineCacheEntry entries[kNumInlineCacheEntries];
+
+  // Next probe to replace within each bucket.
+  uint8_t next_probe[kNumInlineCacheBuckets];
+};
+
+enum : size_t {
+  // The top of a shadow stack is a `uint8_t`, so pushes and pops wrap around
+  // without changing the flags.
+  kNumShadowStackEntries = 256
+};
+
+// An entry on the shadow stack of a process. These are pushed by emulated
+// function calls, and popped by emulated function returns.
+struct ShadowStackEntry {
+  // Negated return address of the function call. Adding the target of a
+  // `ret` to this yields zero iff the prediction is right, which lets the
+  // translated `ret` check the prediction without changing the flags.
+  uint32_t neg_return_pc;
+  uint32_t padding;
+
+  // Code in the calling block that jumps to the block at the return address.
+  CachePC return_site;
+};
+
+static_assert(16 == sizeof(ShadowStackEntry),
+              "Invalid structure packing of `ShadowStackEntry`.");
+
+// Per-process stack of predicted function return targets. This is pushed and
+// popped by translated code, and so entries are never trusted until they have
+// been compared against the actual return address.
+struct ShadowStack {
+  ShadowStackEntry entries[kNumShadowStackEntries];
+};
+
+// Makes every entry of `stack` return back into `Call` when it is used.
+void ClearShadowStack(ShadowStack *stack);
+
+// Insert into the inline cache of `process`.
 void InsertIntoInlineCache(const os::Process32 *process, index::Key key,
                            index::Value value);
 
-// Clear the inline cache.
-void ClearInlineCache(void);
+// Insert into the index mirror, which is probed from within the assembly in
+// `cache.S` when the inline cache misses. Only blocks and traces that can be
+// entered directly from another block are inserted.
+void InsertIntoIndexMirror(index::Key key, index::Value value);
+
+// Marks the arithmetic flags as being dead on entry to `block`, so that the
+// dispatcher in `cache.S` can skip restoring the flags before entering it.
+void MarkAFlagsDeadOnEntry(index::Value block);
 
 // Calls into the code cache and returns a continuation.
 //
@@ -31,9 +124,15 @@ void Init(void);
 // Tear down the code cache.
 void Exit(void);
 
+// Commit the code cache, and all index entries that refer to it, to the
+// persisted index journal, and then link the committed jumps that were
+// waiting on those entries.
+void Commit(void);
+
 // Allocate `num_bytes` of space from the code cache.
 //
-// Note: This function is NOT thread-safe.
+// Note: This function is NOT thread-safe. However, allocations from a cache
+//       that is shared across processes are atomic.
 CachePC Allocate(size_t num_bytes);
 
 // Returns true if the PC is inside the code cache.
@@ -50,6 +149,13 @@ CacheOffset PCToOffset(CachePC pc);
 // code cache.
 CachePC OffsetToPC(CacheOffset offset);
 
+// Returns the program counter of the block or trace entry to which `val`
+// refers.
+CachePC ValueToPC(index::Value val);
+
+// Makes `val` refer to the block or trace entry at `pc`.
+void SetValuePC(index::Value &val, CachePC pc);
+
 }  // namespace cache
 }  // namespace granary
 
@@ -7,14 +7,19 @@
 #include <unistd.h>
 #include <gflags/gflags.h>
 
+#include <emmintrin.h>
+
 #include <algorithm>
-#include <map>
+#include <iomanip>
+#include <iostream>
 #include <sstream>
+#include <vector>
 
 #include "granary/os/page.h"
 
 #include "granary/code/instrument.h"
 #include "granary/code/coverage.h"
+#include "granary/code/coverage_file.h"
 
 #include "granary/os/process.h"
 
@@ -27,6 +32,9 @@
 DECLARE_bool(path_coverage);
 DECLARE_string(coverage_file);
 DECLARE_string(output_coverage_file);
+DECLARE_string(coverage_mode);
+DECLARE_string(shared_coverage_file);
+DECLARE_bool(compress_coverage_file);
 
 DEFINE_bool(count_path_executions, true,
             "Count the order of magnitude of number of times each path "
@@ -43,20 +51,10 @@ struct PathEntry {
   Addr32 block_pc_of_branch;
   Addr32 target_block_pc_of_branch;
 
-  bool operator<(const PathEntry &other) const {
-    if (block_pc_of_last_branch < other.block_pc_of_last_branch) {
-      return true;
-    } else if (block_pc_of_last_branch > other.block_pc_of_last_branch) {
-      return false;
-    }
-
-    if (block_pc_of_branch < other.block_pc_of_branch) {
-      return true;
-    } else if (block_pc_of_branch > other.block_pc_of_branch) {
-      return false;
-    }
-
-    return target_block_pc_of_branch < other.target_block_pc_of_branch;
+  bool operator==(const PathEntry &other) const {
+    return block_pc_of_last_branch == other.block_pc_of_last_branch &&
+           block_pc_of_branch == other.block_pc_of_branch &&
+           target_block_pc_of_branch == other.target_block_pc_of_branch;
   }
 } __attribute__((packed));
 
@@ -64,18 +62,62 @@ struct CountedPathEntry : public PathEntry {
   uint32_t count;
 } __attribute__((packed));
 
+extern "C" {
+
+// Counters of the edges covered by the current testcase. These are
+// incremented by translated code.
+alignas(64) uint8_t gEdgeBitmap[kEdgeBitmapSize] = {0};
+
+}  // extern C
+
 namespace {
 
-static std::map<PathEntry, uint32_t> gAllPaths;
-static std::map<PathEntry, uint32_t> gAllPathsAtInit;
-static std::map<PathEntry, uint32_t> gCurrPaths;
+// A slot in the open-addressed path coverage table. The counts of a slot
+// are only meaningful if the slot's generation is the generation of the
+// current testcase; otherwise the path has not (yet) been executed by the
+// current testcase, and the counts are implicitly those at initialization.
+struct PathSlot {
+  PathEntry path;
+
+  // Generation of the testcase that last executed this path.
+  uint32_t generation;
+
+  // Number of times the current testcase has executed this path.
+  uint32_t count;
+
+  // Order of magnitude of the most number of times that any testcase (or
+  // previous run) has executed this path.
+  uint32_t all_count;
+
+  // Value of `all_count` as read from the coverage file.
+  uint32_t init_count;
+
+  bool is_used;
+};
+
+// Table of all known paths. This only grows when new paths are discovered.
+static std::vector<PathSlot> gPathSlots;
+static size_t gNumUsedPathSlots = 0;
+
+// Generation of the current testcase. Slots from the coverage file are in
+// generation zero, and so are never part of a testcase's coverage.
+static uint32_t gGeneration = 0;
+
+// Distinct paths executed by the current testcase.
+static std::vector<PathEntry> gCurrPaths;
+
+// Order-independent hash of the `(path, log2ish(count))` pairs of the current
+// testcase. This is updated whenever the order of magnitude of a path's count
+// changes.
+static uint64_t gPathHash[2] = {0, 0};
 
 static bool gHasNewPathCoverage = false;
 static bool gInputLengthMarked = false;
 static size_t gMarkedInputLength = 0;
 
 enum : size_t {
-  kMaxNumBufferedPathEntries = 4096
+  kMaxNumBufferedPathEntries = 4096,
+  kMinNumPathSlots = 4 * kMaxNumBufferedPathEntries
 };
 
 // log2ish(n) = int(log2(n)) + 1
@@ -83,6 +125,256 @@ static inline uint32_t log2ish(uint32_t x) {
   return x ? 32U - static_cast<uint32_t>(__builtin_clz(x)) : 0;
 }
 
+// Finalizer from MurmurHash3.
+static inline uint64_t Mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static uint64_t HashPath(const PathEntry &path, uint64_t seed) {
+  auto h = Mix64(seed ^ path.block_pc_of_last_branch);
+  return Mix64(h ^ ((static_cast<uint64_t>(path.block_pc_of_branch) << 32) |
+                    path.target_block_pc_of_branch));
+}
+
+// Doubles the size of the path table.
+static void GrowPathSlots(void) {
+  std::vector<PathSlot> old_slots(
+      std::max<size_t>(kMinNumPathSlots, gPathSlots.size() * 2));
+  old_slots.swap(gPathSlots);
+  const auto mask = gPathSlots.size() - 1;
+  for (const auto &old_slot : old_slots) {
+    if (!old_slot.is_used) continue;
+    for (auto i = HashPath(old_slot.path, 0); ; ++i) {
+      auto &slot = gPathSlots[i & mask];
+      if (!slot.is_used) {
+        slot = old_slot;
+        break;
+      }
+    }
+  }
+}
+
+// Finds the slot for `path`, adding one if this is a new path.
+static PathSlot &FindPathSlot(const PathEntry &path) {
+  if (gNumUsedPathSlots * 2 >= gPathSlots.size()) {
+    GrowPathSlots();
+  }
+  const auto mask = gPathSlots.size() - 1;
+  for (auto i = HashPath(path, 0); ; ++i) {
+    auto &slot = gPathSlots[i & mask];
+    if (!slot.is_used) {
+      slot.path = path;
+      slot.is_used = true;
+      ++gNumUsedPathSlots;
+      return slot;
+    } else if (slot.path == path) {
+      return slot;
+    }
+  }
+}
+
+// Returns the order of magnitude of the most number of times that any
+// testcase has executed the path in `slot`.
+static inline uint32_t AllCount(const PathSlot &slot) {
+  return slot.generation == gGeneration ? slot.all_count : slot.init_count;
+}
+
+// Changes the contribution of `path` to the path hash.
+static void UpdatePathHash(const PathEntry &path, uint32_t old_log_count,
+                           uint32_t new_log_count) {
+  if (old_log_count) {
+    gPathHash[0] -= HashPath(path, old_log_count);
+    gPathHash[1] -= HashPath(path, ~static_cast<uint64_t>(old_log_count));
+  }
+  if (new_log_count) {
+    gPathHash[0] += HashPath(path, new_log_count);
+    gPathHash[1] += HashPath(path, ~static_cast<uint64_t>(new_log_count));
+  }
+}
+
+// Is edge coverage being recorded into the edge bitmap, instead of path
+// coverage being recorded into `gPathEntries`?
+static bool gUseEdgeBitmap = false;
+
+// Bucketed counters of every edge that has been covered, either by a previous
+// run (`gEdgeBucketsAtInit`), or by the current testcase.
+alignas(16) static uint8_t gEdgeBuckets[kEdgeBitmapSize] = {0};
+alignas(16) static uint8_t gEdgeBucketsAtInit[kEdgeBitmapSize] = {0};
+
+// Input index as of the last time that the edge bitmap was scanned.
+static size_t gLastScannedInputIndex = 0;
+
+// A slot in the shared path coverage map. Paths are identified by a 64-bit
+// hash so that a slot can be claimed with a single compare-and-swap.
+struct SharedPathSlot {
+  uint64_t path_hash;
+  uint32_t all_count;
+  uint32_t padding;
+};
+
+enum : size_t {
+  kNumSharedPathSlots = 1ULL << 20ULL,
+  kMaxNumSharedPathProbes = 64
+};
+
+// Coverage map that is shared by all concurrent instances of `grrplay`. This
+// is either an array of `SharedPathSlot`s, or of edge buckets, depending on
+// the coverage mode.
+static void *gSharedCoverage = nullptr;
+static size_t gSharedCoverageSize = 0;
+
+// Number of paths that didn't fit into the shared path coverage map.
+static uint64_t gNumUnsharedPaths = 0;
+
+// Maps an edge counter to a bit representing the order of magnitude of the
+// counter: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, and 128+.
+static uint8_t gEdgeCountBuckets[256] = {0};
+
+static void InitEdgeCountBuckets(void) {
+  for (auto i = 1U; i < 256U; ++i) {
+    if (!FLAGS_count_path_executions) {
+      gEdgeCountBuckets[i] = 1;
+    } else if (i <= 3) {
+      gEdgeCountBuckets[i] = static_cast<uint8_t>(1U << (i - 1U));
+    } else if (i < 32) {
+      gEdgeCountBuckets[i] = static_cast<uint8_t>(1U << log2ish(i));
+    } else if (i < 128) {
+      gEdgeCountBuckets[i] = 64;
+    } else {
+      gEdgeCountBuckets[i] = 128;
+    }
+  }
+}
+
+// Invokes `func` on the index and bucketed counter of every non-zero counter in
+// the edge bitmap. Runs of zero counters are skipped 16 at a time.
+template <typename Func>
+static void ForEachCoveredEdge(Func func) {
+  const auto zero = _mm_setzero_si128();
+  for (auto i = 0UL; i < kEdgeBitmapSize; i += 16) {
+    auto counters = _mm_load_si128(
+        reinterpret_cast<const __m128i *>(&(gEdgeBitmap[i])));
+    auto zero_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(counters, zero));
+    if (0xFFFF == zero_mask) continue;
+    for (auto j = 0UL; j < 16; ++j) {
+      if (auto count = gEdgeBitmap[i + j]) {
+        func(i + j, gEdgeCountBuckets[count]);
+      }
+    }
+  }
+}
+
+// Maps in the shared coverage file. Every instance sizes the file the same
+// way, so it doesn't matter which one creates it.
+static void MapSharedCoverage(void) {
+  gSharedCoverageSize = gUseEdgeBitmap ?
+                        kEdgeBitmapSize :
+                        kNumSharedPathSlots * sizeof(SharedPathSlot);
+
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto fd = open(FLAGS_shared_coverage_file.c_str(),
+                 O_RDWR | O_CLOEXEC | O_CREAT | O_LARGEFILE, 0666);
+  GRANARY_ASSERT(!errno && "Unable to open the shared coverage file.");
+
+  struct stat file_info;
+  fstat(fd, &file_info);
+  GRANARY_ASSERT(!errno && "Unable to stat the shared coverage file.");
+
+  auto size = static_cast<size_t>(file_info.st_size);
+  GRANARY_ASSERT((!size || gSharedCoverageSize == size) &&
+                 "Shared coverage file has the wrong size for this mode.");
+  if (!size) {
+    ftruncate(fd, static_cast<off_t>(gSharedCoverageSize));
+    GRANARY_ASSERT(!errno && "Unable to size the shared coverage file.");
+  }
+
+  gSharedCoverage = mmap(nullptr, gSharedCoverageSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+  GRANARY_ASSERT(!errno && "Unable to map the shared coverage file.");
+  close(fd);
+}
+
+// Atomically raises the shared count of `path` to `log_count`. Returns the
+// previous shared count. If the shared map is full then the path is treated
+// as already having been covered as many times by someone else; otherwise
+// every path that doesn't fit would look new to every testcase.
+static uint32_t MaxSharedPathCount(const PathEntry &path, uint32_t log_count) {
+  auto slots = reinterpret_cast<SharedPathSlot *>(gSharedCoverage);
+  auto path_hash = HashPath(path, 0) | 1ULL;  // Zero marks an empty slot.
+  for (auto i = 0UL; i < kMaxNumSharedPathProbes; ++i) {
+    auto &slot = slots[(path_hash + i) & (kNumSharedPathSlots - 1)];
+    auto slot_hash = __sync_val_compare_and_swap(
+        &(slot.path_hash), 0ULL, path_hash);
+    if (slot_hash && slot_hash != path_hash) continue;
+
+    auto count = slot.all_count;
+    while (count < log_count) {
+      auto prev_count = __sync_val_compare_and_swap(
+          &(slot.all_count), count, log_count);
+      if (prev_count == count) break;
+      count = prev_count;
+    }
+    return count;
+  }
+
+  if (!gNumUnsharedPaths++) {
+    std::cerr << "Warning: Shared path coverage map is full; paths that "
+              << "don't fit are treated as already covered." << std::endl;
+  }
+  return log_count;
+}
+
+// Merges the current edge counters into the covered edges. New coverage is
+// either a new edge, or an edge that executed an order of magnitude more
+// times than before.
+//
+// Note: Like with path coverage, edges covered before any input is read are
+//       not input-dependent, and so they are discarded.
+static void UpdateEdgeBuckets(void) {
+  if (!gInputIndex) {
+    memset(gEdgeBitmap, 0, sizeof gEdgeBitmap);
+    return;
+  }
+  ForEachCoveredEdge([] (size_t i, uint8_t bucket) {
+    if (bucket & ~gEdgeBuckets[i]) {
+      gEdgeBuckets[i] |= bucket;
+      if (!gSharedCoverage) {
+        gHasNewPathCoverage = true;
+        return;
+      }
+
+      // Some other instance might have already covered this edge. Either
+      // way, later testcases are compared against everyone's coverage.
+      auto shared_buckets = reinterpret_cast<uint8_t *>(gSharedCoverage);
+      auto prev_bucket = __sync_fetch_and_or(&(shared_buckets[i]), bucket);
+      if (bucket & ~prev_bucket) {
+        gHasNewPathCoverage = true;
+      }
+      gEdgeBuckets[i] |= prev_bucket;
+      gEdgeBucketsAtInit[i] |= gEdgeBuckets[i];
+    }
+  });
+}
+
+// Closes the temporary coverage file `cov_file`, and then replaces the output
+// coverage file with it. If the temporary file couldn't be fully written then
+// the old output coverage file is kept.
+static void CommitCoverageFile(CoverageFileWriter &writer,
+                               const std::string &cov_file) {
+  if (writer.Close()) {
+    rename(cov_file.c_str(), FLAGS_output_coverage_file.c_str());
+  } else {
+    std::cerr << "Keeping the old coverage file "
+              << FLAGS_output_coverage_file << std::endl;
+    unlink(cov_file.c_str());
+  }
+}
+
 }  // namespace
 
 extern "C" {
@@ -92,6 +384,7 @@ unsigned gNextPathEntry = 0;
 
 // Used for path tracing.
 extern void CoverPath(void);
+extern void CoverPathAFlagsDead(void);
 
 // Invoked by assembly
 extern void UpdateCoverageSet(void) {
@@ -109,18 +402,39 @@ extern void UpdateCoverageSet(void) {
       break;
     }
 
-    PathEntry *uncounted_entry = &entry;
+    auto &slot = FindPathSlot(entry);
+    if (slot.generation != gGeneration) {
+      slot.all_count = slot.init_count;
+      slot.count = 0;
+      slot.generation = gGeneration;
+      gCurrPaths.push_back(slot.path);
+    }
 
-    auto &count = gCurrPaths[*uncounted_entry];
-    auto &all_count = gAllPaths[*uncounted_entry];
     if (FLAGS_count_path_executions) {
-      count += entry.count;
-      const auto log_count = log2ish(count);
+      const auto old_log_count = log2ish(slot.count);
+      slot.count += entry.count;
+      const auto log_count = log2ish(slot.count);
+      if (old_log_count != log_count) {
+        UpdatePathHash(slot.path, old_log_count, log_count);
+      }
 
       // Executed some path an order of magnitude more than before.
-      if (all_count < log_count) {
-        gHasNewPathCoverage = true;
-        all_count = log_count;
+      if (slot.all_count < log_count) {
+        slot.all_count = log_count;
+        if (!gSharedCoverage) {
+          gHasNewPathCoverage = true;
+
+        // Some other instance might have already executed this path as
+        // many times. Either way, later testcases are compared against
+        // everyone's coverage.
+        } else {
+          auto shared_count = MaxSharedPathCount(slot.path, log_count);
+          if (shared_count < log_count) {
+            gHasNewPathCoverage = true;
+          }
+          slot.all_count = std::max(log_count, shared_count);
+          slot.init_count = std::max(slot.init_count, slot.all_count);
+        }
       }
     }
 
@@ -134,84 +448,95 @@ extern void UpdateCoverageSet(void) {
 
 }  // extern C
 
+uint8_t *EdgeBitmap(void) {
+  return gUseEdgeBitmap ? gEdgeBitmap : nullptr;
+}
+
 void InitPathCoverage(void) {
   if (!FLAGS_path_coverage) {
     return;
   }
 
+  GRANARY_ASSERT(("path" == FLAGS_coverage_mode ||
+                  "edge_bitmap" == FLAGS_coverage_mode) &&
+                 "Invalid coverage mode.");
+
   // Multi-way branches (jCC, call r/m, jmp r/m, and ret) are the only
   // possible input-dependent branches. Direct jumps and calls are ignored
-  // because they contribute no new information.
-  granary::code::AddInstrumentationFunction(
-      granary::code::InstrumentationPoint::kInstrumentMultiWayBranch,
-      CoverPath);
+  // because they contribute no new information. In edge bitmap mode, the
+  // counters of these branches are updated inline by translated code.
+  if ("edge_bitmap" == FLAGS_coverage_mode) {
+    gUseEdgeBitmap = true;
+    InitEdgeCountBuckets();
+  } else {
+    granary::code::AddInstrumentationFunction(
+        granary::code::InstrumentationPoint::kInstrumentMultiWayBranch,
+        CoverPath,
+        CoverPathAFlagsDead);
+  }
+
+  if (!FLAGS_shared_coverage_file.empty()) {
+    MapSharedCoverage();
+  }
 
   if (FLAGS_coverage_file.empty() ||
       FLAGS_coverage_file == "/dev/null") {
     return;
   }
 
-  GRANARY_IF_ASSERT( errno = 0; )
-  auto fd = open(FLAGS_coverage_file.c_str(),
-                 O_RDONLY | O_CLOEXEC | O_CREAT | O_LARGEFILE, 0666);
-  GRANARY_ASSERT(!errno && "Unable to open a coverage file.");
-
-  struct stat file_info;
-  fstat(fd, &file_info);
-  GRANARY_ASSERT(!errno && "Unable to stat the coverage file.");
-
-  auto size = static_cast<size_t>(file_info.st_size);
-
-  // Likely that we just created the coverage file.
-  if (!size) {
-    close(fd);
+  // Likely that the coverage file hasn't been created yet.
+  CoverageFileReader reader;
+  if (!reader.Open(FLAGS_coverage_file.c_str())) {
     return;
   }
 
-  // Verify that we have the right number of entries.
-  GRANARY_ASSERT(0 == (size % sizeof(CountedPathEntry)));
-
-  auto num_entries = size / sizeof(CountedPathEntry);
-  for (size_t i = 0; i < num_entries; ) {
-    auto bytes_read_ = read(fd, &(gPathEntries[0]), sizeof(gPathEntries));
-    GRANARY_ASSERT(!errno && "Unable to read path entries.");
-
-    // Figure out how many entries we've read.
-    auto bytes_read = static_cast<size_t>(bytes_read_);
-    auto num_entries_read = bytes_read / sizeof(CountedPathEntry);
-    GRANARY_ASSERT(num_entries_read < kMaxNumBufferedPathEntries);
-
-    i += num_entries_read;
-
-    // We didn't read a complete number of entries; back us up.
-    if (0 != (bytes_read % sizeof(PathEntry))) {
-      lseek(fd, static_cast<off_t>(i * sizeof(CountedPathEntry)), SEEK_SET);
-      GRANARY_ASSERT(!errno && "Unable to seek to valid path entry.");
-    }
-
-    // Process the entries that we have read.
-    for (size_t e = 0; e < num_entries_read; ++e) {
-      PathEntry *uncounted_entry = &gPathEntries[e];
-      gAllPathsAtInit[*uncounted_entry] = gPathEntries[e].count;
-      gPathEntries[e] = {};
-    }
+  if (gUseEdgeBitmap) {
+    GRANARY_ASSERT(kCoverageFileEdgeBuckets == reader.Kind() &&
+                   sizeof gEdgeBucketsAtInit == reader.NumEdgeBuckets() &&
+                   "Coverage file is not an edge bitmap coverage file.");
+    memcpy(gEdgeBucketsAtInit, reader.EdgeBuckets(),
+           sizeof gEdgeBucketsAtInit);
+    return;
   }
 
-  close(fd);
+  GRANARY_ASSERT(kCoverageFilePaths == reader.Kind() &&
+                 "Coverage file is not a path coverage file.");
+  for (CoverageRecord record; reader.Next(&record); ) {
+    PathEntry path = {record.block_pc_of_last_branch,
+                      record.block_pc_of_branch,
+                      record.target_block_pc_of_branch};
+    auto &slot = FindPathSlot(path);
+    slot.init_count = std::max(slot.init_count, record.count);
+  }
 }
 
 void BeginPathCoverage(void) {
   gInputLengthMarked = false;
   gMarkedInputLength = 0;
-  gNextPathEntry = 0;
   gHasNewPathCoverage = false;
+  if (gUseEdgeBitmap) {
+    gLastScannedInputIndex = 0;
+    memset(gEdgeBitmap, 0, sizeof gEdgeBitmap);
+    memcpy(gEdgeBuckets, gEdgeBucketsAtInit, sizeof gEdgeBuckets);
+    return;
+  }
+
+  // Only the buffered entries need clearing. Moving to the next generation
+  // implicitly resets the counts of every path to their initial values.
+  memset(&(gPathEntries[0]), 0, gNextPathEntry);
+  gNextPathEntry = 0;
   gCurrPaths.clear();
-  gAllPaths = gAllPathsAtInit;
-  memset(&(gPathEntries[0]), 0, sizeof(gPathEntries));
+  gPathHash[0] = 0;
+  gPathHash[1] = 0;
+  ++gGeneration;
 }
 
 void EndPathCoverage(void) {
-  UpdateCoverageSet();
+  if (gUseEdgeBitmap) {
+    UpdateEdgeBuckets();
+  } else {
+    UpdateCoverageSet();
+  }
   MarkCoveredInputLength();
 }
 
@@ -224,6 +549,17 @@ void ExitPathCoverage(void) {
     return;
   }
 
+  if (gSharedCoverage) {
+    munmap(gSharedCoverage, gSharedCoverageSize);
+    gSharedCoverage = nullptr;
+  }
+
+  if (gNumUnsharedPaths) {
+    std::cerr << std::dec << gNumUnsharedPaths << " paths were treated as "
+              << "already covered because the shared path coverage map was "
+              << "full." << std::endl;
+  }
+
   if (FLAGS_output_coverage_file.empty() ||
       FLAGS_output_coverage_file == "/dev/null") {
     return;
@@ -233,46 +569,65 @@ void ExitPathCoverage(void) {
   ss << FLAGS_output_coverage_file << "." << getpid();
   auto cov_file = ss.str();
 
-  GRANARY_IF_ASSERT( errno = 0; )
-  auto fd = open(
-      cov_file.c_str(),
-      O_RDWR | O_CLOEXEC | O_CREAT | O_LARGEFILE | O_TRUNC,
-      0666);
-  GRANARY_ASSERT(!errno && "Unable to open a coverage file.");
-
-  for (const auto &entry : gAllPaths) {
-    if (entry.second) {
-      GRANARY_ASSERT(entry.second >= gAllPathsAtInit[entry.first] &&
-                     "Invalid path counting!");
+  CoverageFileWriter writer;
+  if (gUseEdgeBitmap) {
+    writer.Open(cov_file.c_str(), kCoverageFileEdgeBuckets, false);
+    writer.AddEdgeBuckets(gEdgeBuckets, sizeof gEdgeBuckets);
+    CommitCoverageFile(writer, cov_file);
+    return;
+  }
 
-      CountedPathEntry counted_entry = {};
-      *reinterpret_cast<PathEntry *>(&counted_entry) = entry.first;
-      counted_entry.count = entry.second;
-      write(fd, &counted_entry, sizeof(counted_entry));
+  std::vector<CoverageRecord> records;
+  records.reserve(gNumUsedPathSlots);
+  for (const auto &slot : gPathSlots) {
+    if (!slot.is_used) continue;
+    if (auto all_count = AllCount(slot)) {
+      GRANARY_ASSERT(all_count >= slot.init_count &&
+                     "Invalid path counting!");
+      records.push_back({slot.path.block_pc_of_last_branch,
+                         slot.path.block_pc_of_branch,
+                         slot.path.target_block_pc_of_branch,
+                         all_count});
     }
   }
 
-  close(fd);
-  rename(cov_file.c_str(), FLAGS_output_coverage_file.c_str());
+  SortCoverageRecords(&records);
+  writer.Open(cov_file.c_str(), kCoverageFilePaths,
+              FLAGS_compress_coverage_file);
+  for (const auto &record : records) {
+    writer.Add(record);
+  }
+  CommitCoverageFile(writer, cov_file);
 }
 
 std::string PathCoverageHash(void) {
-  MD5 hash;
-  for (const auto &entry : gCurrPaths) {
-    if (entry.second) {
-      CountedPathEntry counted_entry = {};
-      *reinterpret_cast<PathEntry *>(&counted_entry) = entry.first;
-      counted_entry.count = log2ish(entry.second);
-      hash.update(reinterpret_cast<const char *>(&counted_entry),
-                  sizeof(counted_entry));
-    }
+  if (gUseEdgeBitmap) {
+    MD5 hash;
+    ForEachCoveredEdge([&hash] (size_t i, uint8_t bucket) {
+      uint32_t covered_edge[2] = {static_cast<uint32_t>(i), bucket};
+      hash.update(reinterpret_cast<const char *>(covered_edge),
+                  sizeof covered_edge);
+    });
+    hash.finalize();
+    return hash.hexdigest();
   }
 
-  hash.finalize();
-  return hash.hexdigest();
+  std::stringstream ss;
+  ss << std::hex << std::setfill('0')
+     << std::setw(16) << gPathHash[0]
+     << std::setw(16) << gPathHash[1];
+  return ss.str();
 }
 
 void MarkCoveredInputLength(void) {
+
+  // The edge bitmap only needs to be scanned if more input has been read
+  // since the last scan, otherwise the marked input length would be the same.
+  if (gUseEdgeBitmap && !gInputLengthMarked &&
+      (!gInputIndex || gInputIndex != gLastScannedInputIndex)) {
+    gLastScannedInputIndex = gInputIndex;
+    UpdateEdgeBuckets();
+  }
   if (FLAGS_path_coverage && gHasNewPathCoverage && !gInputLengthMarked) {
     GRANARY_ASSERT(gInputIndex &&
                    "Cannot cover new code without reading inputs.");
@@ -289,8 +644,106 @@ size_t GetCoveredInputLength(void) {
 }
 
 size_t GetNumCoveredPaths(void) {
+  if (gUseEdgeBitmap) {
+    size_t num_covered_edges = 0;
+    ForEachCoveredEdge([&num_covered_edges] (size_t, uint8_t) {
+      ++num_covered_edges;
+    });
+    return num_covered_edges;
+  }
   return gCurrPaths.size();
 }
 
+namespace {
+
+// Coverage state of the current testcase that isn't stored in the path slots
+// or in the edge bitmap.
+struct CoverageCheckpoint {
+  uint64_t path_hash[2];
+  size_t marked_input_length;
+  size_t last_scanned_input_index;
+  bool has_new_path_coverage;
+  bool input_length_marked;
+};
+
+// A path executed by the current testcase.
+struct CheckpointedPath {
+  PathEntry path;
+  uint32_t count;
+  uint32_t all_count;
+};
+
+template <typename T>
+static void AppendBytes(std::vector<uint8_t> *data, const T *vals,
+                        size_t num_vals) {
+  auto bytes = reinterpret_cast<const uint8_t *>(vals);
+  data->insert(data->end(), bytes, bytes + num_vals * sizeof(T));
+}
+
+}  // namespace
+
+void CheckpointPathCoverage(std::vector<uint8_t> *data) {
+  data->clear();
+  if (!gUseEdgeBitmap) {
+    UpdateCoverageSet();
+  }
+
+  CoverageCheckpoint checkpoint = {
+    {gPathHash[0], gPathHash[1]},
+    gMarkedInputLength,
+    gLastScannedInputIndex,
+    gHasNewPathCoverage,
+    gInputLengthMarked
+  };
+  AppendBytes(data, &checkpoint, 1);
+
+  if (gUseEdgeBitmap) {
+    AppendBytes(data, gEdgeBitmap, kEdgeBitmapSize);
+    AppendBytes(data, gEdgeBuckets, kEdgeBitmapSize);
+    return;
+  }
+
+  data->reserve(data->size() + gCurrPaths.size() * sizeof(CheckpointedPath));
+  for (const auto &path : gCurrPaths) {
+    const auto &slot = FindPathSlot(path);
+    CheckpointedPath checkpointed_path = {path, slot.count, slot.all_count};
+    AppendBytes(data, &checkpointed_path, 1);
+  }
+}
+
+void RestorePathCoverage(const std::vector<uint8_t> &data) {
+  CoverageCheckpoint checkpoint;
+  memcpy(&checkpoint, data.data(), sizeof checkpoint);
+  gPathHash[0] = checkpoint.path_hash[0];
+  gPathHash[1] = checkpoint.path_hash[1];
+  gMarkedInputLength = checkpoint.marked_input_length;
+  gLastScannedInputIndex = checkpoint.last_scanned_input_index;
+  gHasNewPathCoverage = checkpoint.has_new_path_coverage;
+  gInputLengthMarked = checkpoint.input_length_marked;
+
+  auto bytes = data.data() + sizeof checkpoint;
+  if (gUseEdgeBitmap) {
+    memcpy(gEdgeBitmap, bytes, kEdgeBitmapSize);
+    memcpy(gEdgeBuckets, bytes + kEdgeBitmapSize, kEdgeBitmapSize);
+    return;
+  }
+
+  // The paths of the checkpoint become the paths of the current testcase.
+  auto num_paths = (data.size() - sizeof checkpoint) /
+                   sizeof(CheckpointedPath);
+  gCurrPaths.clear();
+  gCurrPaths.reserve(num_paths);
+  for (auto i = 0UL; i < num_paths; ++i) {
+    CheckpointedPath checkpointed_path;
+    memcpy(&checkpointed_path, bytes + i * sizeof checkpointed_path,
+           sizeof checkpointed_path);
+    auto &slot = FindPathSlot(checkpointed_path.path);
+    slot.generation = gGeneration;
+    slot.count = checkpointed_path.count;
+    slot.all_count = checkpointed_path.all_count;
+    gCurrPaths.push_back(checkpointed_path.path);
+  }
+}
+
 }  // namespace code
 }  // namespace granary
@@ -4,10 +4,39 @@
 #define CLIENT_COVERAGE_H_
 
 #include <string>
+#include <vector>
+
+#include "granary/base/base.h"
 
 namespace granary {
 namespace code {
 
+enum : size_t {
+  // Number of 8-bit counters in the edge bitmap. Translated code computes the
+  // index of a counter by truncating to 16 bits.
+  kEdgeBitmapSize = 1ULL << 16ULL
+};
+
+// Returns the ID of the multi-way branch at the end of the block `block_pc`,
+// as it is mixed into the edge bitmap index of each of its targets.
+inline uint32_t EdgeBitmapBranchId(AppPC32 block_pc) {
+  return (block_pc * 0x9E3779B1U) >> 16U;
+}
+
+// Returns the index of the counter for the edge from the multi-way branch at
+// the end of `block_pc` to `target_pc`. Translated code computes this without
+// changing the flags, i.e. as `LEA`s followed by a 16-bit `MOVZX`, so this
+// must match `CoverEdge` in `arch/x86/block.cc`.
+inline uint32_t EdgeBitmapIndex(AppPC32 block_pc, AppPC32 target_pc) {
+  return (target_pc * 45U + EdgeBitmapBranchId(block_pc)) &
+         static_cast<uint32_t>(kEdgeBitmapSize - 1);
+}
+
+// Returns the bitmap of edge counters that translated code should update
+// inline at every multi-way branch, or `nullptr` if edge coverage is not
+// enabled.
+uint8_t *EdgeBitmap(void);
+
 void InitPathCoverage(void);
 void BeginPathCoverage(void);
 void EndPathCoverage(void);
@@ -18,6 +47,12 @@ void MarkCoveredInputLength(void);
 size_t GetCoveredInputLength(void);
 size_t GetNumCoveredPaths(void);
 
+// Saves the coverage of the current testcase into `data`, and later restores
+// it, so that a testcase can resume from a checkpoint as if it had executed
+// from the beginning.
+void CheckpointPathCoverage(std::vector<uint8_t> *data);
+void RestorePathCoverage(const std::vector<uint8_t> &data);
+
 }  // namespace code
 }  // namespace granary
 
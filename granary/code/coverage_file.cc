@@ -0,0 +1,376 @@
+/* Copyright 2016 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "granary/code/coverage.h"
+#include "granary/code/coverage_file.h"
+
+#ifndef O_LARGEFILE
+# define O_LARGEFILE 0
+#endif
+
+namespace granary {
+namespace code {
+namespace {
+
+enum : size_t {
+  kMaxNumBufferedBytes = 1ULL << 16ULL
+};
+
+enum : uint32_t {
+  // Path counts are the order of magnitude of a 32-bit execution count.
+  kMaxLegacyRecordCount = 32
+};
+
+// Returns `true` if the `size` bytes at `file` are a headerless array of path
+// records. Every legacy record was written with a non-zero count, whereas
+// a headerless edge bucket file is mostly zeroes.
+static bool IsLegacyPathFile(const uint8_t *file, size_t size) {
+  if (size % sizeof(CoverageRecord)) return false;
+  for (size_t offset = 0; offset < size; offset += sizeof(CoverageRecord)) {
+    CoverageRecord record;
+    memcpy(&record, file + offset, sizeof record);
+    if (!record.count || kMaxLegacyRecordCount < record.count) return false;
+  }
+  return true;
+}
+
+// Writes all `size` bytes of `data` to `fd`, at `offset` if it isn't
+// negative. Returns `false` if the write failed.
+static bool WriteAll(int fd, const void *data, size_t size, off_t offset) {
+  auto bytes = reinterpret_cast<const uint8_t *>(data);
+  while (size) {
+    auto ret = 0 > offset ? write(fd, bytes, size) :
+                            pwrite(fd, bytes, size, offset);
+    if (0 > ret) {
+      if (EINTR == errno) continue;
+      return false;
+    } else if (!ret) {
+      errno = EIO;
+      return false;
+    }
+    bytes += ret;
+    size -= static_cast<size_t>(ret);
+    if (0 <= offset) offset += ret;
+  }
+  return true;
+}
+
+static void EncodeVarint(std::vector<uint8_t> &buffer, uint32_t val) {
+  while (val >= 0x80U) {
+    buffer.push_back(static_cast<uint8_t>(val | 0x80U));
+    val >>= 7U;
+  }
+  buffer.push_back(static_cast<uint8_t>(val));
+}
+
+static uint32_t DecodeVarint(const uint8_t *&data, const uint8_t *data_end) {
+  uint32_t val = 0;
+  for (auto shift = 0U; shift < 35U; shift += 7U) {
+    GRANARY_ASSERT(data < data_end && "Truncated coverage file.");
+    auto byte = *data++;
+    val |= static_cast<uint32_t>(byte & 0x7FU) << shift;
+    if (!(byte & 0x80U)) break;
+  }
+  return val;
+}
+
+}  // namespace
+
+void SortCoverageRecords(std::vector<CoverageRecord> *records) {
+  if (records->empty()) return;
+  std::sort(records->begin(), records->end());
+  auto last = records->begin();
+  for (auto it = last + 1; it != records->end(); ++it) {
+    if (last->HasSamePath(*it)) {
+      last->count = std::max(last->count, it->count);
+    } else {
+      *++last = *it;
+    }
+  }
+  records->erase(last + 1, records->end());
+}
+
+CoverageFileReader::CoverageFileReader(void)
+    : file(nullptr),
+      file_size(0),
+      header(),
+      data(nullptr),
+      data_end(nullptr),
+      prev_record(),
+      num_records_read(0),
+      legacy_records() {}
+
+CoverageFileReader::~CoverageFileReader(void) {
+  if (file) {
+    munmap(const_cast<uint8_t *>(file), file_size);
+  }
+}
+
+bool CoverageFileReader::Open(const char *path) {
+  GRANARY_ASSERT(!file && "Coverage file is already open.");
+  auto fd = open(path, O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+  if (-1 == fd) {
+    errno = 0;
+    return false;
+  }
+
+  struct stat file_info;
+  GRANARY_IF_ASSERT( errno = 0; )
+  fstat(fd, &file_info);
+  GRANARY_ASSERT(!errno && "Unable to stat the coverage file.");
+
+  file_size = static_cast<size_t>(file_info.st_size);
+  if (!file_size) {
+    close(fd);
+    return false;
+  }
+
+  auto ret = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                  fd, 0);
+  GRANARY_ASSERT(!errno && MAP_FAILED != ret &&
+                 "Unable to map the coverage file.");
+  close(fd);
+
+  file = reinterpret_cast<const uint8_t *>(ret);
+  if (file_size >= sizeof header) {
+    memcpy(&header, file, sizeof header);
+  }
+
+  if (kCoverageFileMagic == header.magic) {
+    GRANARY_ASSERT(kCoverageFileVersion == header.version &&
+                   "Unsupported coverage file version.");
+    GRANARY_ASSERT(file_size == (sizeof header + header.num_data_bytes) &&
+                   "Truncated coverage file.");
+    data = file + sizeof header;
+    data_end = data + header.num_data_bytes;
+    return true;
+  }
+
+  memset(&header, 0, sizeof header);
+
+  // Edge bucket file from before the coverage file was versioned.
+  if (!IsLegacyPathFile(file, file_size)) {
+    if (kEdgeBitmapSize != file_size) {
+      std::cerr << "Invalid coverage file: " << path << std::endl;
+      munmap(const_cast<uint8_t *>(file), file_size);
+      file = nullptr;
+      file_size = 0;
+      return false;
+    }
+    header.kind = kCoverageFileEdgeBuckets;
+    header.num_records = file_size;
+    header.num_data_bytes = file_size;
+    data = file;
+    data_end = file + file_size;
+    return true;
+  }
+
+  // Legacy path coverage file.
+  header.kind = kCoverageFilePaths;
+  header.num_records = file_size / sizeof(CoverageRecord);
+  legacy_records.resize(header.num_records);
+  memcpy(legacy_records.data(), file, file_size);
+  SortCoverageRecords(&legacy_records);
+  header.num_records = legacy_records.size();
+  return true;
+}
+
+CoverageFileKind CoverageFileReader::Kind(void) const {
+  return static_cast<CoverageFileKind>(header.kind);
+}
+
+bool CoverageFileReader::Next(CoverageRecord *record) {
+  GRANARY_ASSERT(kCoverageFilePaths == header.kind &&
+                 "Can't read paths from this kind of coverage file.");
+  if (num_records_read >= header.num_records) {
+    return false;
+  }
+
+  if (!legacy_records.empty()) {
+    *record = legacy_records[num_records_read++];
+    return true;
+  }
+
+  ++num_records_read;
+  if (!(header.flags & kCoverageFileCompressed)) {
+    GRANARY_ASSERT(data + sizeof *record <= data_end &&
+                   "Truncated coverage file.");
+    memcpy(record, data, sizeof *record);
+    data += sizeof *record;
+    return true;
+  }
+
+  // Each field is a delta against the previous record's, until the first
+  // field that differs, and that field's successors are stored in full.
+  auto last_branch_delta = DecodeVarint(data, data_end);
+  auto branch = DecodeVarint(data, data_end);
+  auto target = DecodeVarint(data, data_end);
+  record->count = DecodeVarint(data, data_end);
+  record->block_pc_of_last_branch =
+      prev_record.block_pc_of_last_branch + last_branch_delta;
+  if (last_branch_delta) {
+    record->block_pc_of_branch = branch;
+    record->target_block_pc_of_branch = target;
+  } else {
+    record->block_pc_of_branch = prev_record.block_pc_of_branch + branch;
+    if (branch) {
+      record->target_block_pc_of_branch = target;
+    } else {
+      record->target_block_pc_of_branch =
+          prev_record.target_block_pc_of_branch + target;
+    }
+  }
+  prev_record = *record;
+  return true;
+}
+
+const uint8_t *CoverageFileReader::EdgeBuckets(void) const {
+  GRANARY_ASSERT(kCoverageFileEdgeBuckets == header.kind &&
+                 "Not an edge bucket coverage file.");
+  return data;
+}
+
+size_t CoverageFileReader::NumEdgeBuckets(void) const {
+  GRANARY_ASSERT(kCoverageFileEdgeBuckets == header.kind &&
+                 "Not an edge bucket coverage file.");
+  return static_cast<size_t>(data_end - data);
+}
+
+CoverageFileWriter::CoverageFileWriter(void)
+    : fd(-1),
+      header(),
+      failed(false),
+      has_pending_record(false),
+      pending_record(),
+      prev_record(),
+      buffer() {}
+
+CoverageFileWriter::~CoverageFileWriter(void) {
+  GRANARY_ASSERT(-1 == fd && "Coverage file was not closed.");
+}
+
+void CoverageFileWriter::Open(const char *path, CoverageFileKind kind,
+                              bool compress) {
+  GRANARY_IF_ASSERT( errno = 0; )
+  fd = open(path, O_RDWR | O_CLOEXEC | O_CREAT | O_LARGEFILE | O_TRUNC, 0666);
+  GRANARY_ASSERT(!errno && "Unable to open a coverage file.");
+
+  failed = false;
+  memset(&header, 0, sizeof header);
+  header.magic = kCoverageFileMagic;
+  header.version = kCoverageFileVersion;
+  header.kind = kind;
+  if (compress && kCoverageFilePaths == kind) {
+    header.flags = kCoverageFileCompressed;
+  }
+
+  // The header is written for real once the sizes are known.
+  buffer.reserve(kMaxNumBufferedBytes + sizeof header);
+  buffer.resize(sizeof header);
+}
+
+void CoverageFileWriter::Add(const CoverageRecord &record) {
+  GRANARY_ASSERT(kCoverageFilePaths == header.kind &&
+                 "Can't write paths to this kind of coverage file.");
+  if (has_pending_record) {
+    if (pending_record.HasSamePath(record)) {
+      pending_record.count = std::max(pending_record.count, record.count);
+      return;
+    }
+    GRANARY_ASSERT(pending_record < record &&
+                   "Paths must be added in sorted order.");
+    Encode(pending_record);
+  }
+  pending_record = record;
+  has_pending_record = true;
+}
+
+void CoverageFileWriter::AddEdgeBuckets(const uint8_t *buckets,
+                                        size_t num_buckets) {
+  GRANARY_ASSERT(kCoverageFileEdgeBuckets == header.kind &&
+                 "Can't write edges to this kind of coverage file.");
+  buffer.insert(buffer.end(), buckets, buckets + num_buckets);
+  header.num_records += num_buckets;
+  header.num_data_bytes += num_buckets;
+  Flush();
+}
+
+void CoverageFileWriter::Encode(const CoverageRecord &record) {
+  auto old_size = buffer.size();
+  if (!(header.flags & kCoverageFileCompressed)) {
+    auto bytes = reinterpret_cast<const uint8_t *>(&record);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof record);
+
+  } else if (record.block_pc_of_last_branch !=
+             prev_record.block_pc_of_last_branch) {
+    EncodeVarint(buffer, record.block_pc_of_last_branch -
+                         prev_record.block_pc_of_last_branch);
+    EncodeVarint(buffer, record.block_pc_of_branch);
+    EncodeVarint(buffer, record.target_block_pc_of_branch);
+    EncodeVarint(buffer, record.count);
+
+  } else if (record.block_pc_of_branch != prev_record.block_pc_of_branch) {
+    EncodeVarint(buffer, 0);
+    EncodeVarint(buffer, record.block_pc_of_branch -
+                         prev_record.block_pc_of_branch);
+    EncodeVarint(buffer, record.target_block_pc_of_branch);
+    EncodeVarint(buffer, record.count);
+
+  } else {
+    EncodeVarint(buffer, 0);
+    EncodeVarint(buffer, 0);
+    EncodeVarint(buffer, record.target_block_pc_of_branch -
+                         prev_record.target_block_pc_of_branch);
+    EncodeVarint(buffer, record.count);
+  }
+
+  prev_record = record;
+  header.num_records += 1;
+  header.num_data_bytes += buffer.size() - old_size;
+  if (buffer.size() >= kMaxNumBufferedBytes) {
+    Flush();
+  }
+}
+
+// Writes out the buffered data. After a failed write, nothing more is
+// written, and `Close` reports the failure.
+void CoverageFileWriter::Flush(void) {
+  if (!failed && !buffer.empty() &&
+      !WriteAll(fd, buffer.data(), buffer.size(), -1)) {
+    std::cerr << "Unable to write to the coverage file: "
+              << strerror(errno) << std::endl;
+    failed = true;
+    errno = 0;
+  }
+  buffer.clear();
+}
+
+bool CoverageFileWriter::Close(void) {
+  if (has_pending_record) {
+    Encode(pending_record);
+    has_pending_record = false;
+  }
+  Flush();
+
+  if (!failed && !WriteAll(fd, &header, sizeof header, 0)) {
+    std::cerr << "Unable to write the coverage file header: "
+              << strerror(errno) << std::endl;
+    failed = true;
+    errno = 0;
+  }
+  close(fd);
+  fd = -1;
+  return !failed;
+}
+
+}  // namespace code
+}  // namespace granary
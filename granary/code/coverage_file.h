@@ -0,0 +1,143 @@
+/* Copyright 2016 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+#ifndef GRANARY_CODE_COVERAGE_FILE_H_
+#define GRANARY_CODE_COVERAGE_FILE_H_
+
+#include <vector>
+
+#include "granary/base/base.h"
+
+namespace granary {
+namespace code {
+
+enum : uint32_t {
+  kCoverageFileMagic = 0x56435247U,  // "GRCV".
+  kCoverageFileVersion = 1U
+};
+
+enum CoverageFileKind : uint16_t {
+  // Sorted `CoverageRecord`s, one per path.
+  kCoverageFilePaths = 0,
+
+  // `kEdgeBitmapSize` bucketed edge counters.
+  kCoverageFileEdgeBuckets = 1
+};
+
+enum CoverageFileFlags : uint16_t {
+  // Paths are delta-encoded against the previous path, and every field is
+  // stored as a LEB128 varint.
+  kCoverageFileCompressed = 1
+};
+
+struct CoverageFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint16_t kind;
+  uint16_t flags;
+  uint32_t reserved;
+  uint64_t num_records;
+  uint64_t num_data_bytes;
+} __attribute__((packed));
+
+// A path, and the order of magnitude of the number of times it was executed.
+// Records are ordered by their paths only.
+struct CoverageRecord {
+  Addr32 block_pc_of_last_branch;
+  Addr32 block_pc_of_branch;
+  Addr32 target_block_pc_of_branch;
+  uint32_t count;
+
+  inline bool HasSamePath(const CoverageRecord &that) const {
+    return block_pc_of_last_branch == that.block_pc_of_last_branch &&
+           block_pc_of_branch == that.block_pc_of_branch &&
+           target_block_pc_of_branch == that.target_block_pc_of_branch;
+  }
+
+  inline bool operator<(const CoverageRecord &that) const {
+    if (block_pc_of_last_branch != that.block_pc_of_last_branch) {
+      return block_pc_of_last_branch < that.block_pc_of_last_branch;
+    } else if (block_pc_of_branch != that.block_pc_of_branch) {
+      return block_pc_of_branch < that.block_pc_of_branch;
+    } else {
+      return target_block_pc_of_branch < that.target_block_pc_of_branch;
+    }
+  }
+} __attribute__((packed));
+
+static_assert(16 == sizeof(CoverageRecord),
+              "Invalid packing of `struct CoverageRecord`.");
+
+// Sorts `records` by their paths, and merges records of the same path by
+// keeping the biggest count.
+void SortCoverageRecords(std::vector<CoverageRecord> *records);
+
+// Reads a coverage file by mapping it into memory. Paths are decoded one at
+// a time and in sorted order, so many files can be merged in one pass.
+//
+// Note: Files from before the coverage file was versioned are headerless.
+//       Path files are an array of unsorted records, which are read into
+//       memory and sorted, and edge bucket files are just the buckets.
+class CoverageFileReader {
+ public:
+  CoverageFileReader(void);
+  ~CoverageFileReader(void);
+
+  // Returns `false` if the file doesn't exist, is empty, or is a headerless
+  // file that is neither a legacy path nor a legacy edge bucket file.
+  bool Open(const char *path);
+
+  CoverageFileKind Kind(void) const;
+
+  // Reads the next path. Returns `false` when there are no more paths.
+  bool Next(CoverageRecord *record);
+
+  // Returns the edge buckets of an edge bucket coverage file.
+  const uint8_t *EdgeBuckets(void) const;
+  size_t NumEdgeBuckets(void) const;
+
+ private:
+  const uint8_t *file;
+  size_t file_size;
+  CoverageFileHeader header;
+  const uint8_t *data;
+  const uint8_t *data_end;
+  CoverageRecord prev_record;
+  uint64_t num_records_read;
+  std::vector<CoverageRecord> legacy_records;
+
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(CoverageFileReader);
+};
+
+// Writes out a coverage file. Paths must be added in sorted order; adding
+// the same path multiple times keeps the biggest count.
+class CoverageFileWriter {
+ public:
+  CoverageFileWriter(void);
+  ~CoverageFileWriter(void);
+
+  void Open(const char *path, CoverageFileKind kind, bool compress);
+  void Add(const CoverageRecord &record);
+  void AddEdgeBuckets(const uint8_t *buckets, size_t num_buckets);
+
+  // Returns `false` if any part of the file couldn't be written.
+  bool Close(void);
+
+ private:
+  void Encode(const CoverageRecord &record);
+  void Flush(void);
+
+  int fd;
+  CoverageFileHeader header;
+  bool failed;
+  bool has_pending_record;
+  CoverageRecord pending_record;
+  CoverageRecord prev_record;
+  std::vector<uint8_t> buffer;
+
+  GRANARY_DISALLOW_COPY_AND_ASSIGN(CoverageFileWriter);
+};
+
+}  // namespace code
+}  // namespace granary
+
+#endif  // GRANARY_CODE_COVERAGE_FILE_H_
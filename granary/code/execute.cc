@@ -2,9 +2,13 @@
 
 #include "granary/code/execute.h"
 
+#include "granary/arch/patch.h"
+
 #include "granary/code/block.h"
 #include "granary/code/cache.h"
 #include "granary/code/index.h"
+#include "granary/code/instrument.h"
+#include "granary/code/profile.h"
 #include "granary/code/trace.h"
 
 #include "granary/os/process.h"
@@ -13,11 +17,32 @@
 
 #include <iostream>
 #include <iomanip>
+#include <limits>
 
 DEFINE_bool(disable_tracing, false, "Disable building superblocks.");
 DEFINE_bool(disable_inline_cache, false, "Disable the inline cache.");
 DEFINE_bool(debug_print_executions, false, "Print all block executions.");
 DEFINE_bool(debug_print_pcs, false, "Print PCs executed by the program.");
+DEFINE_int64(exec_budget, 0, "Maximum number of dispatches and back-edges "
+                             "that a testcase can execute before it is "
+                             "treated as a hang. Zero means no budget.");
+
+DECLARE_bool(shared_cache);
+
+extern "C" {
+
+// Remaining execution budget of the current testcase. This is decremented by
+// the dispatcher in `cache.S`, and by translated code on back-edges.
+int64_t gExecBudget = std::numeric_limits<int64_t>::max();
+
+// Whether or not the dispatcher charges `gExecBudget`.
+bool gHasExecBudget = false;
+
+// Charge one unit of the budget on a back-edge.
+extern void ChargeExecBudget(void);
+extern void ChargeExecBudgetAFlagsDead(void);
+
+}  // extern C
 
 namespace granary {
 namespace code {
@@ -26,15 +51,7 @@ namespace {
 // Translate a block.
 static index::Value Translate(os::Process32 *process, index::Key key) {
   Block block;
-
-  // Safely reads instruction bytes into memory. This only reads bytes that are
-  // both executable and readable.
-  block.Decode(key.pc32, [=] (Addr32 pc32, uint8_t &byte) -> bool {
-    auto pc64 = process->ConvertPC(pc32);
-    if (!process->TryRead(pc64, byte)) return false;
-    if (!process->CanExecute(pc32)) return false;
-    return true;
-  });
+  block.Decode(process, key.pc32);
 
   index::Value val;
   val.block_pc32 = key.pc32;
@@ -44,6 +61,40 @@ static index::Value Translate(os::Process32 *process, index::Key key) {
 
 }  // namespace
 
+// Instruments back-edges so that they charge the execution budget. Loops
+// that don't go through the dispatcher, e.g. because their branches are
+// hot-patched, contain at least one back-edge.
+void InitExecBudget(void) {
+  gHasExecBudget = 0 < FLAGS_exec_budget;
+  if (gHasExecBudget) {
+    AddInstrumentationFunction(InstrumentationPoint::kInstrumentBackEdge,
+                               ChargeExecBudget,
+                               ChargeExecBudgetAFlagsDead);
+  }
+}
+
+// Gives the next testcase its full execution budget.
+void ResetExecBudget(void) {
+  if (0 < FLAGS_exec_budget) {
+    gExecBudget = FLAGS_exec_budget;
+  } else {
+    gExecBudget = std::numeric_limits<int64_t>::max();
+  }
+}
+
+// Returns how much of its execution budget the current testcase has used.
+int64_t ConsumedExecBudget(void) {
+  return gHasExecBudget ? FLAGS_exec_budget - gExecBudget : 0;
+}
+
+// Gives the current testcase its full execution budget, minus the
+// `num_consumed` units that it used before the checkpoint it resumes from.
+void RestoreExecBudget(int64_t num_consumed) {
+  if (gHasExecBudget) {
+    gExecBudget = FLAGS_exec_budget - num_consumed;
+  }
+}
+
 // Main interpreter loop. This function handles index lookup, block translation,
 // trace building, and dispatching.
 //
@@ -53,6 +104,7 @@ static index::Value Translate(os::Process32 *process, index::Key key) {
 __attribute__((noinline))
 void Execute(os::Process32 *process) {
   TraceRecorder trace;
+  index::Value prev_block;
   for (;;) {
     index::Key key;
     index::Value block;
@@ -68,6 +120,10 @@ void Execute(os::Process32 *process) {
       key = index::Key(process, process->PC());  // Might hash page ranges.
       block = index::Find(key);
       if (GRANARY_LIKELY(block)) {
+
+        // Another process that shares the code cache might have translated
+        // the block, in which case our jumps to it are still waiting.
+        if (FLAGS_shared_cache) arch::LinkSharedPatchPoints(key, block);
         break;
 
       } else if (GRANARY_UNLIKELY(process->TryMakeExecutable())) {
@@ -76,7 +132,7 @@ void Execute(os::Process32 *process) {
       } else {
         block = Translate(process, key);
         index::Insert(key, block);
-        cache::ClearInlineCache();
+        code::ProfileBlock(key, block);
         break;
       }
     }
@@ -88,12 +144,14 @@ void Execute(os::Process32 *process) {
         !block.ends_with_error &&
         !block.ends_with_syscall) {
       cache::InsertIntoInlineCache(process, key, block);
+      cache::InsertIntoIndexMirror(key, block);
     }
 
     // If we can't extend the trace, then build the trace block.
-    if (!FLAGS_disable_tracing && trace.BlockEndsTrace(key, block)) {
+    if (!FLAGS_disable_tracing && trace.Record(key, block, prev_block)) {
       Uninterruptible disable_interrupts;
-      trace.Build();
+      trace.Build(process);
+      cache::Commit();
     }
 
     if (FLAGS_debug_print_executions) {
@@ -120,8 +178,19 @@ void Execute(os::Process32 *process) {
     // block executed. This is important in the case of traces and persistent
     // caches, where the jumps might be hot-patched, thus leading to syscalls.
     process->RestoreFPUState();
-    block = cache::Call(process, cache::OffsetToPC(block.cache_offset));
+    block = cache::Call(process, cache::ValueToPC(block));
     process->SaveFPUState();
+    prev_block = block;
+
+    // The execution budget ran out, either in the dispatcher or on a
+    // back-edge. Execution might have stopped part-way through a trace, so
+    // this goes before checking how `block` ends. Faults also return through
+    // the dispatcher, and take priority.
+    if (GRANARY_UNLIKELY(0 >= gExecBudget) && !process->signal) {
+      process->status = os::ProcessStatus::kTimeout;
+      process->exec_status = os::ExecStatus::kInvalid;
+      return;
+    }
 
     // At the time of translating the block, we determined that the block
     // ended in either an invalid instruction, or crossed into a non-
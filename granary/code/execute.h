@@ -12,6 +12,18 @@ namespace code {
 // trace building, dispatching, and system call handling.
 void Execute(os::Process32 *process);
 
+// Instruments back-edges so that they charge the execution budget, if there
+// is one. This must happen before the code cache is initialized.
+void InitExecBudget(void);
+
+// Gives the next testcase its full execution budget.
+void ResetExecBudget(void);
+
+// Returns how much of its execution budget the current testcase has used, and
+// gives a testcase that resumes from a checkpoint what was left of its budget.
+int64_t ConsumedExecBudget(void);
+void RestoreExecBudget(int64_t num_consumed);
+
 }  // namespace code
 }  // namespace granary
 
@@ -1,17 +1,20 @@
 /* Copyright 2015 Peter Goodman, all rights reserved. */
 
 #include "granary/code/index.h"
-
-#include <unordered_map>
+#include "granary/code/cache.h"
 
 #include <gflags/gflags.h>
 
 #include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <unordered_map>
+#include <vector>
 
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -22,10 +25,6 @@
 # define O_LARGEFILE 0
 #endif
 
-#ifndef MAP_POPULATE
-# define MAP_POPULATE 0
-#endif
-
 #ifdef __APPLE__
 typedef off_t off64_t;
 #endif
@@ -33,13 +32,32 @@ typedef off_t off64_t;
 DECLARE_bool(persist);
 DECLARE_string(persist_dir);
 
+DEFINE_bool(shared_cache, false, "Share the persisted code cache and index "
+                                 "with all other concurrently running "
+                                 "processes that use the same --persist_dir.");
+
 namespace granary {
 namespace index {
 namespace {
 
 enum : uint64_t {
   kMaxNumProbes = 6,
-  kMinNumEntries = 4
+  kMinNumSlots = 1024,
+  kMaxNumSlots = 1ULL << 30,
+
+  // A shared index can't grow, so it starts out big. This is 64 MiB of mostly
+  // sparse file.
+  kNumSharedSlots = 1ULL << 22,
+
+  // A shared index can't grow when a neighborhood fills up, so it tolerates
+  // longer probe sequences instead.
+  kMaxNumSharedProbes = 64,
+
+  // Identifies a persisted index file, and the version of its layout. The
+  // version also covers the layout of the code cache that the index refers
+  // to.
+  kIndexMagic = 0x58444e4952524701ULL,  // "\1GRRINDX".
+  kIndexVersion = 5
 };
 
 struct Entry {
@@ -47,6 +65,31 @@ struct Entry {
   Value val;
 };
 
+static_assert(16 == sizeof(Entry), "Invalid structure packing of `Entry`.");
+
+// The index is an open-addressing hash table whose in-memory layout is also
+// its file format. The first page holds this header, and the remaining pages
+// hold `num_slots` entries.
+struct alignas(os::kPageSize) Header {
+  uint64_t magic;
+  uint64_t version;
+  uint64_t num_slots;
+  uint64_t num_entries;
+
+  // Size of the code cache to which the entries of this index refer.
+  uint64_t cache_size;
+
+  // Instrumentation features of the code cache.
+  uint64_t features;
+};
+
+static_assert(os::kPageSize == sizeof(Header),
+              "Invalid structure packing of `Header`.");
+
+enum : uint64_t {
+  kMaxTableSize = sizeof(Header) + kMaxNumSlots * sizeof(Entry)
+};
+
 struct Hash {
   size_t operator()(const Key key) const {
     XXH64_state_t state;
@@ -56,128 +99,657 @@ struct Hash {
   }
 };
 
-// Pointer to the currently active index.
-static std::unordered_map<Key, Value, Hash> gTable;
+// Header of the currently active index. This is the beginning of a big
+// reserved region of address space, into which the table grows.
+static Header *gHeader = nullptr;
+
+// Slots of the currently active index.
+static Entry *gSlots = nullptr;
+
+// Size (in bytes) of the mapped portion of the index.
+static size_t gTableSize = 0;
+
+// Instrumentation features that the code cache must have.
+static uint64_t gFeatures = 0;
 
-// Path to the persisted cache file.
+// Path to the persisted index checkpoint file.
 static char gIndexPath[256] = {'\0'};
 
-// Was there an old index file before this one?
-static bool gOldIndexExists = false;
+// Path to the persisted index journal file.
+static char gJournalPath[256] = {'\0'};
+
+// Path to the file that serializes the initialization of a shared index.
+static char gLockPath[256] = {'\0'};
+
+// Path to the file whose existence means that a compacted code cache, index,
+// and set of patch points are ready to replace the persisted ones.
+static char gReplacePath[256] = {'\0'};
+
+// File descriptor for the persisted index checkpoint.
+static int gFd = -1;
+
+// File descriptor for the persisted index journal.
+static int gJournalFd = -1;
+
+// Entries inserted since the last commit to the journal.
+static std::vector<Entry> gPendingEntries;
+
+// Entries that didn't fit into the shared index because the neighborhoods of
+// their keys were full.
+static std::unordered_map<uint64_t, Value> gOverflowEntries;
+
+// Number of insertions into `gOverflowEntries`.
+static uint64_t gNumOverflowInserts = 0;
+
+// Size of the code cache as of the last commit to the journal.
+static size_t gCommittedCacheSize = 0;
+
+// Invoked after every insertion into the index.
+static InsertHook gInsertHook = nullptr;
+
+// Maximum number of slots to probe when looking for a key.
+static uint64_t gMaxNumProbes = kMaxNumProbes;
+
+// Returns the size (in bytes) of an index with `num_slots` slots.
+static size_t TableSize(uint64_t num_slots) {
+  return sizeof(Header) + num_slots * sizeof(Entry);
+}
+
+// Make sure that at least `size` bytes of the index are mapped. The table
+// only ever grows, and it always grows in place.
+static void MapTable(size_t size) {
+  if (size <= gTableSize) return;
+  GRANARY_ASSERT(size <= kMaxTableSize && "Code cache index is too big.");
+
+  auto begin = reinterpret_cast<uint8_t *>(gHeader) + gTableSize;
+  GRANARY_IF_ASSERT( errno = 0; )
+  mprotect(begin, size - gTableSize, PROT_READ | PROT_WRITE);
+  GRANARY_ASSERT(!errno && "Unable to map code cache index.");
+  gTableSize = size;
+}
+
+// Returns a pointer to the slot that contains `key`, or to the first empty
+// slot where `key` can be placed. Returns `nullptr` if neither is found
+// within `gMaxNumProbes` probes.
+static Entry *Probe(const Key key) {
+  const auto mask = gHeader->num_slots - 1;
+  auto slot = Hash()(key) & mask;
+  for (auto i = 0ULL; i < gMaxNumProbes; ++i) {
+    auto entry = &(gSlots[slot]);
+    if (key == entry->key || !entry->key) return entry;
+    slot = (slot + 1) & mask;
+  }
+  return nullptr;
+}
+
+// Doubles the number of slots in the index, and re-hashes all entries.
+static void Grow(void) {
+  std::vector<Entry> entries;
+  entries.reserve(gHeader->num_entries);
+  for (auto i = 0ULL; i < gHeader->num_slots; ++i) {
+    if (gSlots[i].key) entries.push_back(gSlots[i]);
+  }
+
+  for (auto num_slots = gHeader->num_slots * 2; ; num_slots *= 2) {
+    GRANARY_ASSERT(num_slots <= kMaxNumSlots && "Code cache index is too big.");
+    MapTable(TableSize(num_slots));
+    memset(gSlots, 0, num_slots * sizeof(Entry));
+    gHeader->num_slots = num_slots;
+
+    auto rehashed = true;
+    for (const auto &entry : entries) {
+      auto slot = Probe(entry.key);
+      if (GRANARY_UNLIKELY(!slot)) {
+        rehashed = false;
+        break;
+      }
+      *slot = entry;
+    }
+    if (GRANARY_LIKELY(rehashed)) return;
+  }
+}
+
+// Inserts a (key, value) pair into the index without journaling it.
+static void InsertEntry(Key key, Value value) {
+
+  // Keep the table at most half full so that probe sequences stay short.
+  if (GRANARY_UNLIKELY(gHeader->num_entries >= gHeader->num_slots / 2)) {
+    Grow();
+  }
+
+  auto entry = Probe(key);
+  while (GRANARY_UNLIKELY(!entry)) {
+    Grow();
+    entry = Probe(key);
+  }
+
+  if (!entry->key) {
+    entry->key = key;
+    gHeader->num_entries++;
+  }
+  entry->val = value;
+}
+
+// Initializes an empty index.
+static void InitTable(void) {
+  MapTable(TableSize(kMinNumSlots));
+  gHeader->magic = kIndexMagic;
+  gHeader->version = kIndexVersion;
+  gHeader->num_slots = kMinNumSlots;
+  gHeader->num_entries = 0;
+  gHeader->cache_size = 0;
+  gHeader->features = kAnyFeatures == gFeatures ? 0 : gFeatures;
+}
+
+// Writes the current contents of the index to the file at `path`.
+static void WriteTable(const char *path) {
+  gHeader->cache_size = gCommittedCacheSize;
+
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC |
+                       O_LARGEFILE, 0666);
+  GRANARY_ASSERT(!errno && "Unable to open new code cache index file.");
+
+  // Only write out the non-empty pages of the table, leaving the rest of the
+  // file sparse.
+  auto size = TableSize(gHeader->num_slots);
+  ftruncate(fd, static_cast<off64_t>(size));
+  GRANARY_ASSERT(!errno && "Unable to resize new code cache index file.");
+
+  static const uint8_t zeros[os::kPageSize] = {0};
+  auto table = reinterpret_cast<const uint8_t *>(gHeader);
+  for (auto offset = 0UL; offset < size; offset += os::kPageSize) {
+    if (!memcmp(&(table[offset]), zeros, os::kPageSize)) continue;
+    auto written = pwrite(fd, &(table[offset]), os::kPageSize,
+                          static_cast<off64_t>(offset));
+    GRANARY_ASSERT(!errno && os::kPageSize == static_cast<size_t>(written) &&
+                   "Unable to write new code cache index file.");
+    GRANARY_UNUSED(written);
+  }
+
+  fsync(fd);
+  close(fd);
+}
+
+// Atomically replaces the index checkpoint file with the current contents of
+// the index, and empties the journal.
+static void WriteCheckpoint(void) {
+  char tmp_path[sizeof gIndexPath + 4];
+  sprintf(tmp_path, "%s.tmp", gIndexPath);
+  WriteTable(tmp_path);
+
+  GRANARY_IF_ASSERT( errno = 0; )
+  rename(tmp_path, gIndexPath);
+  GRANARY_ASSERT(!errno && "Unable to replace code cache index file.");
+
+  // The journal is only emptied once the new checkpoint is in place. If we
+  // die in between, then replaying the old journal on top of the new
+  // checkpoint is harmless.
+  ftruncate(gJournalFd, 0);
+  GRANARY_ASSERT(!errno && "Unable to truncate code cache index journal.");
+}
 
-// Should the index be synced with the file system?
-static bool gSyncIndex = false;
+// Makes renames and file creations in the persist directory durable.
+static void SyncPersistDir(void) {
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto fd = open(FLAGS_persist_dir.c_str(), O_RDONLY | O_CLOEXEC);
+  GRANARY_ASSERT(!errno && "Unable to open persist directory.");
+  fsync(fd);
+  close(fd);
+}
+
+// Persisted files that are replaced by a compaction, in the order in which
+// they are replaced. The segments of the code cache are replaced first.
+static const char * const kReplacedFiles[] = {
+  "grr.patch.persist",
+  "grr.index.persist"
+};
+
+// Moves the compacted files into place, empties the journal, and then removes
+// the replacement marker. Every step can be repeated, so a replacement that
+// is interrupted part way through is finished by the next process to
+// initialize the index.
+//
+// Note: Old code cache segments beyond the end of the compacted code cache
+//       are left behind; they are removed when the code cache is revived.
+static void FinishReplacement(void) {
+  char path[256];
+  char compact_path[256 + 8];
+  for (size_t segment = 0; segment < cache::kMaxNumSegments; ++segment) {
+    cache::SegmentPath(path, FLAGS_persist_dir.c_str(), segment);
+    sprintf(compact_path, "%s.compact", path);
+    rename(compact_path, path);  // Might have already been renamed.
+  }
+  for (auto file : kReplacedFiles) {
+    sprintf(path, "%s/%s", FLAGS_persist_dir.c_str(), file);
+    sprintf(compact_path, "%s.compact", path);
+    rename(compact_path, path);  // Might have already been renamed.
+  }
 
-// Opens or re-opens the backing file for the index.
-static void ReviveCache(void) {
-  if (!FLAGS_persist) return;
   GRANARY_IF_ASSERT( errno = 0; )
-  auto fd = open(gIndexPath, O_CREAT | O_RDWR | O_CLOEXEC | O_LARGEFILE, 0666);
+  truncate(gJournalPath, 0);
+  GRANARY_ASSERT((!errno || ENOENT == errno) &&
+                 "Unable to truncate code cache index journal.");
+
+  SyncPersistDir();
+  unlink(gReplacePath);
+  SyncPersistDir();
+  GRANARY_IF_ASSERT( errno = 0; )
+}
+
+// Finishes a committed replacement, or discards the files left behind by one
+// that died before committing.
+static void RecoverReplacement(void) {
+  if (!access(gReplacePath, F_OK)) {
+    GRANARY_DEBUG( std::cerr << "Finishing index replacement." << std::endl; )
+    FinishReplacement();
+    return;
+  }
+
+  char path[256];
+  char compact_path[256 + 8];
+  for (size_t segment = 0; segment < cache::kMaxNumSegments; ++segment) {
+    cache::SegmentPath(path, FLAGS_persist_dir.c_str(), segment);
+    sprintf(compact_path, "%s.compact", path);
+    unlink(compact_path);
+  }
+  for (auto file : kReplacedFiles) {
+    sprintf(compact_path, "%s/%s.compact", FLAGS_persist_dir.c_str(), file);
+    unlink(compact_path);
+  }
+  GRANARY_IF_ASSERT( errno = 0; )
+}
+
+// Opens the backing file for the index checkpoint. A valid checkpoint is
+// mapped directly (and privately) into memory, and so no rebuilding is needed.
+// Returns `false` if the checkpoint had to be replaced.
+static bool ReviveCheckpoint(void) {
+  GRANARY_IF_ASSERT( errno = 0; )
+  gFd = open(gIndexPath, O_CREAT | O_RDONLY | O_CLOEXEC | O_LARGEFILE, 0666);
   GRANARY_ASSERT(!errno && "Unable to open persisted code cache index file.");
 
   struct stat info;
-  fstat(fd, &info);
+  fstat(gFd, &info);
   GRANARY_ASSERT(!errno && "Could stat code cache index file.");
 
   // Existing file is empty; nothing to revive.
-  if (!info.st_size) {
-    close(fd);
-    return;
+  auto size = static_cast<size_t>(info.st_size);
+  if (!size) {
+    InitTable();
+    return true;
+  }
+
+  Header header;
+  memset(&header, 0, sizeof header);
+  if (size >= sizeof header) {
+    pread(gFd, &header, sizeof header, 0);
+    GRANARY_ASSERT(!errno && "Unable to read code cache index file header.");
+  }
+
+  auto valid = kIndexMagic == header.magic &&
+               kIndexVersion == header.version && header.num_slots &&
+               !(header.num_slots & (header.num_slots - 1)) &&
+               TableSize(header.num_slots) == size;
+
+  if (valid && kAnyFeatures != gFeatures && header.features != gFeatures) {
+    std::cerr << "Discarding the persisted code cache, which was translated "
+              << "with different instrumentation (e.g. --coverage_mode or "
+              << "--profile_file)." << std::endl;
+    valid = false;
   }
 
-  GRANARY_DEBUG( std::cerr << "Reviving index file." << std::endl; )
+  if (valid) {
+    GRANARY_DEBUG( std::cerr << "Reviving index file." << std::endl; )
+    mmap(gHeader, size, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE,
+         gFd, 0);
+    GRANARY_ASSERT(!errno && "Unable to map code cache index file.");
+    gTableSize = size;
+    gCommittedCacheSize = header.cache_size;
+
+    // Tables that were once shared might have longer probe sequences.
+    if (kNumSharedSlots <= header.num_slots) {
+      gMaxNumProbes = kMaxNumSharedProbes;
+    }
+    return true;
+  }
 
-  gOldIndexExists = true;
+  // Either an old flat-array index, or a different version of the table. The
+  // values in older indexes encode cache offsets differently, and the code in
+  // older caches addresses data outside of the code cache differently, so
+  // neither the index nor the code cache can be trusted. The same goes for
+  // code that was translated with different instrumentation features. An
+  // empty index commits none of the code cache, so the code cache is
+  // discarded along with it.
+  GRANARY_DEBUG( std::cerr << "Discarding old index file." << std::endl; )
+  InitTable();
+  return false;
+}
+
+// Opens the journal file for appending.
+static void OpenJournal(void) {
+  GRANARY_IF_ASSERT( errno = 0; )
+  gJournalFd = open(gJournalPath, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC |
+                                  O_LARGEFILE, 0666);
+  GRANARY_ASSERT(!errno && "Unable to open code cache index journal.");
+}
+
+// Replays the committed records of the journal on top of the checkpoint.
+// Records following the last commit refer to code that might never have been
+// fully written to the code cache, and so they are discarded. Returns `true`
+// if the journal had any records in it.
+static bool ReplayJournal(void) {
+  struct stat info;
+  fstat(gJournalFd, &info);
+  GRANARY_ASSERT(!errno && "Could stat code cache index journal.");
 
   auto size = static_cast<size_t>(info.st_size);
-  auto num_entries = size / sizeof(Entry);
+  if (!size) return false;
+
+  GRANARY_DEBUG( std::cerr << "Replaying index journal." << std::endl; )
+
+  auto ret = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, gJournalFd, 0);
+  GRANARY_ASSERT(!errno && "Could not map code cache index journal.");
+
+  auto records = reinterpret_cast<const Entry *>(ret);
+  auto num_records = size / sizeof(Entry);
+  auto num_committed = 0UL;
+  for (auto i = 0UL; i < num_records; ++i) {
+    if (records[i].key) continue;
+    for (auto j = num_committed; j < i; ++j) {
+      InsertEntry(records[j].key, records[j].val);
+    }
+    gCommittedCacheSize = records[i].val.value;
+    num_committed = i + 1;
+  }
+  munmap(ret, size);
+
+  // Drop any uncommitted or torn records, so that new records are appended
+  // after the last commit.
+  auto committed_size = num_committed * sizeof(Entry);
+  if (committed_size < size) {
+    ftruncate(gJournalFd, static_cast<off64_t>(committed_size));
+    GRANARY_ASSERT(!errno && "Could not truncate code cache index journal.");
+  }
+  return true;
+}
 
-  auto scaled_size = (size + os::kPageSize - 1) & os::kPageMask;
-  if (scaled_size > size) {
-    ftruncate(fd, static_cast<off64_t>(scaled_size));
-    GRANARY_ASSERT(!errno && "Could not scale code cache index file.");
+// Revives the index, and then re-maps it so that it is shared with other
+// processes. The first process to share the index folds the journal into the
+// checkpoint and grows the checkpoint to its final size. After that, the
+// journal is no longer used; the shared mapping is the persisted state.
+static void ReviveSharedIndex(void) {
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto lock_fd = open(gLockPath, O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+  GRANARY_ASSERT(!errno && "Unable to open code cache index lock file.");
+  flock(lock_fd, LOCK_EX);
+  GRANARY_ASSERT(!errno && "Unable to lock code cache index lock file.");
+
+  auto revived = ReviveCheckpoint();
+  OpenJournal();
+  auto replayed = revived && ReplayJournal();
+  if (!revived || replayed || kNumSharedSlots > gHeader->num_slots) {
+    while (kNumSharedSlots > gHeader->num_slots) Grow();
+    WriteCheckpoint();
   }
-  auto ret = mmap(nullptr, scaled_size, PROT_READ,
-                  MAP_PRIVATE | MAP_POPULATE, fd, 0);
-  GRANARY_ASSERT(!errno && "Could not map code cache index file.");
 
-  gTable.reserve(num_entries);
-  auto entry = reinterpret_cast<const Entry *>(ret);
-  for (auto i = 0UL; i < num_entries; ++i, ++entry) {
-    gTable[entry->key] = entry->val;
+  // Re-open the checkpoint, as `WriteCheckpoint` might have replaced it.
+  auto size = TableSize(gHeader->num_slots);
+  close(gFd);
+  gFd = open(gIndexPath, O_RDWR | O_CLOEXEC | O_LARGEFILE);
+  GRANARY_ASSERT(!errno && "Unable to open shared code cache index file.");
+
+  mmap(gHeader, size, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_SHARED, gFd, 0);
+  GRANARY_ASSERT(!errno && "Unable to map shared code cache index file.");
+  gTableSize = size;
+  gMaxNumProbes = kMaxNumSharedProbes;
+
+  flock(lock_fd, LOCK_UN);
+  close(lock_fd);
+}
+
+// Inserts a (key, value) pair into a shared index without taking any locks.
+// If another process concurrently inserts the same key, then the last value
+// stored wins; both values refer to valid translations. Returns `false` if
+// the neighborhood of `key` is full.
+static bool InsertSharedEntry(Key key, Value value) {
+  const auto mask = gHeader->num_slots - 1;
+  auto slot = Hash()(key) & mask;
+  for (auto i = 0ULL; i < gMaxNumProbes; ++i) {
+    auto entry = &(gSlots[slot]);
+    auto old_key = __sync_val_compare_and_swap(&(entry->key.key), 0ULL,
+                                               key.key);
+    if (!old_key) {
+      __sync_fetch_and_add(&(gHeader->num_entries), 1ULL);
+    }
+    if (!old_key || key.key == old_key) {
+      __atomic_store_n(&(entry->val.value), value.value, __ATOMIC_RELEASE);
+      return true;
+    }
+    slot = (slot + 1) & mask;
   }
+  return false;
+}
 
-  munmap(ret, scaled_size);
-  close(fd);
+// Inserts a (key, value) pair into the private overflow table. This is used
+// when the neighborhood of `key` in the shared index is full. Entries in the
+// overflow table are only visible to this process.
+static void InsertOverflowEntry(Key key, Value value) {
+  if (!gNumOverflowInserts++) {
+    std::cerr << "Warning: Shared code cache index is full; new entries will "
+              << "not be shared with other processes." << std::endl;
+  }
+  gOverflowEntries[key.key] = value;
 }
 
 }  // namespace
 
-// Initialize the code cache index.
-void Init(void) {
-  if (!FLAGS_persist) return;
-  sprintf(gIndexPath, "%s/grr.index.persist", FLAGS_persist_dir.c_str());
-  ReviveCache();
+// Initialize the code cache index. A persisted index, and the code cache that
+// it covers, is discarded if it was created with different `features`.
+void Init(uint64_t features) {
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto ret = mmap(nullptr, kMaxTableSize, PROT_NONE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  GRANARY_ASSERT(!errno && "Unable to map address space for index.");
+
+  gHeader = reinterpret_cast<Header *>(ret);
+  gSlots = reinterpret_cast<Entry *>(&(gHeader[1]));
+  gTableSize = 0;
+  gCommittedCacheSize = 0;
+  gMaxNumProbes = kMaxNumProbes;
+  gFeatures = features;
+
+  if (FLAGS_persist) {
+    sprintf(gIndexPath, "%s/grr.index.persist", FLAGS_persist_dir.c_str());
+    sprintf(gJournalPath, "%s/grr.journal.persist", FLAGS_persist_dir.c_str());
+    sprintf(gReplacePath, "%s/grr.replace.persist", FLAGS_persist_dir.c_str());
+    RecoverReplacement();
+    if (FLAGS_shared_cache) {
+      sprintf(gLockPath, "%s/grr.lock", FLAGS_persist_dir.c_str());
+      ReviveSharedIndex();
+      return;
+    }
+    auto revived = ReviveCheckpoint();
+    OpenJournal();
+    if (revived) {
+      ReplayJournal();
+    } else {
+      WriteCheckpoint();
+    }
+  } else {
+    InitTable();
+  }
 }
 
-// Exit the code cache index.
+// Exit the code cache index. Everything worth keeping has already been
+// committed to the journal, so there is nothing to write back.
 void Exit(void) {
-  if (!FLAGS_persist || !gSyncIndex) return;
+  munmap(gHeader, kMaxTableSize);
+  if (FLAGS_persist) {
+    close(gFd);
+    close(gJournalFd);
+  }
 
-  GRANARY_IF_ASSERT( errno = 0; )
-  auto fd = open(gIndexPath, O_CREAT | O_RDWR | O_CLOEXEC | O_LARGEFILE, 0666);
-  GRANARY_ASSERT(!errno && "Unable to open persisted code cache index file.");
+  gHeader = nullptr;
+  gSlots = nullptr;
+  gTableSize = 0;
+  gFd = -1;
+  gJournalFd = -1;
+  gPendingEntries.clear();
+
+  if (gNumOverflowInserts) {
+    std::cerr << "Inserted " << std::dec << gNumOverflowInserts
+              << " entries into the private overflow table because the "
+              << "shared code cache index was full." << std::endl;
+  }
+  gOverflowEntries.clear();
+  gNumOverflowInserts = 0;
+}
+
+// Fold the journal into a new checkpoint of the index.
+void Compact(void) {
+  if (FLAGS_persist) WriteCheckpoint();
+}
 
-  if (gOldIndexExists) {
-    ftruncate(fd, 0);
-    GRANARY_ASSERT(!errno && "Could not clear stale code cache index file.");
+// Invokes `rewriter` on every entry in the index. Entries whose values are
+// cleared by `rewriter` are removed from the index.
+void Rewrite(const std::function<void(Key, Value &)> &rewriter) {
+  std::vector<Entry> entries;
+  entries.reserve(gHeader->num_entries);
+  for (auto i = 0ULL; i < gHeader->num_slots; ++i) {
+    auto entry = gSlots[i];
+    if (!entry.key) continue;
+    rewriter(entry.key, entry.val);
+    if (entry.val) entries.push_back(entry);
   }
 
-  auto size = sizeof(Entry) * gTable.size();
-  auto scaled_size = (size + os::kPageSize - 1) & os::kPageMask;
+  memset(gSlots, 0, gHeader->num_slots * sizeof(Entry));
+  gHeader->num_entries = 0;
+  for (const auto &entry : entries) {
+    InsertEntry(entry.key, entry.val);
+  }
+}
 
-  ftruncate(fd, static_cast<off64_t>(scaled_size));
-  GRANARY_ASSERT(!errno && "Could not scale new code cache index file.");
+// Atomically replaces the persisted code cache, patch points, and index with
+// compacted versions. The new cache and patch point files must already have
+// been written, with a `.compact` suffix, into the persist directory. The
+// index itself is replaced by the current contents of the index.
+void Replace(size_t cache_size) {
+  GRANARY_ASSERT(FLAGS_persist && !FLAGS_shared_cache);
+  gCommittedCacheSize = cache_size;
+
+  char path[sizeof gIndexPath + 8];
+  sprintf(path, "%s.compact", gIndexPath);
+  WriteTable(path);
+  SyncPersistDir();
+
+  // Creating the marker file is the commit point of the replacement.
+  sprintf(path, "%s.tmp", gReplacePath);
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666);
+  GRANARY_ASSERT(!errno && "Unable to create index replacement marker.");
+  fsync(fd);
+  close(fd);
+  rename(path, gReplacePath);
+  GRANARY_ASSERT(!errno && "Unable to commit index replacement.");
+  SyncPersistDir();
 
-  auto ret = mmap(nullptr, scaled_size, PROT_READ | PROT_WRITE,
-                  MAP_SHARED, fd, 0);
-  GRANARY_ASSERT(!errno && "Could not map new code cache index file.");
+  FinishReplacement();
+}
 
-  // Serialize.
-  auto entry = reinterpret_cast<Entry *>(ret);
-  for (const auto &key_val : gTable) {
-    if (key_val.second) *entry++ = {key_val.first, key_val.second};
-  }
+// Appends all entries inserted since the last commit to the journal, followed
+// by a commit record covering the first `cache_size` bytes of the code cache.
+void Commit(size_t cache_size) {
+  if (!FLAGS_persist || FLAGS_shared_cache) return;
+  if (gPendingEntries.empty() && cache_size == gCommittedCacheSize) return;
 
-  // Persist.
-  msync(ret, scaled_size, MS_SYNC | MS_INVALIDATE);
-  munmap(ret, scaled_size);
+  Entry commit;
+  commit.val.value = cache_size;
+  gPendingEntries.push_back(commit);
 
-  // Truncate.
-  if (size < scaled_size) {
-    ftruncate(fd, static_cast<off64_t>(size));
-    GRANARY_ASSERT(!errno && "Could resize new code cache index file.");
-  }
+  auto size = gPendingEntries.size() * sizeof(Entry);
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto written = write(gJournalFd, gPendingEntries.data(), size);
+  GRANARY_ASSERT(!errno && static_cast<size_t>(written) == size &&
+                 "Unable to append to the code cache index journal.");
+  GRANARY_UNUSED(written);
+
+  gPendingEntries.clear();
+  gCommittedCacheSize = cache_size;
+}
+
+// Returns the size of the code cache as of the most recent commit.
+size_t CommittedCacheSize(void) {
+  return gCommittedCacheSize;
+}
+
+// Returns a pointer to the size of the code cache that is shared by all
+// processes using the shared index.
+uint64_t *SharedCacheSize(void) {
+  GRANARY_ASSERT(FLAGS_persist && FLAGS_shared_cache);
+  return &(gHeader->cache_size);
 }
 
 // Print out all entries in the code cache index.
 void Dump(void) {
-  for (const auto &entry : gTable) {
-    auto pc = entry.first.pc32;
-    auto pid = entry.first.pid;
+  for (auto i = 0ULL; i < gHeader->num_slots; ++i) {
+    const auto &entry = gSlots[i];
+    if (!entry.key || !entry.val) continue;
+    auto pc = entry.key.pc32;
+    auto pid = entry.key.pid;
     std::cout << std::dec << pid << " " << std::hex << pc << std::endl;
   }
 }
 
 // Finds a value in the index given a key.
 Value Find(const Key key) {
-  return gTable[key];  // If not there, this will create space.
+  Value val;
+  if (auto entry = Probe(key)) {
+    val.value = __atomic_load_n(&(entry->val.value), __ATOMIC_ACQUIRE);
+  }
+  if (GRANARY_UNLIKELY(!val && !gOverflowEntries.empty())) {
+    auto overflow = gOverflowEntries.find(key.key);
+    if (overflow != gOverflowEntries.end()) val = overflow->second;
+  }
+  return val;
 }
 
-// Inserts a (key, value) pair into the index.
+// Inserts a (key, value) pair into the index. The pair is persisted by the
+// next `Commit`, unless the index is shared.
 void Insert(Key key, Value value) {
-  gSyncIndex = true;
-  gTable[key] = value;
+  if (!FLAGS_persist) {
+    InsertEntry(key, value);
+  } else if (FLAGS_shared_cache) {
+    if (!InsertSharedEntry(key, value)) InsertOverflowEntry(key, value);
+  } else {
+    InsertEntry(key, value);
+    gPendingEntries.push_back({key, value});
+  }
+  if (gInsertHook) gInsertHook(key, value);
+}
+
+void SetInsertHook(InsertHook hook) {
+  gInsertHook = hook;
+}
+
+// Saves the entries that didn't fit into the shared index.
+void CheckpointOverflowEntries(std::vector<uint8_t> *data) {
+  data->resize(gOverflowEntries.size() * sizeof(Entry));
+  auto entry = reinterpret_cast<Entry *>(data->data());
+  for (const auto &key_val : gOverflowEntries) {
+    entry->key.key = key_val.first;
+    entry->val = key_val.second;
+    ++entry;
+  }
+}
+
+// Re-inserts saved entries. Entries that now fit into the shared index go
+// there instead of into the overflow table.
+void RestoreOverflowEntries(const std::vector<uint8_t> &data) {
+  auto entry = reinterpret_cast<const Entry *>(data.data());
+  auto num_entries = data.size() / sizeof(Entry);
+  for (size_t i = 0; i < num_entries; ++i) {
+    Insert(entry[i].key, entry[i].val);
+  }
 }
 
 }  // namespace index
@@ -48,6 +48,12 @@ union Key {
   } __attribute__((packed));
 };
 
+enum : size_t {
+  // Blocks and trace entries are 8-byte aligned, which lets a 27-bit cache
+  // offset address a 1 GiB code cache.
+  kCacheOffsetScale = 8
+};
+
 union Value {
   inline Value(void)
       : value(0ULL) {}
@@ -66,8 +72,9 @@ union Value {
     // A non-unique block ID that includes part of the AppPC32 and the PID.
     uint32_t block_pc32;
 
-    // Offset of the translated block within the code cache.
-    CacheOffset cache_offset:27;
+    // Offset of the translated block within the code cache, in units of
+    // `kCacheOffsetScale` bytes.
+    uint32_t cache_offset:27;
 
     // Is this the first block in a trace?
     bool is_trace_head:1;
@@ -99,8 +106,20 @@ static_assert(sizeof(Key) <= sizeof(uint64_t),
 static_assert(sizeof(Value) <= sizeof(uint64_t),
               "Invalid structure packing of `IndexKey`.");
 
-// Initialize the code cache index.
-void Init(void);
+// Instrumentation that is inlined into translated code. Code translated with
+// one set of features can't be run with another, so the features are part of
+// the identity of a persisted index, and of the code cache that it covers.
+enum Feature : uint64_t {
+  kFeatureEdgeBitmap = 1ULL << 0,
+  kFeatureBlockCounters = 1ULL << 1,
+
+  // Accept the features of any persisted index, e.g. in offline tools.
+  kAnyFeatures = ~0ULL
+};
+
+// Initialize the code cache index. A persisted index, and the code cache that
+// it covers, is discarded if it was created with different `features`.
+void Init(uint64_t features);
 
 // Exit the code cache index.
 void Exit(void);
@@ -108,12 +127,54 @@ void Exit(void);
 // Print out all entries in the code cache index.
 void Dump(void);
 
+// Fold the journal into a new checkpoint of the index. This should only be
+// done offline, i.e. when no other process is using the index.
+void Compact(void);
+
+// Invokes `rewriter` on every entry in the index. Entries whose values are
+// cleared by `rewriter` are removed from the index.
+void Rewrite(const std::function<void(Key, Value &)> &rewriter);
+
+// Atomically replaces the persisted code cache, patch points, and index with
+// compacted versions. The new cache and patch point files must already have
+// been written, with a `.compact` suffix, into the persist directory. The
+// index itself is replaced by the current contents of the index.
+//
+// Note: Like `Compact`, this should only be done offline.
+void Replace(size_t cache_size);
+
+// Appends all entries inserted since the last commit to the journal, followed
+// by a commit record covering the first `cache_size` bytes of the code cache.
+//
+// Note: This should only be invoked at a safe point, where every inserted
+//       entry refers to fully encoded code.
+void Commit(size_t cache_size);
+
+// Returns the size of the code cache as of the most recent commit.
+size_t CommittedCacheSize(void);
+
+// Returns a pointer to the size of the code cache that is shared by all
+// processes using the shared index.
+uint64_t *SharedCacheSize(void);
+
 // Finds a value in the index given a key.
 Value Find(const Key search_key);
 
 // Inserts a (key, value) pair into the index.
 void Insert(const Key key, Value value);
 
+// Function that is invoked after every (key, value) pair is inserted into the
+// index, e.g. to link the code that is waiting on the key to be translated.
+typedef void (*InsertHook)(Key key, Value value);
+
+// Sets the function to be invoked after every insertion into the index.
+void SetInsertHook(InsertHook hook);
+
+// Saves and restores the entries that didn't fit into the shared index, e.g.
+// so that a forked child can send them back to its parent.
+void CheckpointOverflowEntries(std::vector<uint8_t> *data);
+void RestoreOverflowEntries(const std::vector<uint8_t> &data);
+
 }  // namespace index
 }  // namespace granary
 
@@ -10,6 +10,7 @@ namespace code {
 namespace {
 
 static uintptr_t gInstFuncs[InstrumentationPoint::kInvalid] = {0};
+static uintptr_t gAFlagsDeadInstFuncs[InstrumentationPoint::kInvalid] = {0};
 static std::unordered_map<Addr32, InstrumentationIds> gPCInstFuncs;
 
 static const InstrumentationIds gNoPCFunc = {};
@@ -20,13 +21,16 @@ static unsigned gNextPCId = 0;
 
 // Adds an instrumentation function.
 void AddInstrumentationFunction(InstrumentationPoint ipoint,
-                                void (*func)(void)) {
+                                void (*func)(void),
+                                void (*aflags_dead_func)(void)) {
   // This works as long as:
   //    1)  The code cache is allocated within +/- 31 bits of displacement
   //        of the binary.
   //    2)  The build of `grr` doesn't change across two
   //        uses of a persisted code cache. This part is *REALLY* important.
   gInstFuncs[ipoint] = reinterpret_cast<uintptr_t>(func);
+  gAFlagsDeadInstFuncs[ipoint] = reinterpret_cast<uintptr_t>(
+      aflags_dead_func ? aflags_dead_func : func);
 }
 
 // Set the value of the sole to the PC instrumentation function.
@@ -39,9 +43,10 @@ void AddPCInstrumentation(Addr32 pc) {
 
 // Returns the location in the code cache of where this instrumentation
 // function is.
-uintptr_t GetInstrumentationFunction(InstrumentationPoint ipoint) {
+uintptr_t GetInstrumentationFunction(InstrumentationPoint ipoint,
+                                     bool aflags_dead) {
   GRANARY_ASSERT(InstrumentationPoint::kInvalid != ipoint);
-  return gInstFuncs[ipoint];
+  return aflags_dead ? gAFlagsDeadInstFuncs[ipoint] : gInstFuncs[ipoint];
 }
 
 const InstrumentationIds &GetInstrumentationIds(Addr32 pc) {
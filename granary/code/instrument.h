@@ -15,20 +15,25 @@ enum InstrumentationPoint {
   kInstrumentBlockEntry = 1,
   kInstrumentPC = 2,
   kInstrumentMemoryAddress = 3,
+  kInstrumentBackEdge = 4,
   kInvalid
 };
 
 typedef std::vector<unsigned> InstrumentationIds;
 
-// Adds an instrumentation function.
+// Adds an instrumentation function. If `aflags_dead_func` is non-null, then it
+// is used instead of `func` where the arithmetic flags are dead, and so need
+// not be preserved by the instrumentation function.
 void AddInstrumentationFunction(InstrumentationPoint ipoint,
-                                void (*func)(void));
+                                void (*func)(void),
+                                void (*aflags_dead_func)(void)=nullptr);
 
 void AddPCInstrumentation(Addr32 pc);
 
 // Returns the location in the code cache of where this instrumentation
 // function is.
-uintptr_t GetInstrumentationFunction(InstrumentationPoint ipoint);
+uintptr_t GetInstrumentationFunction(InstrumentationPoint ipoint,
+                                     bool aflags_dead=false);
 
 const InstrumentationIds &GetInstrumentationIds(Addr32 pc);
 
@@ -0,0 +1,205 @@
+/* Copyright 2015 Peter Goodman, all rights reserved. */
+
+#include "granary/code/profile.h"
+#include "granary/code/instrument.h"
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef O_LARGEFILE
+# define O_LARGEFILE 0
+#endif
+
+DEFINE_string(profile_file, "", "Path to a file into which the execution "
+                                "counts of blocks are accumulated. Only blocks "
+                                "that are translated during this run are "
+                                "counted, so this is best used without a "
+                                "populated --persist_dir. The profile can be "
+                                "used by grrcompact --relayout_cache.");
+
+DEFINE_string(block_report_file, "", "Path to a file into which a report of "
+                                     "the blocks executed during this run "
+                                     "is written, hottest blocks first. Each "
+                                     "line has the tab-separated PID, guest "
+                                     "PC, execution count, cache offset, "
+                                     "translated size, and whether or not "
+                                     "the block is a trace head and a "
+                                     "superblock.");
+
+namespace granary {
+namespace code {
+namespace {
+enum : size_t {
+  // One counter for every possible cache offset in an `index::Value`.
+  kNumBlockCounters = 1ULL << 27
+};
+
+// Execution counters, indexed by the cache offset of a block.
+static uint64_t *gBlockCounts = nullptr;
+
+// Are the blocks that are translated during this run profiled?
+static bool gProfileBlocks = false;
+
+struct ProfiledBlock {
+  index::Key key;
+  index::Value val;
+  size_t num_bytes;
+};
+
+// The blocks translated during this run, indexed by cache offset.
+static std::unordered_map<uint32_t, ProfiledBlock> gBlocks;
+
+// Accumulates the execution counts of this run into the profile file.
+static void WriteProfile(void) {
+  std::unordered_map<uint64_t, uint64_t> counts;
+
+  // Start with the counts from previous runs.
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto fd = open(FLAGS_profile_file.c_str(),
+                 O_RDONLY | O_CLOEXEC | O_CREAT | O_LARGEFILE, 0666);
+  GRANARY_ASSERT(!errno && "Unable to open the profile file.");
+
+  BlockProfileEntry entry;
+  while (static_cast<ssize_t>(sizeof entry) == read(fd, &entry, sizeof entry)) {
+    counts[entry.key.key] += entry.count;
+  }
+  close(fd);
+
+  for (const auto &block : gBlocks) {
+    if (!block.second.key) continue;
+    if (auto count = gBlockCounts[block.first]) {
+      counts[block.second.key.key] += count;
+    }
+  }
+
+  std::vector<BlockProfileEntry> entries;
+  entries.reserve(counts.size());
+  for (const auto &count : counts) {
+    entry.key.key = count.first;
+    entry.count = count.second;
+    entries.push_back(entry);
+  }
+
+  auto tmp_path = FLAGS_profile_file + ".tmp";
+  GRANARY_IF_ASSERT( errno = 0; )
+  fd = open(tmp_path.c_str(),
+            O_WRONLY | O_CLOEXEC | O_CREAT | O_LARGEFILE | O_TRUNC, 0666);
+  GRANARY_ASSERT(!errno && "Unable to open the profile file.");
+  auto size = entries.size() * sizeof(BlockProfileEntry);
+  auto written = write(fd, entries.data(), size);
+  GRANARY_ASSERT(!errno && size == static_cast<size_t>(written) &&
+                 "Unable to write the profile file.");
+  GRANARY_UNUSED(written);
+  close(fd);
+  rename(tmp_path.c_str(), FLAGS_profile_file.c_str());
+}
+
+// Writes out the executed blocks of this run, hottest first.
+static void WriteBlockReport(void) {
+  std::vector<std::pair<uint64_t, const ProfiledBlock *>> blocks;
+  blocks.reserve(gBlocks.size());
+  for (const auto &block : gBlocks) {
+    if (!block.second.key) continue;
+    if (auto count = gBlockCounts[block.first]) {
+      blocks.push_back({count, &(block.second)});
+    }
+  }
+
+  std::sort(blocks.begin(), blocks.end(),
+            [] (const std::pair<uint64_t, const ProfiledBlock *> &a,
+                const std::pair<uint64_t, const ProfiledBlock *> &b) {
+    if (a.first != b.first) return a.first > b.first;
+    return a.second->val.cache_offset < b.second->val.cache_offset;
+  });
+
+  std::stringstream ss;
+  ss << "# pid\tpc\texecutions\tcache_offset\tnum_bytes\t"
+     << "trace_head\tsuperblock\n";
+  for (const auto &block : blocks) {
+    const auto &key = block.second->key;
+    const auto &val = block.second->val;
+    ss << std::dec << key.pid << "\t"
+       << "0x" << std::hex << key.pc32 << "\t"
+       << std::dec << block.first << "\t"
+       << "0x" << std::hex
+       << (val.cache_offset * index::kCacheOffsetScale) << "\t"
+       << std::dec << block.second->num_bytes << "\t"
+       << (val.is_trace_head ? 1 : 0) << "\t"
+       << (val.is_trace_block ? 1 : 0) << "\n";
+  }
+
+  auto report = ss.str();
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto fd = open(FLAGS_block_report_file.c_str(),
+                 O_WRONLY | O_CLOEXEC | O_CREAT | O_LARGEFILE | O_TRUNC, 0666);
+  GRANARY_ASSERT(!errno && "Unable to open the block report file.");
+  auto written = write(fd, report.data(), report.size());
+  GRANARY_ASSERT(!errno && report.size() == static_cast<size_t>(written) &&
+                 "Unable to write the block report file.");
+  GRANARY_UNUSED(written);
+  close(fd);
+}
+
+}  // namespace
+
+// Blocks in a persisted code cache might have been translated with inline
+// execution counters, so the counters always exist, even if the blocks of
+// this run are not profiled.
+void InitBlockProfiler(void) {
+  GRANARY_IF_ASSERT( errno = 0; )
+  auto ret = mmap(nullptr, kNumBlockCounters * sizeof(uint64_t),
+                  PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  GRANARY_ASSERT(!errno && "Unable to map block execution counters.");
+  gBlockCounts = reinterpret_cast<uint64_t *>(ret);
+  gProfileBlocks = !FLAGS_profile_file.empty() ||
+                   !FLAGS_block_report_file.empty();
+}
+
+void ExitBlockProfiler(void) {
+  if (!FLAGS_profile_file.empty()) {
+    WriteProfile();
+  }
+  if (!FLAGS_block_report_file.empty()) {
+    WriteBlockReport();
+  }
+
+  munmap(gBlockCounts, kNumBlockCounters * sizeof(uint64_t));
+  gBlockCounts = nullptr;
+  gProfileBlocks = false;
+  gBlocks.clear();
+}
+
+// Remembers that the block at `val.cache_offset` was translated for `key`.
+void ProfileBlock(index::Key key, index::Value val) {
+  if (gProfileBlocks) {
+    auto &block = gBlocks[val.cache_offset];
+    block.key = key;
+    block.val = val;
+  }
+}
+
+// Remembers that the block at `val.cache_offset` is `num_bytes` long.
+void ProfileBlockSize(index::Value val, size_t num_bytes) {
+  if (gProfileBlocks) {
+    gBlocks[val.cache_offset].num_bytes = num_bytes;
+  }
+}
+
+uint64_t *BlockCounters(void) {
+  return gProfileBlocks ? gBlockCounts : nullptr;
+}
+
+}  // namespace code
+}  // namespace granary
@@ -0,0 +1,38 @@
+/* Copyright 2015 Peter Goodman, all rights reserved. */
+
+#ifndef GRANARY_CODE_PROFILE_H_
+#define GRANARY_CODE_PROFILE_H_
+
+#include "granary/code/index.h"
+
+namespace granary {
+namespace code {
+
+// The number of times that the block with `key` was executed. A profile file
+// is an array of these.
+struct BlockProfileEntry {
+  index::Key key;
+  uint64_t count;
+};
+
+// Initialize the block execution profiler.
+void InitBlockProfiler(void);
+
+// Accumulate the execution counts of this run into the profile file.
+void ExitBlockProfiler(void);
+
+// Remembers that the block at `val.cache_offset` was translated for `key`.
+void ProfileBlock(index::Key key, index::Value val);
+
+// Remembers that the block at `val.cache_offset` is `num_bytes` long.
+void ProfileBlockSize(index::Value val, size_t num_bytes);
+
+// Returns the execution counters of blocks, or `nullptr` if blocks aren't
+// being profiled. Translated code increments the counter at its cache offset
+// on entry.
+uint64_t *BlockCounters(void);
+
+}  // namespace code
+}  // namespace granary
+
+#endif  // GRANARY_CODE_PROFILE_H_
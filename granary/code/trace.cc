@@ -2,13 +2,92 @@
 
 #include "granary/code/trace.h"
 
+#include "granary/code/block.h"
+#include "granary/code/cache.h"
+#include "granary/code/profile.h"
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+DEFINE_int32(trace_threshold, 50, "Number of times that a trace head "
+                                  "candidate must be dispatched before a "
+                                  "trace is recorded from it. Trace head "
+                                  "candidates are the targets of backward "
+                                  "branches, and the blocks executed just "
+                                  "after leaving a superblock.");
+
+DEFINE_bool(print_trace_stats, false, "Print out statistics about trace "
+                                      "selection when exiting.");
+
 namespace granary {
+namespace {
+
+enum : int {
+  kMaxHeadCount = 0xFFFF
+};
+
+// Execution counts of the trace head candidates that aren't hot yet, indexed
+// by `index::Value::cache_offset`. Every block has its own cache offset, so
+// a flat array avoids hashing on every dispatch.
+static std::vector<uint16_t> gHeadCounts;
+
+// Number of non-zero counts in `gHeadCounts`.
+static uint64_t gNumColdHeads = 0;
+
+// A saved count of a trace head candidate.
+struct SavedHeadCount {
+  uint32_t cache_offset;
+  uint32_t count;
+};
+
+// Statistics about trace selection.
+static uint64_t gNumHeadExecutions = 0;
+static uint64_t gNumTracesRecorded = 0;
+static uint64_t gNumSuperblocks = 0;
+static uint64_t gNumSuperblockBlocks = 0;
+
+// Returns true if the block `key`, entered after the block `prev` returned
+// back to the dispatcher, is a trace head candidate.
+static bool IsTraceHeadCandidate(index::Key key, index::Value val,
+                                 index::Value prev) {
+  if (!prev || val.is_trace_block) return false;
+  return prev.is_trace_block || key.pc32 <= prev.block_pc32;
+}
+
+}  // namespace
 
 TraceRecorder::TraceRecorder(void)
-    : next_entry(0)
+    : is_recording(false)
+    , next_entry(0)
     , trace_length(0)
     , entries{} {}
 
+bool TraceRecorder::Record(index::Key key, index::Value val,
+                           index::Value prev) {
+  if (!is_recording) {
+    if (!IsTraceHeadCandidate(key, val, prev)) return false;
+    ++gNumHeadExecutions;
+    if (val.cache_offset >= gHeadCounts.size()) {
+      gHeadCounts.resize(val.cache_offset + 1, 0);
+    }
+    auto &count = gHeadCounts[val.cache_offset];
+    if (!count++) ++gNumColdHeads;
+    if (count < std::min<int>(FLAGS_trace_threshold, kMaxHeadCount)) {
+      return false;
+    }
+    count = 0;
+    --gNumColdHeads;
+    ++gNumTracesRecorded;
+    is_recording = true;
+  }
+  if (!BlockEndsTrace(key, val)) return false;
+  is_recording = false;
+  return true;
+}
+
 bool TraceRecorder::BlockEndsTrace(index::Key key, index::Value block) {
   auto &entry = entries[next_entry++];
   entry.key = key;
@@ -25,4 +104,78 @@ bool TraceRecorder::BlockEndsTrace(index::Key key, index::Value block) {
   }
 }
 
+// Builds a superblock out of the recorded blocks. The blocks are re-decoded
+// and emitted back-to-back, with the jumps between them straightened out, so
+// that hot straight-line code runs as one region of the code cache.
+//
+// Only the first block of the superblock is redirected into the superblock.
+// The other blocks can only be entered from the front, so their own index
+// entries are left alone.
+void TraceRecorder::Build(os::Process32 *process) {
+  if (1 >= trace_length) {
+    trace_length = 0;
+    return;
+  }
+
+  Block blocks[kMaxNumTraceEntries];
+  for (auto i = 0UL; i < trace_length; ++i) {
+    blocks[i].Decode(process, entries[i].key.pc32);
+  }
+
+  index::Value val;
+  val.is_trace_head = true;
+  val.is_trace_block = true;
+  auto num_blocks = Block::EncodeSuperblock(blocks, trace_length, val);
+  trace_length = 0;
+
+  if (!num_blocks || val.ends_with_error) {
+    return;
+  }
+
+  auto key = entries[0].key;
+  index::Insert(key, val);
+  cache::InsertIntoIndexMirror(key, val);
+  code::ProfileBlock(key, val);
+
+  ++gNumSuperblocks;
+  gNumSuperblockBlocks += num_blocks;
+}
+
+void CheckpointTraceHeads(std::vector<uint8_t> *data) {
+  data->clear();
+  data->reserve(gNumColdHeads * sizeof(SavedHeadCount));
+  for (size_t i = 0; i < gHeadCounts.size(); ++i) {
+    if (!gHeadCounts[i]) continue;
+    SavedHeadCount saved = {static_cast<uint32_t>(i), gHeadCounts[i]};
+    auto bytes = reinterpret_cast<const uint8_t *>(&saved);
+    data->insert(data->end(), bytes, bytes + sizeof saved);
+  }
+}
+
+void RestoreTraceHeads(const std::vector<uint8_t> &data) {
+  GRANARY_ASSERT(0 == (data.size() % sizeof(SavedHeadCount)) &&
+                 "Invalid saved trace head counts.");
+  std::fill(gHeadCounts.begin(), gHeadCounts.end(), 0);
+  gNumColdHeads = 0;
+  for (size_t i = 0; i < data.size(); i += sizeof(SavedHeadCount)) {
+    SavedHeadCount saved;
+    memcpy(&saved, &(data[i]), sizeof saved);
+    if (saved.cache_offset >= gHeadCounts.size()) {
+      gHeadCounts.resize(saved.cache_offset + 1, 0);
+    }
+    gHeadCounts[saved.cache_offset] = static_cast<uint16_t>(saved.count);
+    ++gNumColdHeads;
+  }
+}
+
+void PrintTraceStats(void) {
+  if (!FLAGS_print_trace_stats) return;
+  std::cerr << std::dec << "Dispatched trace head candidates "
+            << gNumHeadExecutions << " times; " << gNumColdHeads
+            << " candidates are still cold." << std::endl;
+  std::cerr << "Recorded " << gNumTracesRecorded << " traces, and built "
+            << gNumSuperblocks << " superblocks out of "
+            << gNumSuperblockBlocks << " blocks." << std::endl;
+}
+
 }  // namespace granary
@@ -3,6 +3,8 @@
 #ifndef GRANARY_CODE_TRACE_H_
 #define GRANARY_CODE_TRACE_H_
 
+#include <vector>
+
 #include "granary/code/index.h"
 
 namespace granary {
@@ -20,15 +22,16 @@ class TraceRecorder {
  public:
   TraceRecorder(void);
 
-  // Record an entry into a trace.
-  bool BlockEndsTrace(index::Key key, index::Value val);
+  // Counts an execution of the block `key`, which was entered after the block
+  // `prev` returned back to the dispatcher. A trace is only recorded once a
+  // trace head candidate becomes hot, and then it is recorded until it ends.
+  // Returns true if the recorded trace should now be built.
+  bool Record(index::Key key, index::Value val, index::Value prev);
 
-  // Build a trace.
-  //
-  // Note: This has an architecture-specific implementation.
+  // Build a superblock out of the recorded blocks of `process`.
   //
   // Note: This function is NOT thread-safe.
-  void Build(void);
+  void Build(os::Process32 *process);
 
   // Returns true if the trace buffer is empty.
   inline bool IsEmpty(void) const {
@@ -36,6 +39,10 @@ class TraceRecorder {
   }
 
  private:
+  // Record an entry into a trace.
+  bool BlockEndsTrace(index::Key key, index::Value val);
+
+  bool is_recording;
   size_t next_entry;
   size_t trace_length;
   TraceEntry entries[kMaxNumTraceEntries];
@@ -43,6 +50,14 @@ class TraceRecorder {
   GRANARY_DISALLOW_COPY_AND_ASSIGN(TraceRecorder);
 };
 
+// Saves the counts of the trace head candidates into `data`, and later
+// replaces the counts with saved ones, e.g. so that a fork server child can
+// send them back to its parent.
+void CheckpointTraceHeads(std::vector<uint8_t> *data);
+void RestoreTraceHeads(const std::vector<uint8_t> &data);
+
+// Prints out statistics about trace selection, if requested.
+void PrintTraceStats(void);
 
 }  // namespace granary
 
@@ -0,0 +1,215 @@
+/* Copyright 2016 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+#include "granary/os/checkpoint.h"
+
+#include <gflags/gflags.h>
+
+#include <string>
+#include <vector>
+
+#include "granary/code/coverage.h"
+#include "granary/code/execute.h"
+
+#include "granary/input/record.h"
+
+#include "granary/os/schedule.h"
+
+DECLARE_int32(checkpoint_cache_size_mb);
+DECLARE_bool(reset_processes);
+DECLARE_string(input_mutator);
+DECLARE_string(output_snapshot_dir);
+
+namespace granary {
+
+extern std::string gInput;
+extern "C" size_t gInputIndex;
+
+namespace os {
+namespace {
+
+// A checkpoint of a process taken just before it received the input byte
+// `gInput[input_index]`. Checkpoints form a tree, where the input consumed by
+// a checkpoint is the input consumed by its parent, followed by `input`.
+struct CheckpointNode {
+  CheckpointNode *parent;
+  std::vector<CheckpointNode *> children;
+  size_t input_index;
+  std::string input;
+
+  Process32Checkpoint process;
+  std::vector<uint8_t> coverage;
+  input::IORecording record;
+
+  // Number of system calls made before the receive. The receive itself is
+  // made again after resuming from this checkpoint.
+  size_t num_syscalls;
+
+  // Amount of the execution budget used before the receive.
+  int64_t consumed_exec_budget;
+
+  // Approximate number of bytes used by this checkpoint.
+  size_t num_bytes;
+
+  // Used to evict the least recently used checkpoints.
+  uint64_t last_use;
+};
+
+// The root of the checkpoint tree. This represents the processes as they
+// are when revived, and so it doesn't hold a checkpoint.
+static CheckpointNode gRoot = {};
+
+// Checkpoint from which the current testcase resumed, or the most recent
+// checkpoint taken by the current testcase. This is `nullptr` if
+// checkpointing is disabled.
+static CheckpointNode *gCurrNode = nullptr;
+
+static size_t gNumBytes = 0;
+static uint64_t gNumUses = 0;
+
+// Returns the deepest child of `node` whose consumed input is a prefix of
+// `gInput`.
+static CheckpointNode *FindChild(const CheckpointNode *node) {
+  CheckpointNode *found_child = nullptr;
+  for (auto child : node->children) {
+    if (child->input_index <= gInput.size() &&
+        !gInput.compare(node->input_index, child->input.size(),
+                        child->input) &&
+        (!found_child || found_child->input_index < child->input_index)) {
+      found_child = child;
+    }
+  }
+  return found_child;
+}
+
+// Finds the least recently used checkpoint that has no children.
+static CheckpointNode *FindLRULeaf(CheckpointNode *node) {
+  CheckpointNode *lru_leaf = nullptr;
+  for (auto child : node->children) {
+    auto leaf = child->children.empty() ? child : FindLRULeaf(child);
+    if (leaf && leaf != gCurrNode &&
+        (!lru_leaf || leaf->last_use < lru_leaf->last_use)) {
+      lru_leaf = leaf;
+    }
+  }
+  return lru_leaf;
+}
+
+static void DeleteNode(CheckpointNode *node) {
+  for (auto child : node->children) {
+    DeleteNode(child);
+  }
+  gNumBytes -= node->num_bytes;
+  delete node;
+}
+
+// Evicts checkpoints until there is room for `num_bytes` more bytes.
+static bool MakeRoom(size_t num_bytes) {
+  const auto max_num_bytes =
+      static_cast<size_t>(FLAGS_checkpoint_cache_size_mb) << 20ULL;
+  while ((gNumBytes + num_bytes) > max_num_bytes) {
+    auto leaf = FindLRULeaf(&gRoot);
+    if (!leaf) {
+      return false;
+    }
+    auto &siblings = leaf->parent->children;
+    for (auto &sibling : siblings) {
+      if (sibling == leaf) {
+        sibling = siblings.back();
+        siblings.pop_back();
+        break;
+      }
+    }
+    DeleteNode(leaf);
+  }
+  return true;
+}
+
+}  // namespace
+
+// Tries to resume `processes` from the deepest checkpoint.
+//
+// Note: Only single-process testcases are checkpointed, because otherwise
+//       the state of the files shared by the processes, and of the scheduler,
+//       would also need to be checkpointed.
+bool ResumeFromCheckpoint(const Process32Group &processes) {
+  gCurrNode = nullptr;
+  if (0 >= FLAGS_checkpoint_cache_size_mb || !FLAGS_reset_processes ||
+      FLAGS_input_mutator.empty() || !FLAGS_output_snapshot_dir.empty() ||
+      1 != processes.size()) {
+    return false;
+  }
+
+  gCurrNode = &gRoot;
+  while (auto child = FindChild(gCurrNode)) {
+    gCurrNode = child;
+  }
+  if (&gRoot == gCurrNode) {
+    return false;
+  }
+
+  gCurrNode->last_use = ++gNumUses;
+  processes[0]->Restore(gCurrNode->process);
+  code::RestorePathCoverage(gCurrNode->coverage);
+  *input::gRecord = gCurrNode->record;
+  gInputIndex = gCurrNode->input_index;
+  SetNumSystemCalls(gCurrNode->num_syscalls);
+  code::RestoreExecBudget(gCurrNode->consumed_exec_budget);
+  return true;
+}
+
+// Checkpoints `process` just before it receives more input. The checkpoint
+// is only valid for inputs that share the input consumed so far, so nothing
+// is checkpointed once the end of the input has been reached.
+void CheckpointBeforeReceive(Process32 *process) {
+  if (!gCurrNode || !input::gRecord ||
+      gInputIndex <= gCurrNode->input_index ||
+      gInputIndex >= gInput.size()) {
+    return;
+  }
+
+  const auto max_num_bytes =
+      static_cast<size_t>(FLAGS_checkpoint_cache_size_mb) << 20ULL;
+  auto node = new CheckpointNode;
+  if (!process->Checkpoint(&(node->process), max_num_bytes)) {
+    delete node;
+    return;
+  }
+
+  node->parent = gCurrNode;
+  node->input_index = gInputIndex;
+  node->input = gInput.substr(gCurrNode->input_index,
+                              gInputIndex - gCurrNode->input_index);
+  code::CheckpointPathCoverage(&(node->coverage));
+  node->record = *input::gRecord;
+  node->num_syscalls = NumSystemCalls() - 1;
+  node->consumed_exec_budget = code::ConsumedExecBudget();
+  node->last_use = ++gNumUses;
+
+  node->num_bytes = sizeof *node + node->input.size() +
+                    node->process.data.size() +
+                    node->process.pages.size() * sizeof(PageRange32) +
+                    node->coverage.size();
+  for (const auto &syscall : node->record) {
+    node->num_bytes += sizeof syscall + syscall.data.size();
+  }
+
+  if (!MakeRoom(node->num_bytes)) {
+    delete node;
+    return;
+  }
+
+  gNumBytes += node->num_bytes;
+  gCurrNode->children.push_back(node);
+  gCurrNode = node;
+}
+
+void ExitCheckpoints(void) {
+  for (auto child : gRoot.children) {
+    DeleteNode(child);
+  }
+  gRoot.children.clear();
+  gCurrNode = nullptr;
+}
+
+}  // namespace os
+}  // namespace granary
@@ -0,0 +1,25 @@
+/* Copyright 2016 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+#ifndef GRANARY_OS_CHECKPOINT_H_
+#define GRANARY_OS_CHECKPOINT_H_
+
+#include "granary/os/process.h"
+
+namespace granary {
+namespace os {
+
+// Tries to resume `processes` from the deepest checkpoint whose consumed
+// input is a prefix of `gInput`. The processes must have just been revived or
+// reset. Returns `true` if the processes were resumed from a checkpoint.
+bool ResumeFromCheckpoint(const Process32Group &processes);
+
+// Checkpoints `process` just before it receives more input.
+void CheckpointBeforeReceive(Process32 *process);
+
+// Frees all checkpoints.
+void ExitCheckpoints(void);
+
+}  // namespace os
+}  // namespace granary
+
+#endif  // GRANARY_OS_CHECKPOINT_H_
@@ -4,6 +4,7 @@
 
 #include "granary/input/record.h"
 
+#include "granary/os/checkpoint.h"
 #include "granary/os/syscall.h"
 #include "granary/os/file.h"
 #include "granary/os/process.h"
@@ -303,6 +304,8 @@ static SystemCallStatus Receive(Process32 *process,
                            << std::dec << " -> "; )
 
   if (DECREE_STDIN == fd || DECREE_STDOUT == fd || DECREE_STDERR == fd) {
+    CheckpointBeforeReceive(process);
+
     auto receive_fault = false;
     auto num_bytes = DoReceive(process, fd, buf, length, receive_fault);
 
@@ -428,6 +431,20 @@ static bool UpdateSet(const FileTable &files,
   return true;
 }
 
+// Makes `process` wait on every file in `set`, so that it's woken up once it
+// might no longer block on one of them.
+static void WaitOnSet(const FileTable &files,
+                      void (File::*wait)(Process32 *),
+                      Process32 *proc, const decree_fd_set *set, int nfds) {
+  auto max_fds = sizeof(decree_fd_set) * 8;
+  auto max_fd = std::min(static_cast<size_t>(nfds), max_fds);
+  for (auto fd = 3UL; fd < max_fd; ++fd) {
+    if (DECREE_FD_ISSET(fd, set)) {
+      (files[fd]->*wait)(proc);
+    }
+  }
+}
+
 // Print out an FD set.
 static void PrintSet(const decree_fd_set *set, const char *name, int nfds) {
   GRANARY_STRACE( std::cerr << name << "=["; )
@@ -528,6 +545,12 @@ static SystemCallStatus Fdwait(Process32 *process,
 
   if (!num_bits) {
     if (!timeout) {
+      if (readfds) {
+        WaitOnSet(files, &File::WaitToRead, process, readfds, nfds);
+      }
+      if (writefds) {
+        WaitOnSet(files, &File::WaitToWrite, process, writefds, nfds);
+      }
       GRANARY_STRACE( std::cerr << "(IPR)" << std::endl; )
       return SystemCallStatus::kInProgress;
     }
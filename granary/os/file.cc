@@ -3,7 +3,9 @@
 #include "granary/os/file.h"
 
 #include "granary/os/process.h"
+#include "granary/os/schedule.h"
 
+#include <algorithm>
 #include <iostream>
 
 #include <gflags/gflags.h>
@@ -12,11 +14,36 @@ DECLARE_bool(strace);
 
 namespace granary {
 namespace os {
+namespace {
 
-File::File(void) {
-  memset(this, 0, sizeof *this);
+// Adds `process` to `waiters`, unless it's already waiting.
+static void AddWaiter(std::vector<Process32 *> &waiters, Process32 *process) {
+  if (waiters.end() == std::find(waiters.begin(), waiters.end(), process)) {
+    waiters.push_back(process);
+  }
+}
+
+// Wakes up all processes in `waiters`. Some of them might have since been
+// woken up by a different file, e.g. if they were in an `fdwait`, in which
+// case they end up re-trying their system call.
+static void WakeAll(std::vector<Process32 *> &waiters) {
+  for (auto waiter : waiters) {
+    WakeProcess(waiter);
+  }
+  waiters.clear();
 }
 
+}  // namespace
+
+File::File(void)
+    : writer_head(0),
+      reader_head(0),
+      blocked_writer_count(0),
+      blocked_writer(nullptr),
+      blocked_reader(nullptr),
+      read_waiters(),
+      write_waiters() {}
+
 // Emulated behavior:
 //  - Readers can under read.
 //  - Writers block if their write exceeds the max buffer size.
@@ -32,10 +59,12 @@ FileIOStatus File::Read(Process32 *process, uint32_t *num_bytes,
     if (blocked_reader) {
       // Someone else is at the head of the queue.
       if (process != blocked_reader) {
+        WaitToRead(process);
         return FileIOStatus::kInProgress;
 
       // We're the blocked reader, and no new data is available.
       } else if (reader_head == writer_head) {
+        WaitToRead(process);
         return FileIOStatus::kInProgress;
 
       } else {
@@ -45,6 +74,7 @@ FileIOStatus File::Read(Process32 *process, uint32_t *num_bytes,
     // We want to read, but no data is available.
     } else if (reader_head == writer_head) {
       blocked_reader = process;
+      WaitToRead(process);
       return FileIOStatus::kInProgress;
     }
 
@@ -57,6 +87,15 @@ FileIOStatus File::Read(Process32 *process, uint32_t *num_bytes,
       }
     }
     reader_head += completed_count;
+
+    // Reading makes room for the writers, and any leftover data can go to
+    // the readers that were queued up behind this one.
+    if (completed_count) {
+      WakeAll(write_waiters);
+    }
+    if (reader_head != writer_head) {
+      WakeAll(read_waiters);
+    }
   }
 
   GRANARY_STRACE( std::cerr << "length=" << completed_count; )
@@ -80,10 +119,12 @@ FileIOStatus File::Write(Process32 *process, uint32_t *num_bytes,
     if (blocked_writer) {
       // Someone else is at the head of the queue.
       if (process != blocked_writer) {
+        WaitToWrite(process);
         return FileIOStatus::kInProgress;
 
       // We're the blocked writer, and the buffer is still too full.
       } else if ((writer_head - reader_head + count) > kBufferSize) {
+        WaitToWrite(process);
         return FileIOStatus::kInProgress;
 
       } else {
@@ -95,6 +136,7 @@ FileIOStatus File::Write(Process32 *process, uint32_t *num_bytes,
     } else if ((writer_head - reader_head + count) > kBufferSize) {
       blocked_writer = process;
       blocked_writer_count = count;
+      WaitToWrite(process);
       return FileIOStatus::kInProgress;
     }
 
@@ -106,6 +148,15 @@ FileIOStatus File::Write(Process32 *process, uint32_t *num_bytes,
       }
     }
     writer_head += completed_count;
+
+    // Writing gives the readers something to read, and the writers that were
+    // queued up behind this one can now try to write.
+    if (completed_count) {
+      WakeAll(read_waiters);
+    }
+    if (!blocked_writer) {
+      WakeAll(write_waiters);
+    }
   }
 
   GRANARY_STRACE( std::cerr << "length=" << completed_count; )
@@ -129,5 +180,13 @@ bool File::WriteWillBlock(const Process32 *process) const {
          (blocked_writer && blocked_writer != process);
 }
 
+void File::WaitToRead(Process32 *process) {
+  AddWaiter(read_waiters, process);
+}
+
+void File::WaitToWrite(Process32 *process) {
+  AddWaiter(write_waiters, process);
+}
+
 }  // namespace os
 }  // namespace granary
@@ -37,6 +37,11 @@ class File {
   bool ReadWillBlock(const Process32 *process) const;
   bool WriteWillBlock(const Process32 *process) const;
 
+  // Blocks `process` until the next time that some other process writes to,
+  // or reads from, this file, respectively.
+  void WaitToRead(Process32 *process);
+  void WaitToWrite(Process32 *process);
+
   void Cancel(void);
 
   enum : size_t {
@@ -51,6 +56,11 @@ class File {
   uint32_t blocked_writer_count;
   Process32 *blocked_writer;
   Process32 *blocked_reader;
+
+  // Processes that are waiting for data to read from this file, or for space
+  // to write into this file. These are woken up by the scheduler.
+  std::vector<Process32 *> read_waiters;
+  std::vector<Process32 *> write_waiters;
 };
 
 typedef std::vector<File *> FileTable;
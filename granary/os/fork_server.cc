@@ -0,0 +1,375 @@
+/* Copyright 2016 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+#include "granary/os/fork_server.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "granary/arch/patch.h"
+
+#include "granary/base/interrupt.h"
+
+#include "granary/code/coverage.h"
+#include "granary/code/index.h"
+#include "granary/code/trace.h"
+
+#include "granary/input/record.h"
+
+#include "granary/os/schedule.h"
+
+DECLARE_int32(fork_server_timeout_ms);
+
+namespace granary {
+
+extern "C" size_t gInputIndex;
+
+namespace os {
+namespace {
+
+// Fixed-size part of the result of running a testcase in a child. This is
+// followed by the status of each process, the system calls of the IO
+// recording, the coverage of the testcase, the index entries that didn't fit
+// into the shared index, and the trace head counts and waiting patch points
+// of the child's code cache.
+struct ChildResult {
+  uint64_t got_term_signal;
+  uint64_t input_index;
+  uint64_t num_processes;
+  uint64_t num_system_calls;
+  uint64_t num_coverage_bytes;
+  uint64_t num_overflow_bytes;
+  uint64_t num_trace_head_bytes;
+  uint64_t num_patch_point_bytes;
+
+  uint64_t num_inputs;
+  uint64_t num_input_bytes;
+  uint64_t num_outputs;
+  uint64_t num_output_bytes;
+  uint64_t num_splits;
+};
+
+enum : int64_t {
+  // How long a child has to report back after its parent forwards an
+  // interrupt to it.
+  kInterruptGracePeriodMs = 1000
+};
+
+// A serialized system call of the IO recording.
+struct ChildSystemCall {
+  uint64_t kind;
+  uint64_t num_bytes;
+};
+
+static bool gHasSignalHandlers = false;
+
+template <typename T>
+static void Append(std::string &buffer, const T &val) {
+  buffer.append(reinterpret_cast<const char *>(&val), sizeof val);
+}
+
+// Reads `num_bytes` from the result of a child. Returns `nullptr` if the
+// result is truncated.
+static const char *Consume(const std::string &buffer, size_t &offset,
+                           size_t num_bytes) {
+  if ((offset + num_bytes) > buffer.size()) {
+    return nullptr;
+  }
+  auto data = buffer.data() + offset;
+  offset += num_bytes;
+  return data;
+}
+
+static void WriteAll(int fd, const std::string &buffer) {
+  for (size_t offset = 0; offset < buffer.size(); ) {
+    auto ret = write(fd, buffer.data() + offset, buffer.size() - offset);
+    if (0 < ret) {
+      offset += static_cast<size_t>(ret);
+    } else if (EINTR != errno) {
+      break;
+    }
+  }
+}
+
+// Runs the testcase in the child, and sends the result back to the parent.
+[[noreturn]]
+static void RunChild(const Process32Group &processes, int fd) {
+  ChildResult result;
+  memset(&result, 0, sizeof result);
+  result.got_term_signal = Run(processes);
+  code::EndPathCoverage();
+
+  std::vector<uint8_t> coverage;
+  std::vector<uint8_t> overflow;
+  std::vector<uint8_t> trace_heads;
+  std::vector<uint8_t> patch_points;
+  code::CheckpointPathCoverage(&coverage);
+  index::CheckpointOverflowEntries(&overflow);
+  CheckpointTraceHeads(&trace_heads);
+  arch::CheckpointPatchPoints(&patch_points);
+
+  const auto &record = *input::gRecord;
+  result.input_index = gInputIndex;
+  result.num_processes = processes.size();
+  result.num_system_calls = record.system_calls.size();
+  result.num_coverage_bytes = coverage.size();
+  result.num_overflow_bytes = overflow.size();
+  result.num_trace_head_bytes = trace_heads.size();
+  result.num_patch_point_bytes = patch_points.size();
+  result.num_inputs = record.num_inputs;
+  result.num_input_bytes = record.num_input_bytes;
+  result.num_outputs = record.num_outputs;
+  result.num_output_bytes = record.num_output_bytes;
+  result.num_splits = record.num_splits;
+
+  std::string buffer;
+  Append(buffer, result);
+  for (auto process : processes) {
+    Append(buffer, process->status);
+  }
+  for (const auto &syscall : record) {
+    Append(buffer, ChildSystemCall{static_cast<uint64_t>(syscall.kind),
+                                   syscall.data.size()});
+    buffer.append(syscall.data);
+  }
+  buffer.append(reinterpret_cast<const char *>(coverage.data()),
+                coverage.size());
+  buffer.append(reinterpret_cast<const char *>(overflow.data()),
+                overflow.size());
+  buffer.append(reinterpret_cast<const char *>(trace_heads.data()),
+                trace_heads.size());
+  buffer.append(reinterpret_cast<const char *>(patch_points.data()),
+                patch_points.size());
+
+  WriteAll(fd, buffer);
+  close(fd);
+  std::cout.flush();
+  std::cerr.flush();
+  _exit(EXIT_SUCCESS);
+}
+
+// Returns the current time, in milliseconds.
+static int64_t NowMs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+// Reads everything that the child sends to the parent. Interrupts of the
+// parent are forwarded to the child, which stops at its next safe point and
+// still reports back. The child is killed if it doesn't finish before
+// `--fork_server_timeout_ms`, or within a grace period of being interrupted.
+//
+// Note: The interrupt signals are blocked except while in `ppoll`, so that
+//       an interrupt can't arrive between checking for one and waiting on
+//       the child.
+static std::string ReadChildResult(pid_t pid, int fd) {
+  sigset_t interrupts;
+  sigset_t old_mask;
+  sigemptyset(&interrupts);
+  sigaddset(&interrupts, SIGINT);
+  sigaddset(&interrupts, SIGTERM);
+  sigaddset(&interrupts, SIGALRM);
+  sigaddset(&interrupts, SIGPIPE);
+  sigaddset(&interrupts, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &interrupts, &old_mask);
+
+  int64_t deadline = -1;
+  if (0 < FLAGS_fork_server_timeout_ms) {
+    deadline = NowMs() + FLAGS_fork_server_timeout_ms;
+  }
+
+  std::string buffer;
+  char chunk[4096];
+  auto forwarded_interrupt = false;
+  auto killed = false;
+  for (;;) {
+    if (!forwarded_interrupt && HasPendingInterrupt()) {
+      kill(pid, SIGTERM);
+      forwarded_interrupt = true;
+      auto grace_deadline = NowMs() + kInterruptGracePeriodMs;
+      deadline = -1 == deadline ? grace_deadline :
+                 std::min<int64_t>(deadline, grace_deadline);
+    }
+
+    struct timespec timeout = {0, 0};
+    auto timeout_ptr = &timeout;
+    if (killed || -1 == deadline) {
+      timeout_ptr = nullptr;
+    } else {
+      auto remaining_ms = std::max<int64_t>(0, deadline - NowMs());
+      timeout.tv_sec = static_cast<time_t>(remaining_ms / 1000);
+      timeout.tv_nsec = static_cast<long>((remaining_ms % 1000) * 1000000);
+    }
+
+    struct pollfd poll_fd = {fd, POLLIN, 0};
+    auto num_ready = ppoll(&poll_fd, 1, timeout_ptr, &old_mask);
+    if (0 > num_ready) {
+      if (EINTR == errno) continue;
+      break;
+
+    // The child ran out of time, so kill it. The pipe is closed once it
+    // dies, which ends the read.
+    } else if (!num_ready) {
+      std::cerr << "Fork server child " << pid << " timed out" << std::endl;
+      kill(pid, SIGKILL);
+      killed = true;
+      continue;
+    }
+
+    auto ret = read(fd, chunk, sizeof chunk);
+    if (0 < ret) {
+      buffer.append(chunk, static_cast<size_t>(ret));
+    } else if (!ret || EINTR != errno) {
+      break;
+    }
+  }
+  close(fd);
+
+  int status = 0;
+  while (-1 == waitpid(pid, &status, 0) && EINTR == errno) {}
+  errno = 0;
+
+  sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+
+  if (!WIFEXITED(status) || EXIT_SUCCESS != WEXITSTATUS(status)) {
+    std::cerr << "Fork server child " << pid << " died with status "
+              << status << std::endl;
+  }
+  return buffer;
+}
+
+// Replaces the parent's state of the testcase with the child's. Nothing is
+// replaced, and `false` is returned, if the result is truncated.
+static bool ApplyChildResult(const Process32Group &processes,
+                             const std::string &buffer,
+                             bool *got_term_signal) {
+  size_t offset = 0;
+  auto result_data = Consume(buffer, offset, sizeof(ChildResult));
+  if (!result_data) {
+    return false;
+  }
+
+  ChildResult result;
+  memcpy(&result, result_data, sizeof result);
+  GRANARY_ASSERT(processes.size() == result.num_processes &&
+                 "Fork server child ran a different process group.");
+
+  std::vector<ProcessStatus> statuses(processes.size());
+  auto statuses_data = Consume(buffer, offset,
+                               statuses.size() * sizeof(ProcessStatus));
+  if (!statuses_data) {
+    return false;
+  }
+  memcpy(statuses.data(), statuses_data,
+         statuses.size() * sizeof(ProcessStatus));
+
+  input::IORecording record;
+  record.num_inputs = result.num_inputs;
+  record.num_input_bytes = result.num_input_bytes;
+  record.num_outputs = result.num_outputs;
+  record.num_output_bytes = result.num_output_bytes;
+  record.num_splits = result.num_splits;
+  record.system_calls.resize(result.num_system_calls);
+  for (auto &syscall : record.system_calls) {
+    ChildSystemCall child_syscall;
+    auto syscall_data = Consume(buffer, offset, sizeof child_syscall);
+    if (!syscall_data) return false;
+    memcpy(&child_syscall, syscall_data, sizeof child_syscall);
+    auto bytes = Consume(buffer, offset, child_syscall.num_bytes);
+    if (!bytes) return false;
+    syscall.kind = static_cast<input::IOKind>(child_syscall.kind);
+    syscall.data.assign(bytes, child_syscall.num_bytes);
+  }
+
+  auto coverage_data = reinterpret_cast<const uint8_t *>(
+      Consume(buffer, offset, result.num_coverage_bytes));
+  if (!coverage_data) {
+    return false;
+  }
+
+  auto overflow_data = reinterpret_cast<const uint8_t *>(
+      Consume(buffer, offset, result.num_overflow_bytes));
+  if (!overflow_data) {
+    return false;
+  }
+
+  auto trace_head_data = reinterpret_cast<const uint8_t *>(
+      Consume(buffer, offset, result.num_trace_head_bytes));
+  if (!trace_head_data) {
+    return false;
+  }
+
+  auto patch_point_data = reinterpret_cast<const uint8_t *>(
+      Consume(buffer, offset, result.num_patch_point_bytes));
+  if (!patch_point_data) {
+    return false;
+  }
+
+  for (size_t i = 0; i < processes.size(); ++i) {
+    processes[i]->status = statuses[i];
+  }
+  code::RestorePathCoverage(std::vector<uint8_t>(
+      coverage_data, coverage_data + result.num_coverage_bytes));
+  index::RestoreOverflowEntries(std::vector<uint8_t>(
+      overflow_data, overflow_data + result.num_overflow_bytes));
+  RestoreTraceHeads(std::vector<uint8_t>(
+      trace_head_data, trace_head_data + result.num_trace_head_bytes));
+  arch::RestorePatchPoints(std::vector<uint8_t>(
+      patch_point_data, patch_point_data + result.num_patch_point_bytes));
+  *input::gRecord = std::move(record);
+  gInputIndex = result.input_index;
+  *got_term_signal = 0 != result.got_term_signal;
+  return true;
+}
+
+}  // namespace
+
+bool RunInForkedChild(const Process32Group &processes) {
+  if (!gHasSignalHandlers) {
+    InstallSignalHandlers();
+    gHasSignalHandlers = true;
+  }
+
+  int fds[2] = {-1, -1};
+  GRANARY_IF_ASSERT( errno = 0; )
+  pipe(fds);
+  GRANARY_ASSERT(!errno && "Unable to create fork server pipe.");
+
+  std::cout.flush();
+  std::cerr.flush();
+
+  auto pid = fork();
+  GRANARY_ASSERT(-1 != pid && "Unable to fork a fork server child.");
+  if (!pid) {
+    close(fds[0]);
+    RunChild(processes, fds[1]);
+  }
+
+  close(fds[1]);
+  auto buffer = ReadChildResult(pid, fds[0]);
+
+  // A child that died without reporting back covered nothing, and produced
+  // no recording, so the testcase is ignored. It might still have patched
+  // some of the parent's waiting jumps in the shared code cache.
+  auto got_term_signal = false;
+  if (!ApplyChildResult(processes, buffer, &got_term_signal)) {
+    arch::LinkPersistedPatchPoints();
+  }
+  return got_term_signal;
+}
+
+}  // namespace os
+}  // namespace granary
@@ -0,0 +1,22 @@
+/* Copyright 2016 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+#ifndef GRANARY_OS_FORK_SERVER_H_
+#define GRANARY_OS_FORK_SERVER_H_
+
+#include "granary/os/process.h"
+
+namespace granary {
+namespace os {
+
+// Runs `processes` in a forked, copy-on-write child process. The child sends
+// back the status of each process, the IO recording, the coverage of the
+// testcase, its trace head counts, and its waiting patch points, which replace
+// those of the parent. Translations and index mirror entries made by the child
+// reach the parent through shared memory. Returns `true` if the run was
+// interrupted, like `Run`.
+bool RunInForkedChild(const Process32Group &processes);
+
+}  // namespace os
+}  // namespace granary
+
+#endif  // GRANARY_OS_FORK_SERVER_H_
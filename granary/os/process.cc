@@ -3,6 +3,8 @@
 #include "granary/os/process.h"
 #include "granary/os/snapshot.h"
 
+#include "granary/code/cache.h"
+
 #include <algorithm>
 #include <iostream>
 
@@ -84,7 +86,7 @@ static void DebugRanges(const std::vector<PageRange32> &pages,
 
 }  // namespace
 
-Process32::Process32(const Snapshot32 *snapshot)
+Process32::Process32(const Snapshot32 *snapshot, bool track_dirty_pages_)
     : base(mmap(nullptr, kProcessSize, PROT_NONE,
                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)),
       pid(snapshot->exe_num),
@@ -97,11 +99,23 @@ Process32::Process32(const Snapshot32 *snapshot)
       fault_addr(0),
       fault_base_addr(0),
       fault_index_addr(0),
+      inline_cache_generation(1),
+      inline_cache(new cache::InlineCache()),
+      key_tag(0),
+      key_tag_is_valid(0),
+      shadow_stack(new cache::ShadowStack),
+      shadow_stack_top(0),
       page_hash(0),
       page_hash_is_valid(false),
-      pages() {
+      pages(),
+      track_dirty_pages(track_dirty_pages_),
+      snapshot_pages(),
+      dirty_pages(),
+      page_is_dirty() {
   pages.reserve(kReserveNumRanges);
 
+  cache::ClearShadowStack(shadow_stack);
+
   InitRegs(snapshot);
   InitSnapshotPages(snapshot);
   InitPages();
@@ -109,6 +123,12 @@ Process32::Process32(const Snapshot32 *snapshot)
   TryMakeExecutable();
   HashPageRange();
 
+  if (track_dirty_pages) {
+    snapshot_pages = pages;
+    page_is_dirty.resize(kProcessSize / kPageSize, false);
+    WriteProtectPages();
+  }
+
   GRANARY_IF_DEBUG( DebugRanges(pages, regs.eip, regs.esp); )
 }
 
@@ -150,11 +170,14 @@ void Process32::InitSnapshotPages(const Snapshot32 *snapshot) {
   }
 }
 
-Process32 *Process32::Revive(const Snapshot32 *snapshot) {
-  return new Process32(snapshot);
+Process32 *Process32::Revive(const Snapshot32 *snapshot,
+                             bool track_dirty_pages) {
+  return new Process32(snapshot, track_dirty_pages);
 }
 
 Process32::~Process32(void) {
+  delete inline_cache;
+  delete shadow_stack;
   GRANARY_IF_ASSERT( errno = 0; )
   munmap(base, kProcessSize);
   GRANARY_ASSERT(!errno && "Unable to unmap process address space.");
@@ -189,6 +212,22 @@ static PageRange32 *FindRange(std::vector<PageRange32> &pages, Addr32 addr) {
   return nullptr;
 }
 
+// Returns true if two page ranges cover the same pages in the same way,
+// ignoring how much of them has been lazily mapped.
+static bool IsSameRange(const PageRange32 &a, const PageRange32 &b) {
+  return a.base == b.base && a.limit == b.limit &&
+         a.perms == b.perms && a.state == b.state;
+}
+
+// Find a page range that is the same as `range`.
+static const PageRange32 *FindSameRange(const std::vector<PageRange32> &pages,
+                                        const PageRange32 &range) {
+  for (const auto &page : pages) {
+    if (IsSameRange(page, range)) return &page;
+  }
+  return nullptr;
+}
+
 // Check the consistency of page ranges.
 static void CheckConsistency(const std::vector<PageRange32> &pages) {
   for (auto page : pages) {
@@ -258,6 +297,290 @@ bool Process32::TryLazyMap(Addr32 addr32) {
   return true;
 }
 
+// Returns true if writing to `addr32` faulted only because the page is
+// write-protected to track whether or not it is dirty.
+bool Process32::TryMarkDirty(Addr32 addr32) {
+  if (!track_dirty_pages) {
+    return false;
+  }
+
+  const Addr32 page32 = addr32 & kPageMask;
+  const auto page_num = page32 / kPageSize;
+  if (page_is_dirty[page_num]) {
+    return false;  // Already writable, so this is a real fault.
+  }
+
+  // Only the mapped pages of writable ranges are write-protected.
+  auto range = FindRange(pages, page32);
+  if (!range || PageState::kRW != range->state || page32 < range->lazy_base) {
+    return false;
+  }
+
+  GRANARY_IF_ASSERT( errno = 0; )
+  mprotect(ConvertAddress(page32), kPageSize, PROT_READ | PROT_WRITE);
+  GRANARY_ASSERT(!errno && "Unable to make dirty page writable.");
+
+  page_is_dirty[page_num] = true;
+  dirty_pages.push_back(page32);
+  return true;
+}
+
+// Write-protects the writable pages so that writes to them can be tracked.
+void Process32::WriteProtectPages(void) {
+  GRANARY_IF_ASSERT( errno = 0; )
+  for (const auto &range : pages) {
+    if (PageState::kRW == range.state && range.lazy_base < range.limit) {
+      mprotect(ConvertAddress(range.lazy_base), range.limit - range.lazy_base,
+               PROT_READ);
+      GRANARY_ASSERT(!errno && "Unable to write-protect pages.");
+    }
+  }
+}
+
+// Restores the page ranges, and the contents of the dirty pages, from
+// the snapshot.
+//
+// Note: Private file mappings of the snapshot revert back to the snapshot's
+//       data when their pages are dropped with `MADV_DONTNEED`.
+void Process32::RestorePages(const Snapshot32 *snapshot) {
+  GRANARY_IF_ASSERT( errno = 0; )
+
+  // Restore runs of dirty pages whose ranges haven't changed. The pages of
+  // changed ranges are restored when their ranges are re-mapped.
+  std::sort(dirty_pages.begin(), dirty_pages.end());
+  for (auto it = dirty_pages.begin(); it != dirty_pages.end(); ) {
+    auto run_base = *it;
+    auto run_limit = run_base + static_cast<Addr32>(kPageSize);
+    auto range = FindRange(snapshot_pages, run_base);
+    GRANARY_ASSERT(range && "Dirty page is not in any snapshot range.");
+    for (page_is_dirty[*it++ / kPageSize] = false;
+         it != dirty_pages.end() && *it == run_limit && run_limit < range->limit;
+         page_is_dirty[*it++ / kPageSize] = false) {
+      run_limit += static_cast<Addr32>(kPageSize);
+    }
+    if (FindSameRange(pages, *range)) {
+      madvise(ConvertAddress(run_base), run_limit - run_base, MADV_DONTNEED);
+      mprotect(ConvertAddress(run_base), run_limit - run_base, PROT_READ);
+      GRANARY_ASSERT(!errno && "Unable to restore dirty pages.");
+    }
+  }
+  dirty_pages.clear();
+
+  // Ranges that aren't exactly ranges of the snapshot were either allocated,
+  // or are what's left of a changed snapshot range. Give them back to the
+  // address space reservation.
+  for (const auto &range : pages) {
+    if (!FindSameRange(snapshot_pages, range) && range.base < range.limit) {
+      mmap(ConvertAddress(range.base), range.limit - range.base, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+      GRANARY_ASSERT(!errno && "Unable to unmap process32 memory.");
+    }
+  }
+
+  for (const auto &range : snapshot_pages) {
+    auto curr_range = FindSameRange(pages, range);
+
+    // Un-map the pages that were lazily mapped since the last reset.
+    if (curr_range) {
+      if (curr_range->lazy_base < range.lazy_base) {
+        auto lazy_base = ConvertAddress(curr_range->lazy_base);
+        auto lazy_size = range.lazy_base - curr_range->lazy_base;
+        madvise(lazy_base, lazy_size, MADV_DONTNEED);
+        mprotect(lazy_base, lazy_size, PROT_NONE);
+        GRANARY_ASSERT(!errno && "Unable to restore lazily mapped pages.");
+      }
+      continue;
+    }
+
+    // The range was split, deallocated, or changed state; map it back in
+    // from the snapshot.
+    const detail::MappedRange32 *mapped_range = nullptr;
+    for (const auto &file_range : snapshot->file->ranges) {
+      if (!file_range.end) break;
+      if (file_range.begin <= range.base && range.limit <= file_range.end) {
+        mapped_range = &file_range;
+        break;
+      }
+    }
+    GRANARY_ASSERT(mapped_range && "Changed page range isn't in the snapshot.");
+
+    auto prot = PROT_READ;
+    if (PageState::kReserved == range.state) prot = PROT_NONE;
+    mmap(ConvertAddress(range.base), range.limit - range.base, prot,
+         MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, snapshot->fd,
+         mapped_range->fd_offs + (range.base - mapped_range->begin));
+    GRANARY_ASSERT(!errno && "Unable to re-map snapshotted memory.");
+    if (range.base < range.lazy_base) {
+      mprotect(ConvertAddress(range.base), range.lazy_base - range.base,
+               PROT_NONE);
+      GRANARY_ASSERT(!errno && "Unable to re-protect lazily mapped pages.");
+    }
+  }
+
+  pages = snapshot_pages;
+}
+
+// Returns the protection of the mapped pages of a range in state `state`.
+static int StateProt(PageState state) {
+  switch (state) {
+    case PageState::kReserved: return PROT_NONE;
+    case PageState::kRO: return PROT_READ;
+    case PageState::kRW: return PROT_READ | PROT_WRITE;
+    case PageState::kRX: return PROT_READ;
+  }
+  return PROT_NONE;
+}
+
+// Saves the state of this process into `checkpoint`.
+bool Process32::Checkpoint(Process32Checkpoint *checkpoint,
+                           size_t max_num_bytes) {
+  if (!track_dirty_pages) {
+    return false;
+  }
+
+  checkpoint->changed_ranges.clear();
+  checkpoint->dirty_pages.clear();
+  checkpoint->data.clear();
+
+  // Ranges that aren't ranges of the snapshot are saved in full. Otherwise,
+  // only the pages that were lazily mapped, or written to, are saved.
+  size_t num_bytes = 0;
+  for (const auto &range : pages) {
+    auto snapshot_range = FindSameRange(snapshot_pages, range);
+    if (!snapshot_range) {
+      if (PageState::kReserved != range.state &&
+          range.lazy_base < range.limit) {
+        checkpoint->changed_ranges.push_back({range.lazy_base, range.limit});
+        num_bytes += range.limit - range.lazy_base;
+      }
+    } else if (range.lazy_base < snapshot_range->lazy_base) {
+      checkpoint->changed_ranges.push_back(
+          {range.lazy_base, snapshot_range->lazy_base});
+      num_bytes += snapshot_range->lazy_base - range.lazy_base;
+    }
+  }
+  for (auto page32 : dirty_pages) {
+    auto range = FindRange(pages, page32);
+    if (range && FindSameRange(snapshot_pages, *range)) {
+      checkpoint->dirty_pages.push_back(page32);
+      num_bytes += kPageSize;
+    }
+  }
+
+  if (num_bytes > max_num_bytes) {
+    return false;
+  }
+
+  checkpoint->data.resize(num_bytes);
+  auto data = checkpoint->data.data();
+  for (const auto &changed_range : checkpoint->changed_ranges) {
+    auto size = changed_range.second - changed_range.first;
+    memcpy(data, ConvertAddress(changed_range.first), size);
+    data += size;
+  }
+  for (auto page32 : checkpoint->dirty_pages) {
+    memcpy(data, ConvertAddress(page32), kPageSize);
+    data += kPageSize;
+  }
+
+  checkpoint->regs = regs;
+  checkpoint->fpregs = fpregs;
+  checkpoint->last_branch_pc = last_branch_pc;
+  checkpoint->schedule_delay = schedule_delay;
+  checkpoint->signal = signal;
+  checkpoint->pages = pages;
+  return true;
+}
+
+// Restores this process to `checkpoint`.
+void Process32::Restore(const Process32Checkpoint &checkpoint) {
+  GRANARY_ASSERT(track_dirty_pages && dirty_pages.empty() &&
+                 "Can only restore a checkpoint into a reset process.");
+  GRANARY_IF_ASSERT( errno = 0; )
+
+  // Snapshot ranges that were changed are reserved, and changed ranges of
+  // the checkpoint are mapped writable so that their contents can be copied
+  // in.
+  for (const auto &range : snapshot_pages) {
+    if (!FindSameRange(checkpoint.pages, range) && range.base < range.limit) {
+      mmap(ConvertAddress(range.base), range.limit - range.base, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+      GRANARY_ASSERT(!errno && "Unable to unmap process32 memory.");
+    }
+  }
+  for (const auto &range : checkpoint.pages) {
+    if (!FindSameRange(snapshot_pages, range) && range.base < range.limit) {
+      mmap(ConvertAddress(range.base), range.limit - range.base, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+      GRANARY_ASSERT(!errno && "Unable to map process32 memory.");
+    }
+  }
+  for (const auto &changed_range : checkpoint.changed_ranges) {
+    mprotect(ConvertAddress(changed_range.first),
+             changed_range.second - changed_range.first,
+             PROT_READ | PROT_WRITE);
+    GRANARY_ASSERT(!errno && "Unable to map changed process32 memory.");
+  }
+
+  pages = checkpoint.pages;
+
+  auto data = checkpoint.data.data();
+  for (const auto &changed_range : checkpoint.changed_ranges) {
+    auto size = changed_range.second - changed_range.first;
+    memcpy(ConvertAddress(changed_range.first), data, size);
+    data += size;
+
+    auto range = FindRange(pages, changed_range.first);
+    mprotect(ConvertAddress(changed_range.first), size,
+             StateProt(range->state));
+    GRANARY_ASSERT(!errno && "Unable to protect changed process32 memory.");
+  }
+  for (auto page32 : checkpoint.dirty_pages) {
+    auto marked_dirty = TryMarkDirty(page32);
+    GRANARY_ASSERT(marked_dirty && "Unable to restore dirty page.");
+    GRANARY_UNUSED(marked_dirty);
+    memcpy(ConvertAddress(page32), data, kPageSize);
+    data += kPageSize;
+  }
+
+  regs = checkpoint.regs;
+  fpregs = checkpoint.fpregs;
+  last_branch_pc = checkpoint.last_branch_pc;
+  schedule_delay = checkpoint.schedule_delay;
+  signal = checkpoint.signal;
+  status = ProcessStatus::kSystemCall;
+  exec_status = ExecStatus::kBlocked;
+
+  InvalidatePageHash();
+  HashPageRange();
+
+  GRANARY_IF_DEBUG( DebugRanges(pages, regs.eip, regs.esp); )
+}
+
+// Resets this process back to the state of `snapshot`.
+void Process32::Reset(const Snapshot32 *snapshot) {
+  GRANARY_ASSERT(track_dirty_pages &&
+                 "Can't reset a process that doesn't track dirty pages.");
+  RestorePages(snapshot);
+  InitRegs(snapshot);
+
+  schedule_delay = -1;
+  signal = 0;
+  status = ProcessStatus::kSystemCall;
+  exec_status = ExecStatus::kReady;
+  fault_addr = 0;
+  fault_base_addr = 0;
+  fault_index_addr = 0;
+  shadow_stack_top = 0;
+
+  // The hashes of the snapshot's executable ranges are still valid, so
+  // re-computing the page hash doesn't re-hash any pages.
+  InvalidatePageHash();
+  HashPageRange();
+
+  GRANARY_IF_DEBUG( DebugRanges(pages, regs.eip, regs.esp); )
+}
+
 // Tries to change the state of some page ranges from `old_state` to
 // `new_state`.
 bool Process32::TryChangeState(Addr32 addr32, PageState old_state,
@@ -318,8 +641,7 @@ bool Process32::TryChangeState(Addr32 addr32, PageState old_state,
 
   // Invalidate the global page hash. The next code cache lookup will
   // trigger new translations.
-  page_hash_is_valid = false;
-  page_hash = 0;
+  InvalidatePageHash();
 
   auto prot = PROT_READ;
   if (PageState::kRW == new_state) prot |= PROT_WRITE;
@@ -350,9 +672,25 @@ uint32_t Process32::HashPageRange(void) const {
   page_hash = XXH32_digest(&digest) & 0x00FFFFFFU;  // Keep low 24 bits.
   page_hash_is_valid = true;
 
+  index::Key key;
+  key.pid = pid;
+  key.code_hash = page_hash;
+  key_tag = static_cast<uint32_t>(key.key >> 32);
+  key_tag_is_valid = 1;
+
   return page_hash;
 }
 
+// Invalidates the page hash, and with it, every entry in the inline cache.
+// The entries refer to blocks that were translated for the old page hash.
+void Process32::InvalidatePageHash(void) {
+  page_hash_is_valid = false;
+  page_hash = 0;
+  key_tag_is_valid = 0;
+  if (!++inline_cache_generation) inline_cache_generation = 1;
+  cache::ClearShadowStack(shadow_stack);
+}
+
 // Allocates some memory.
 Addr32 Process32::Allocate(size_t num_bytes, PagePerms perms) {
   GRANARY_ASSERT(0 < num_bytes);
@@ -379,8 +717,7 @@ Addr32 Process32::Allocate(size_t num_bytes, PagePerms perms) {
 
   // Invalidate the page hash because we've potentially allocated new code.
   if (PagePerms::kRX == perms || PagePerms::kRWX == perms) {
-    page_hash_is_valid = false;
-    page_hash = 0;
+    InvalidatePageHash();
   }
 
   return addr32;
@@ -503,8 +840,7 @@ void Process32::Deallocate(Addr32 addr32, size_t num_bytes) {
   CheckConsistency(pages);
 
   if (invalidate_page_hash && page_hash_is_valid) {
-    page_hash_is_valid = false;
-    page_hash = 0;
+    InvalidatePageHash();
   }
 }
 
@@ -6,6 +6,7 @@
 #include "granary/os/page.h"
 #include "granary/os/user.h"
 
+#include <utility>
 #include <vector>
 
 #include <setjmp.h>
@@ -19,13 +20,18 @@
 
 
 namespace granary {
+namespace cache {
+struct InlineCache;
+struct ShadowStack;
+}  // namespace cache
 namespace os {
 
 enum class ProcessStatus {
   kError,
   kIgnorableError,
   kDone,
-  kSystemCall
+  kSystemCall,
+  kTimeout
 };
 
 enum class ExecStatus {
@@ -62,6 +68,7 @@ struct Value<8> {
 
 class Snapshot32;
 class Process32;
+struct Process32Checkpoint;
 
 typedef std::vector<os::Process32 *> Process32Group;
 
@@ -70,9 +77,30 @@ extern GRANARY_THREAD_LOCAL(Process32 *) gProcess;
 // Represents a single-threaded 32-bit process's state.
 class Process32 final {
  public:
-  static Process32 *Revive(const Snapshot32 *snapshot);
+  // Revives a process from a snapshot. If `track_dirty_pages` is true then
+  // the process remembers which pages it writes to, so that it can later be
+  // `Reset` back to the snapshot.
+  static Process32 *Revive(const Snapshot32 *snapshot,
+                           bool track_dirty_pages);
   ~Process32(void);
 
+  // Resets this process back to the state of `snapshot`, which must be the
+  // snapshot from which this process was revived. Only the pages that were
+  // written since the last reset are restored, unless the page ranges of the
+  // process have changed, in which case the changed ranges are re-mapped.
+  void Reset(const Snapshot32 *snapshot);
+
+  // Saves the state of this process into `checkpoint`. This must be invoked
+  // from within a system call. Returns `false` if this process doesn't track
+  // its dirty pages, or if more than `max_num_bytes` of memory would need to
+  // be saved.
+  bool Checkpoint(Process32Checkpoint *checkpoint, size_t max_num_bytes);
+
+  // Restores this process to `checkpoint`. The process must have just been
+  // revived or reset. The process resumes by re-executing the system call in
+  // which the checkpoint was taken.
+  void Restore(const Process32Checkpoint &checkpoint);
+
   // Converts a 32-bit pointer into a 64-bit pointer.
   inline Addr64 ConvertAddress(Addr32 addr32) const {
     return reinterpret_cast<Addr64>(
@@ -183,6 +211,11 @@ class Process32 final {
   // Tries to lazily map the address if it is marked as having this capability.
   bool TryLazyMap(Addr32 addr);
 
+  // Returns true if writing to `addr` faulted only because the page is
+  // write-protected to track whether or not it is dirty. The page is marked
+  // as dirty and made writable.
+  bool TryMarkDirty(Addr32 addr);
+
   // Restore the saved FPU state.
   void RestoreFPUState(void) const;
 
@@ -231,23 +264,50 @@ class Process32 final {
   ExecStatus exec_status;
 
   // The address that caused us to fault.
-  Addr32 fault_addr;
+  Addr32 fault_addr;  // 80
   Addr32 fault_base_addr;
   Addr32 fault_index_addr;
 
+  // Generation of the entries in the inline cache that are valid. This is
+  // never zero, so that empty entries never match.
+  uint32_t inline_cache_generation;  // 92
+
+  // Targets of recently executed indirect branches.
+  cache::InlineCache * const inline_cache;  // 96
+
+  // Upper half of this process's `index::Key`s, i.e. its pid and page hash.
+  // This is only valid if `key_tag_is_valid` is non-zero.
+  mutable uint32_t key_tag;  // 104
+  mutable uint32_t key_tag_is_valid;  // 108
+
+  // Predicted return addresses of the emulated function calls, and the index
+  // of the most recently pushed entry.
+  cache::ShadowStack * const shadow_stack;  // 112
+  uint8_t shadow_stack_top;  // 120
+
  private:
   friend class Snapshot32;
 
-  explicit Process32(const Snapshot32 *snapshot);
+  Process32(const Snapshot32 *snapshot, bool track_dirty_pages);
   Process32(void) = delete;
 
   void InitPages(void);
   void InitSnapshotPages(const Snapshot32 *snapshot);
   void InitRegs(const Snapshot32 *snapshot);
 
+  // Write-protects the writable pages so that writes to them can be tracked.
+  void WriteProtectPages(void);
+
+  // Restores the page ranges, and the contents of the dirty pages, from
+  // the snapshot.
+  void RestorePages(const Snapshot32 *snapshot);
+
   // Computes the page hash.
   uint32_t HashPageRange(void) const;
 
+  // Invalidates the page hash, and with it, every entry in the inline cache.
+  void InvalidatePageHash(void);
+
   // Tries to do a write of a specific size.
   bool DoTryWrite(uint32_t *ptr, uint32_t val) const;
   bool DoTryWrite(uint16_t *ptr, uint16_t val) const;
@@ -277,12 +337,42 @@ class Process32 final {
   // List of all `mmap`d or `allocate`d pages.
   std::vector<PageRange32> pages;
 
+  // Should the pages written by this process be tracked?
+  const bool track_dirty_pages;
+
+  // Page ranges of this process as of when it was revived.
+  std::vector<PageRange32> snapshot_pages;
+
+  // Pages of the snapshot that have been written to since the process was
+  // revived or reset.
+  std::vector<Addr32> dirty_pages;
+  std::vector<bool> page_is_dirty;
+
   // FPU register state.
   alignas(16) struct user_fpregs_struct fpregs;
 
   GRANARY_DISALLOW_COPY_AND_ASSIGN(Process32);
 };
 
+// The state of a process as of some system call, relative to the snapshot
+// from which the process was revived.
+struct Process32Checkpoint {
+  decltype(Process32::regs) regs;
+  struct user_fpregs_struct fpregs;
+  AppPC32 last_branch_pc;
+  int schedule_delay;
+  int signal;
+
+  std::vector<PageRange32> pages;
+
+  // Ranges of memory whose contents differ from the snapshot, because they
+  // were allocated, changed, or lazily mapped. Followed by the pages of the
+  // snapshot that were dirty. Their contents are stored in order in `data`.
+  std::vector<std::pair<Addr32, Addr32>> changed_ranges;
+  std::vector<Addr32> dirty_pages;
+  std::vector<uint8_t> data;
+};
+
 // Ensures that the correct `Process32` pointer is set up to handle certain
 // kinds of faulting conditions. This is important for things like File
 // reading/writing where two processes are involved, as well as some cases of
@@ -316,6 +406,27 @@ static_assert(40 == __builtin_offsetof(Process32, regs.eip),
 static_assert(44 == __builtin_offsetof(Process32, regs.eflags),
               "Invalid structure packing of `os::Process32`.");
 
+static_assert(52 == __builtin_offsetof(Process32, last_branch_pc),
+              "Invalid structure packing of `os::Process32`.");
+
+static_assert(92 == __builtin_offsetof(Process32, inline_cache_generation),
+              "Invalid structure packing of `os::Process32`.");
+
+static_assert(96 == __builtin_offsetof(Process32, inline_cache),
+              "Invalid structure packing of `os::Process32`.");
+
+static_assert(104 == __builtin_offsetof(Process32, key_tag),
+              "Invalid structure packing of `os::Process32`.");
+
+static_assert(108 == __builtin_offsetof(Process32, key_tag_is_valid),
+              "Invalid structure packing of `os::Process32`.");
+
+static_assert(112 == __builtin_offsetof(Process32, shadow_stack),
+              "Invalid structure packing of `os::Process32`.");
+
+static_assert(120 == __builtin_offsetof(Process32, shadow_stack_top),
+              "Invalid structure packing of `os::Process32`.");
+
 }  // namespace os
 }  // namespace granary
 
@@ -13,6 +13,8 @@
 #include "granary/code/coverage.h"
 #include "granary/code/execute.h"
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
 #include <signal.h>
 #include <gflags/gflags.h>
@@ -41,6 +43,12 @@ static auto gIsRunning = true;
 // The signal that terminated `Schedule`, if any.
 static auto gSigTermSignal = 0;
 
+// Processes that can make progress, in the order that they will run.
+static std::deque<Process32 *> gRunQueue;
+
+// Number of system calls made by the current testcase.
+static size_t gNumSyscalls = 0;
+
 // Create the file table.
 static FileTable CreateFiles(size_t num_processes) {
   FileTable files;
@@ -82,8 +90,6 @@ static void signal(int signum, SignalHandler *handler) {
 
 // Handle termination (via an external or keyboard event).
 static void CatchInterrupt(int sig, siginfo_t *, void *) {
-  cache::ClearInlineCache();
-
   // If we are persisting stuff, then we might need to queue the interrupt
   // until such a time where we know that various memory-mapped files are
   // in a consistent state.
@@ -111,7 +117,6 @@ static void CatchInterrupt(int sig, siginfo_t *, void *) {
 // Handle termination (via an external or keyboard event).
 [[noreturn]]
 static void CatchNonMaskableInterrupt(int sig, siginfo_t *, void *) {
-  cache::ClearInlineCache();
   GRANARY_ASSERT(gSigTermStateValid && "Invalid re-use of `gSigTermState`.");
   if (!gSigTermSignal && SIGUSR1 != sig) gSigTermSignal = sig;
   gSigTermStateValid = false;
@@ -130,8 +135,6 @@ static void CatchNonMaskableInterrupt(int sig, siginfo_t *, void *) {
 //        fault and break out of the interpreter loop.
 //    4)  The emulator itself faults. This is probably a bug.
 static void CatchFault(int sig, siginfo_t *si, void *context_) {
-  cache::ClearInlineCache();
-
   auto context = reinterpret_cast<ucontext_t *>(context_);
 #ifdef __APPLE__
   auto &pc_ref = context->uc_mcontext->__ss.__rip;
@@ -157,9 +160,11 @@ static void CatchFault(int sig, siginfo_t *si, void *context_) {
       reinterpret_cast<Addr64>(fault_addr64));
 
   // Try to write to a RWX page in an RX state into the RW state, OR try to
-  // write to a demand-mapped page.
+  // write to a demand-mapped page, OR try to write to a page that is
+  // write-protected so that we can track that it's dirty.
   if (process->TryLazyMap(fault_addr32) ||
-      process->TryMakeWritable(fault_addr32)) {
+      process->TryMakeWritable(fault_addr32) ||
+      process->TryMarkDirty(fault_addr32)) {
     return;
   }
 
@@ -208,8 +213,6 @@ static void CatchFault(int sig, siginfo_t *si, void *context_) {
 
 // Catch a crash.
 static void CatchCrash(int sig, siginfo_t *, void *context_) {
-  cache::ClearInlineCache();
-
   GRANARY_DEBUG( std::cerr << "  CatchCrash " << sig << std::endl; )
   auto process = os::gProcess;
   auto context = reinterpret_cast<ucontext_t *>(context_);
@@ -270,9 +273,32 @@ static void SetupSignals(void) {
   sigprocmask(SIG_SETMASK, &set, nullptr);
 }
 
+// Returns `true` if `process` terminated or crashed.
+static bool HasExited(const Process32 *process) {
+  return ProcessStatus::kError == process->status ||
+         ProcessStatus::kIgnorableError == process->status ||
+         ProcessStatus::kDone == process->status ||
+         ProcessStatus::kTimeout == process->status;
+}
+
+// Adds `process` to the end of the run queue, unless it's already queued.
+static void EnqueueProcess(Process32 *process) {
+  if (gRunQueue.end() == std::find(gRunQueue.begin(), gRunQueue.end(),
+                                   process)) {
+    gRunQueue.push_back(process);
+  }
+}
+
 // Perform the actual scheduling of processes.
 __attribute__((noinline))
 static void Schedule(Process32Group &processes, FileTable &files) {
+  gRunQueue.clear();
+  for (auto process : processes) {
+    if (process && !HasExited(process)) {
+      gRunQueue.push_back(process);
+    }
+  }
+
   Interruptible enable_interrupts;
 
   // If we were interrupted, then interrupts will be disabled and we'll
@@ -282,100 +308,128 @@ static void Schedule(Process32Group &processes, FileTable &files) {
   }
   gSigTermStateValid = true;
 
-  auto num_syscalls = 0U;
-  for (auto made_progress = true; made_progress; ) {
-    made_progress = false;
-
-    for (auto process : processes) {
+  // Only runnable processes are in the run queue. Processes blocked on a
+  // `File` are put back into the run queue by `WakeProcess` when another
+  // process reads from or writes to that file, so if the run queue is ever
+  // empty then the remaining processes are deadlocked.
+  while (!gRunQueue.empty()) {
+    Process32 *process = nullptr;
+    {
+      Uninterruptible disable_interrupts;
+      process = gRunQueue.front();
+      gRunQueue.pop_front();
+    }
 
-      // The process terminated or crashed.
-      if (!process ||
-          ProcessStatus::kError == process->status ||
-          ProcessStatus::kIgnorableError == process->status ||
-          ProcessStatus::kDone == process->status) {
-        continue;
-      }
+    // The process terminated or crashed.
+    if (HasExited(process)) {
+      continue;
+    }
 
-      PushProcess32 set_process(process);
+    PushProcess32 set_process(process);
+
+    // Allows us to repeat system calls that are in-progress. If the
+    // status is blocked then we'll try to perform a system call.
+    //
+    // Note: The initial state of `process_status` is `kSystemCall` even
+    //       though it isn't really a system call. So initially we come in
+    //       and execute, hopefully up to the first syscall.
+    if (ExecStatus::kReady == process->exec_status) {
+    continue_execution:
+      code::Execute(process);
+    }
 
-      cache::ClearInlineCache();
+    // We need to execute a system call.
+    if (ProcessStatus::kSystemCall == process->status) {
 
-      // Allows us to repeat system calls that are in-progress. If the
-      // status is blocked then we'll try to perform a system call.
-      //
-      // Note: The initial state of `process_status` is `kSystemCall` even
-      //       though it isn't really a system call. So initially we come in
-      //       and execute, hopefully up to the first syscall.
-      if (ExecStatus::kReady == process->exec_status) {
-      continue_execution:
-        code::Execute(process);
-        made_progress = true;
+      // Hard limit on the number of syscalls to avoid OOM conditions.
+      if (gNumSyscalls++ >= kMaxNumSyscalls) {
+        return;
       }
 
-      // We need to execute a system call.
-      if (ProcessStatus::kSystemCall == process->status) {
+      // Disable interrupts; handling system calls modifies global state.
+      Uninterruptible disable_interrupts;
 
-        // Hard limit on the number of syscalls to avoid OOM conditions.
-        if (num_syscalls++ >= kMaxNumSyscalls) {
-          made_progress = false;
-          break;
-        }
+      code::MarkCoveredInputLength();
+      cache::Commit();
 
-        // Disable interrupts; handling system calls modifies global state.
-        Uninterruptible disable_interrupts;
-
-        code::MarkCoveredInputLength();
+      switch (SystemCall(process, files)) {
+        case SystemCallStatus::kTerminated:
+          GRANARY_DEBUG( std::cerr << process->Id() << " terminated"
+                                   << std::endl; )
+          process->status = ProcessStatus::kDone;
+          break;
 
-        switch (SystemCall(process, files)) {
-          case SystemCallStatus::kTerminated:
-            GRANARY_DEBUG( std::cerr << process->Id() << " terminated"
-                                     << std::endl; )
-            process->status = ProcessStatus::kDone;
+        case SystemCallStatus::kComplete:
+          process->exec_status = ExecStatus::kReady;
+          if (1 == processes.size() && gIsRunning) {
+            goto continue_execution;
+          } else {
+            EnqueueProcess(process);
             break;
+          }
 
-          case SystemCallStatus::kComplete:
-            process->exec_status = ExecStatus::kReady;
-            made_progress = true;
-            if (1 == processes.size() && gIsRunning) {
-              goto continue_execution;
-            } else {
-              break;
-            }
-
-          case SystemCallStatus::kInProgress:
-            process->exec_status = ExecStatus::kBlocked;
-            break;
+        // Blocked on a `File`, which will wake the process up.
+        case SystemCallStatus::kInProgress:
+          process->exec_status = ExecStatus::kBlocked;
+          break;
 
-          case SystemCallStatus::kSleeping:
-            process->exec_status = ExecStatus::kBlocked;
-            made_progress = true;
-            break;
-        }
+        // Sleeping processes are re-tried once per trip through the run
+        // queue, which is what counts down their timeouts.
+        case SystemCallStatus::kSleeping:
+          process->exec_status = ExecStatus::kBlocked;
+          EnqueueProcess(process);
+          break;
+      }
 
-      // Hit some kind of error (e.g. runtime error or decode error) when
-      // executing the code.
-      } else if (ProcessStatus::kError == process->status) {
-        GRANARY_DEBUG( std::cerr << process->Id() << " crashed" << std::endl; )
-        return;
+    // Hit some kind of error (e.g. runtime error or decode error) when
+    // executing the code.
+    } else if (ProcessStatus::kError == process->status) {
+      GRANARY_DEBUG( std::cerr << process->Id() << " crashed" << std::endl; )
+      return;
 
-      // Unreachable case: this should never happen.
-      } else {
-        return;
-//        GRANARY_ASSERT(false && "Reached ProcessState::kDone directly from "
-//                                "execute.");
-      }
-    }
+    // Ran out of execution budget, so the testcase is treated as a hang.
+    } else if (ProcessStatus::kTimeout == process->status) {
+      GRANARY_DEBUG( std::cerr << process->Id() << " timed out"
+                               << std::endl; )
+      return;
 
-    // Emulates a `SIGPIPE` if we don't make progress and we haven't already
-    // retried.
-    if (!made_progress) {
+    // Unreachable case: this should never happen.
+    } else {
       return;
+//      GRANARY_ASSERT(false && "Reached ProcessState::kDone directly from "
+//                              "execute.");
     }
   }
 }
 
 }  // namespace
 
+// Makes `process` runnable again if it's blocked, e.g. because it's waiting
+// on a `File` that some other process just read from or wrote to.
+void WakeProcess(Process32 *process) {
+  if (!HasExited(process) && ExecStatus::kBlocked == process->exec_status) {
+    EnqueueProcess(process);
+  }
+}
+
+// Returns the number of system calls made by the current testcase.
+size_t NumSystemCalls(void) {
+  return gNumSyscalls;
+}
+
+// Sets the number of system calls made by the current testcase, e.g. to zero
+// before it starts, or to the number made before the checkpoint that it
+// resumes from.
+void SetNumSystemCalls(size_t num_syscalls) {
+  gNumSyscalls = num_syscalls;
+}
+
+// Installs the signal handlers of the scheduler, e.g. so that a fork server
+// can queue interrupts while it waits on its children.
+void InstallSignalHandlers(void) {
+  SetupSignals();
+}
+
 // The main process scheduler. This is closely tied with the behavior of reads
 // ands writes to `File` objects.
 bool Run(Process32Group processes) {
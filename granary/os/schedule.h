@@ -10,6 +10,19 @@ namespace os {
 
 bool Run(Process32Group processes);
 
+// Makes `process` runnable again if it's blocked, e.g. because it's waiting
+// on a `File` that some other process just read from or wrote to.
+void WakeProcess(Process32 *process);
+
+// Gets and sets the number of system calls made by the current testcase. The
+// testcase is stopped once it has made too many system calls.
+size_t NumSystemCalls(void);
+void SetNumSystemCalls(size_t num_syscalls);
+
+// Installs the signal handlers of the scheduler. Outside of `Run`, these
+// queue interrupts until it is safe to handle them.
+void InstallSignalHandlers(void);
+
 }  // namespace os
 }  // namespace granary
 
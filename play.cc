@@ -14,15 +14,21 @@
 #include <gflags/gflags.h>
 
 #include "granary/arch/base.h"
+#include "granary/arch/patch.h"
 
 #include "granary/code/branch_tracer.h"
 #include "granary/code/cache.h"
 #include "granary/code/index.h"
 #include "granary/code/coverage.h"
+#include "granary/code/execute.h"
+#include "granary/code/profile.h"
+#include "granary/code/trace.h"
 
 #include "granary/input/record.h"
 #include "granary/input/mutate.h"
 
+#include "granary/os/checkpoint.h"
+#include "granary/os/fork_server.h"
 #include "granary/os/process.h"
 #include "granary/os/snapshot.h"
 #include "granary/os/schedule.h"
@@ -71,6 +77,13 @@ DEFINE_bool(remutate, false, "Enable remutating of some stuff.");
 
 DEFINE_bool(path_coverage, false, "Enable path code coverage?");
 
+DEFINE_string(coverage_mode, "path",
+              "How code coverage is recorded when path coverage is enabled. "
+              "Valid modes are `path`, which records every (last branch, "
+              "branch, target) triple, and `edge_bitmap`, which counts "
+              "branch edges in a fixed-size bitmap that translated code "
+              "updates inline.");
+
 DEFINE_string(coverage_file, "/dev/null",
               "File name in which to save the code coverage data. If "
               "/dev/null is specified then the coverage file is not "
@@ -81,6 +94,44 @@ DEFINE_string(output_coverage_file, "/dev/null",
               "/dev/null is specified then the coverage file is not "
               "mapped, but coverage instrumentation is enabled.");
 
+DEFINE_bool(compress_coverage_file, false,
+            "Delta-encode the paths in the output coverage file.");
+
+DEFINE_string(shared_coverage_file, "",
+              "File name of a coverage map that is shared by all concurrently "
+              "running instances of grrplay. New coverage is only reported "
+              "if no other instance has already covered the same paths.");
+
+DEFINE_bool(reset_processes, false,
+            "Reset processes back to their snapshots between testcases by "
+            "restoring only their dirty pages, instead of reviving new "
+            "processes for each testcase.");
+
+DEFINE_int32(checkpoint_cache_size_mb, 0,
+             "Maximum size, in megabytes, of the in-memory checkpoints taken "
+             "before each receive. Mutated testcases resume from the deepest "
+             "checkpoint whose input is a prefix of theirs. Checkpointing is "
+             "disabled when this is 0.");
+
+DEFINE_bool(fork_server, false,
+            "Run each testcase in a forked copy of grrplay, so that a testcase "
+            "can't corrupt the state of later testcases. This implies "
+            "--shared_cache, so that the code translated for one testcase is "
+            "reused by the next.");
+
+DEFINE_int32(fork_server_timeout_ms, 60000,
+             "Maximum number of milliseconds that a fork server child can "
+             "run a testcase for before it is killed. Set to 0 to disable "
+             "the timeout.");
+
+DECLARE_bool(shared_cache);
+DECLARE_string(profile_file);
+DECLARE_string(block_report_file);
+
+DEFINE_bool(publish_hangs, false, "Should testcases that run out of their "
+                                  "execution budget (see --exec_budget) be "
+                                  "published as hangs?");
+
 DEFINE_bool(print_num_mutations, false,
             "Print out the number of mutations evaluated.");
 
@@ -101,6 +152,17 @@ static uintptr_t gTotalInputBytesRead = 0;
 
 static input::IORecording *gRecordToMutate = nullptr;
 
+// Processes that are reset and re-used across testcases.
+static os::Process32Group gProcessGroup;
+
+// Returns the instrumentation features that are inlined into translated code.
+static uint64_t IndexFeatures(void) {
+  uint64_t features = 0;
+  if (code::EdgeBitmap()) features |= index::kFeatureEdgeBitmap;
+  if (code::BlockCounters()) features |= index::kFeatureBlockCounters;
+  return features;
+}
+
 // Creates and returns a snapshot group, where each snapshot is the initial
 // memory and register state of a bunch of related processes.
 static os::SnapshotGroup CreateSnapshotGroup(void) {
@@ -118,11 +180,39 @@ static os::Process32Group CreateProcess32Group(
   os::Process32Group processes;
   processes.reserve(snapshots.size());
   for (const auto &snapshot : snapshots) {
-    processes.push_back(os::Process32::Revive(snapshot));
+    processes.push_back(os::Process32::Revive(snapshot,
+                                              FLAGS_reset_processes));
   }
   return processes;
 }
 
+// Returns a process group for the next testcase. If we're resetting
+// processes then the processes of the previous testcase are reset back to
+// their snapshots.
+static os::Process32Group GetProcess32Group(
+    const os::SnapshotGroup &snapshots) {
+  if (!FLAGS_reset_processes) {
+    return CreateProcess32Group(snapshots);
+  }
+  if (gProcessGroup.empty()) {
+    gProcessGroup = CreateProcess32Group(snapshots);
+  } else {
+    for (size_t i = 0; i < snapshots.size(); ++i) {
+      gProcessGroup[i]->Reset(snapshots[i]);
+    }
+  }
+  return gProcessGroup;
+}
+
+// Deletes the processes of a testcase, unless they will be reset and re-used.
+static void PutProcess32Group(const os::Process32Group &processes) {
+  if (!FLAGS_reset_processes) {
+    for (auto process : processes) {
+      delete process;
+    }
+  }
+}
+
 static bool IsCrash(const granary::os::Process32Group &processes) {
   for (auto process : processes) {
     if (granary::os::ProcessStatus::kError == process->status) {
@@ -132,8 +222,18 @@ static bool IsCrash(const granary::os::Process32Group &processes) {
   return false;
 }
 
+static bool IsHang(const granary::os::Process32Group &processes) {
+  for (auto process : processes) {
+    if (granary::os::ProcessStatus::kTimeout == process->status) {
+      return true;
+    }
+  }
+  return false;
+}
+
 static void PublishNewInput(std::string &&input,
                             bool is_crash,
+                            bool is_hang,
                             bool covered_new_code) {
   GRANARY_ASSERT(!FLAGS_output_dir.empty());
 
@@ -155,6 +255,9 @@ static void PublishNewInput(std::string &&input,
   if (is_crash) {
     temp_path << "crash." << getpid();
     final_path << "crash.";
+  } else if (is_hang) {
+    temp_path << "hang." << getpid();
+    final_path << "hang.";
   } else {
     temp_path << "input." << getpid();
     final_path << "input.";
@@ -172,7 +275,7 @@ static void PublishNewInput(std::string &&input,
 
   // Name the file in terms of its code coverage, and the input byte index
   // after which new code coverage was first detected.
-  if (!is_crash && covered_new_code) {
+  if (!is_crash && !is_hang && covered_new_code) {
     final_path << "cov." << code::PathCoverageHash();
 
     // Number of paths covered.
@@ -210,7 +313,7 @@ static void PublishNewInput(std::string &&input,
 
 // Runs a testcase, and return `true` if we should continue running.
 static bool RunTestCase(const granary::os::SnapshotGroup &snapshot_group) {
-  auto process_group = CreateProcess32Group(snapshot_group);
+  auto process_group = GetProcess32Group(snapshot_group);
 
   // Record the individual syscalls executed.
   auto first_execution = !gRecordToMutate;
@@ -220,13 +323,22 @@ static bool RunTestCase(const granary::os::SnapshotGroup &snapshot_group) {
   input::gRecord = new input::IORecording;
   gInputIndex = 0;
 
+  code::ResetExecBudget();
+  os::SetNumSystemCalls(0);
   code::BeginPathCoverage();
-  auto got_term_signal = os::Run(process_group);
-  code::EndPathCoverage();
+  auto got_term_signal = false;
+  if (FLAGS_fork_server) {
+    got_term_signal = os::RunInForkedChild(process_group);
+  } else {
+    os::ResumeFromCheckpoint(process_group);
+    got_term_signal = os::Run(process_group);
+    code::EndPathCoverage();
+  }
 
   std::string output;
 
   const auto is_crash = IsCrash(process_group);
+  const auto is_hang = FLAGS_publish_hangs && IsHang(process_group);
   const auto covered_new_code = code::CoveredNewPaths();
   if (publishing) {
 
@@ -242,7 +354,7 @@ static bool RunTestCase(const granary::os::SnapshotGroup &snapshot_group) {
         gTotalInputBytes += gInput.size();
         gTotalInputBytesRead += input::gRecord->num_input_bytes;
       }
-      if (!first_execution && (is_crash || covered_new_code)) {
+      if (!first_execution && (is_crash || is_hang || covered_new_code)) {
         output = input::gRecord->ToInput();
       }
 
@@ -259,7 +371,7 @@ static bool RunTestCase(const granary::os::SnapshotGroup &snapshot_group) {
     }
 
     if (!output.empty()) {
-      PublishNewInput(std::move(output), is_crash, covered_new_code);
+      PublishNewInput(std::move(output), is_crash, is_hang, covered_new_code);
     }
   }
 
@@ -292,9 +404,7 @@ static bool RunTestCase(const granary::os::SnapshotGroup &snapshot_group) {
     gRecordToMutate = nullptr;
   }
 
-  for (auto process : process_group) {
-    delete process;
-  }
+  PutProcess32Group(process_group);
 
   // If we weren't signaled, then we can keep going.
   return !got_term_signal;
@@ -324,6 +434,22 @@ extern "C" int main(int argc, char **argv, char **) {
     return EXIT_FAILURE;
   }
 
+  if (FLAGS_fork_server) {
+    if (!FLAGS_persist) {
+      std::cerr << "The fork server requires --persist." << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    // Block execution counts are private to each child, and are lost when it
+    // exits.
+    if (!FLAGS_profile_file.empty() || !FLAGS_block_report_file.empty()) {
+      std::cerr << "The fork server can't be used with --profile_file or "
+                << "--block_report_file." << std::endl;
+      return EXIT_FAILURE;
+    }
+    FLAGS_shared_cache = true;
+  }
+
   if (FLAGS_persist) {
     if (FLAGS_persist_dir.empty()) {
       FLAGS_persist_dir = FLAGS_snapshot_dir;
@@ -352,6 +478,12 @@ extern "C" int main(int argc, char **argv, char **) {
     return EXIT_FAILURE;
   }
 
+  if ("path" != FLAGS_coverage_mode && "edge_bitmap" != FLAGS_coverage_mode) {
+    std::cerr << "Invalid --coverage_mode: " << FLAGS_coverage_mode
+              << "; must be `path` or `edge_bitmap`." << std::endl;
+    return EXIT_FAILURE;
+  }
+
   // Make sure we have a place to output snapshots, as well as a special
   // temporary directory for collecting snapshots before we move them into
   // the main directory.
@@ -395,10 +527,13 @@ extern "C" int main(int argc, char **argv, char **) {
   auto snapshot_group = CreateSnapshotGroup();
 
   code::InitBranchTracer();
+  code::InitBlockProfiler();
   code::InitPathCoverage();
+  code::InitExecBudget();
+  index::Init(IndexFeatures());  // Might finish replacing a compacted cache.
   arch::Init();
-  index::Init();
   cache::Init();
+  arch::LinkPersistedPatchPoints();
 
   // Start by running the individual testcase. This acts as the normal replayer.
   // If branch coverage is enabled, then this also establishes the "base case"
@@ -463,15 +598,23 @@ extern "C" int main(int argc, char **argv, char **) {
     input::gRecord = nullptr;
   }
 
+  os::ExitCheckpoints();
+  for (auto process : gProcessGroup) {
+    delete process;
+  }
+  gProcessGroup.clear();
+
   for (auto snapshot : snapshot_group) {
     delete snapshot;
   }
 
   arch::Exit();
+  cache::Exit();  // Commits to the index journal.
   index::Exit();
-  cache::Exit();
   code::ExitPathCoverage();
   code::ExitBranchTracer();
+  code::ExitBlockProfiler();
+  PrintTraceStats();
 
   if (FLAGS_print_num_mutations) {
     std::cout << gNumMutations << " " << gTotalInputBytes << " "